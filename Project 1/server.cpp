@@ -1,18 +1,29 @@
 #include <arpa/inet.h>
+#include <atomic>
 #include <csignal>
 #include <fcntl.h>
 #include <iostream>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <thread>
 #include <unistd.h>
 
 #define TIMEOUT 15
 #define BUF_LEN 1024
+#define LOCAL_NAME "cs118-project1."
 
 void handle_connection(int, int, std::string);
+void serve_local(int, std::string);
+void handle_local_connection(int, int, std::string);
+void answer_local(int, int, char);
 void handle_signal(int signal);
 
+// Connection ids are shared by TCP and same-host connections
+std::atomic<int> connection_id(1);
+
 int main(int argc, char* argv[]) {
 
 	// Initiating signal handlers
@@ -79,8 +90,26 @@ int main(int argc, char* argv[]) {
 		exit(1);
 	}
 
+	// Listening for clients on the same host, which hand over their file
+	// instead of sending it, on an abstract UNIX socket named after the port
+	int localfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	struct sockaddr_un local_addr;
+	memset(&local_addr, 0, sizeof(local_addr));
+	local_addr.sun_family = AF_UNIX;
+	std::string local_name = LOCAL_NAME + std::to_string(server_port);
+	memcpy(local_addr.sun_path + 1, local_name.c_str(), local_name.size());
+	socklen_t local_len = offsetof(struct sockaddr_un, sun_path) + 1 + local_name.size();
+	if (localfd == -1 || bind(localfd, (struct sockaddr*)&local_addr, local_len) == -1 || listen(localfd, 256) == -1) {
+		std::cerr << "WARNING: Same-host path unavailable\n";
+		if (localfd != -1) {
+			close(localfd);
+		}
+	} else {
+		std::thread t(serve_local, localfd, directory_string);
+		t.detach();
+	}
+
 	// Accepting new connections, creating a thread for each accepted connection
-	int connection_id = 1;
 	int newsockfd;
 	struct sockaddr_in clientAddr;
 	socklen_t clientAddrSize = sizeof(clientAddr);
@@ -214,6 +243,100 @@ void handle_connection(int sock, int connection_id, std::string directory) {
 	fclose(f);
 }
 
+void serve_local(int sockfd, std::string directory) {
+
+	// Accepting same-host connections, creating a thread for each like for TCP
+	int newsockfd;
+	while ((newsockfd = accept(sockfd, NULL, NULL)) != -1) {
+		std::thread t(handle_local_connection, newsockfd, connection_id++, directory);
+		t.detach();
+	}
+	perror("ERROR");
+}
+
+void handle_local_connection(int sock, int connection_id, std::string directory) {
+
+	// Receiving the client's file descriptor, waiting at most TIMEOUT seconds
+	struct timeval tv;
+	tv.tv_sec = TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char request;
+	struct iovec iov;
+	iov.iov_base = &request;
+	iov.iov_len = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		std::cerr << "ERROR: Invalid same-host request\n";
+		close(sock);
+		return;
+	}
+	int in;
+	memcpy(&in, CMSG_DATA(cmsg), sizeof(int));
+
+	// Only a regular file can be copied; anything else is refused
+	struct stat in_stat;
+	if (fstat(in, &in_stat) == -1 || !S_ISREG(in_stat.st_mode)) {
+		std::cerr << "ERROR: Same-host request is not a regular file\n";
+		answer_local(sock, in, 0);
+		return;
+	}
+
+	// If the directory does not exist, create it
+	struct stat buffer;
+	if (stat (directory.c_str(), &buffer) == -1) {
+		if (mkdir(directory.c_str(), 0777) == -1) {
+			perror("ERROR");
+			answer_local(sock, in, 0);
+			return;
+		}
+	}
+
+	// Copying the file in the kernel, from its start whatever the client read
+	std::string file_path = directory + std::to_string(connection_id) + ".file";
+	int out = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out == -1) {
+		perror("ERROR");
+		answer_local(sock, in, 0);
+		return;
+	}
+	off_t offset = 0;
+	ssize_t copied;
+	while ((copied = sendfile(out, in, &offset, 1 << 30)) > 0) {
+	}
+
+	// If the copy failed, the file holds ERROR like that of a failed TCP transfer
+	if (copied == -1) {
+		perror("ERROR");
+		char error_buf[] = {'E', 'R', 'R', 'O', 'R'};
+		if (ftruncate(out, 0) == -1 || pwrite(out, error_buf, sizeof(error_buf), 0) == -1) {
+			perror("ERROR");
+		}
+		close(out);
+		answer_local(sock, in, 0);
+		return;
+	}
+
+	// Telling the client that the file has been received
+	close(out);
+	answer_local(sock, in, 1);
+}
+
+// Answering a same-host request, 1 if the file was received and 0 if not, and
+// closing its descriptors; the server goes on either way
+void answer_local(int sock, int in, char answer) {
+	send(sock, &answer, 1, MSG_NOSIGNAL);
+	close(in);
+	close(sock);
+}
+
 void handle_signal(int signal) {
 	exit(0);
 }
@@ -0,0 +1,55 @@
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+// Counts every heap allocation made through operator new, so the packet path
+// can be checked for allocations. This replaces the global operator new and
+// delete, so it must be included by exactly one source file of a program.
+
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+std::atomic<unsigned long> heap_allocs(0);
+
+// Heap allocations made so far by this process
+inline unsigned long heap_allocations()
+{
+  return heap_allocs.load(std::memory_order_relaxed);
+}
+
+__attribute__((noinline)) void* operator new(size_t n)
+{
+  heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(n ? n : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept
+{
+  free(p);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Sweeps loss x RTT x file size through lossyproxy on loopback and prints one
+# CSV row per run: completion time (until the client sends its FIN), goodput,
+# and the share of data segments that were retransmissions.
+#
+# usage: ./benchmark.sh [-l "LOSSES"] [-r "RTTS-MS"] [-s "SIZES"] [-n RUNS]
+#                       [-c "CLIENT-OPTIONS"] [-p "PROXY-OPTIONS"] > out.csv
+#
+# Run `make` first. Losses are probabilities, the RTT is split evenly between
+# the two directions, and extra proxy options (jitter, Gilbert-Elliott loss,
+# bandwidth cap, ...) apply to every run.
+
+LOSSES="0 0.01 0.05 0.1"
+RTTS="0 20 100"
+SIZES="100000 1000000"
+RUNS=1
+CLIENT_OPTS=""
+PROXY_OPTS=""
+while getopts "l:r:s:n:c:p:" opt; do
+  case $opt in
+    l) LOSSES="$OPTARG" ;;
+    r) RTTS="$OPTARG" ;;
+    s) SIZES="$OPTARG" ;;
+    n) RUNS="$OPTARG" ;;
+    c) CLIENT_OPTS="$OPTARG" ;;
+    p) PROXY_OPTS="$OPTARG" ;;
+    *) sed -n '6,7p' "$0" >&2; exit 1 ;;
+  esac
+done
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+for bin in server client lossyproxy logdecode; do
+  if [ ! -x "$DIR/$bin" ]; then
+    echo "ERROR: $bin not built, run make" >&2
+    exit 1
+  fi
+done
+
+WORK=$(mktemp -d)
+trap 'kill $SERVER_PID $PROXY_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+SERVER_PORT=$((20000 + RANDOM % 10000))
+PROXY_PORT=$((SERVER_PORT + 10000))
+
+# The server takes its directory relative to where it runs
+cd "$WORK"
+"$DIR/server" "$SERVER_PORT" out > /dev/null 2>&1 &
+SERVER_PID=$!
+
+echo "loss,rtt_ms,size,run,ok,seconds,goodput_mbps,data_segments,retransmits,retransmit_ratio"
+for size in $SIZES; do
+  head -c "$size" /dev/urandom > "$WORK/in"
+  for loss in $LOSSES; do
+    for rtt in $RTTS; do
+      delay=$(awk "BEGIN { print $rtt / 2 }")
+      for run in $(seq 1 "$RUNS"); do
+        "$DIR/lossyproxy" -s "$run" -d "$delay" -l "$loss" $PROXY_OPTS \
+          "$PROXY_PORT" 127.0.0.1 "$SERVER_PORT" 2> /dev/null &
+        PROXY_PID=$!
+        sleep 0.1
+
+        rm -rf "$WORK/out"/*
+        "$DIR/client" -L "$WORK/client.log" $CLIENT_OPTS 127.0.0.1 \
+          "$PROXY_PORT" "$WORK/in" > /dev/null 2>&1
+        kill $PROXY_PID 2>/dev/null
+        wait $PROXY_PID 2>/dev/null
+
+        ok=0
+        if cmp -s "$WORK/in" "$WORK"/out/*.file; then
+          ok=1
+        fi
+        "$DIR/logdecode" -t "$WORK/client.log" | awk -v size="$size" \
+          -v prefix="$loss,$rtt,$size,$run,$ok" '
+          $2 == "SEND" && $NF == "FIN" && !done { secs = $1; done = 1 }
+          $2 == "SEND" && $8 != "ACK" && $8 != "SYN" && $8 != "FIN" &&
+            !done { data++; if ($NF == "DUP") dup++ }
+          END {
+            if (!done) secs = 0
+            goodput = secs > 0 ? size * 8 / secs / 1e6 : 0
+            ratio = data > 0 ? dup / data : 0
+            printf "%s,%.6f,%.3f,%d,%d,%.4f\n", prefix, secs, goodput,
+              data, dup, ratio
+          }'
+      done
+    done
+  done
+done
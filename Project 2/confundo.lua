@@ -4,8 +4,40 @@ local f_seqno  = ProtoField.uint32("confundo.seqno",        "Sequence Number")
 local f_ack    = ProtoField.uint32("confundo.ack",          "ACK Number")
 local f_id     = ProtoField.uint16("confundo.connectionId", "Connection ID")
 local f_flags  = ProtoField.uint16("confundo.flags",        "Flags")
+local f_optlen = ProtoField.uint8("confundo.options",       "Options Length")
+local f_wscale = ProtoField.uint8("confundo.wscale",        "Window Scale")
+local f_mss    = ProtoField.uint16("confundo.mss",          "Maximum Segment Size")
+local f_ackfreq = ProtoField.uint8("confundo.ackfreq",      "ACK Frequency")
+local f_rcvbuf = ProtoField.uint32("confundo.rcvbuf",       "Receive Buffer")
+local f_window = ProtoField.uint32("confundo.window",       "Receive Window")
+local f_fecblock = ProtoField.uint8("confundo.fecblock",    "FEC Block")
+local f_block  = ProtoField.uint32("confundo.block",        "Block Start")
+local f_blockend = ProtoField.uint32("confundo.blockend",   "Block End")
+local f_token  = ProtoField.uint64("confundo.token",        "Resumption Token")
+local f_early  = ProtoField.uint32("confundo.early",        "Early Data Accepted")
+local f_crc    = ProtoField.uint32("confundo.crc",          "CRC32C", base.HEX)
+local f_filecrc = ProtoField.uint32("confundo.filecrc",     "File CRC32C", base.HEX)
+local f_laddr  = ProtoField.ipv4("confundo.localaddr",      "Local Client Address")
+local f_lport  = ProtoField.uint16("confundo.localport",    "Local Client Port")
+local f_ltag   = ProtoField.uint64("confundo.localtag",     "Local Tag", base.HEX)
+local f_lpath  = ProtoField.string("confundo.localpath",    "Local Rendezvous")
 
-confundo.fields = { f_seqno, f_ack, f_id, f_flags }
+confundo.fields = { f_seqno, f_ack, f_id, f_flags, f_optlen, f_wscale, f_mss, f_ackfreq,
+                    f_rcvbuf, f_window, f_fecblock, f_block, f_blockend,
+                    f_token, f_early, f_crc, f_filecrc, f_laddr, f_lport,
+                    f_ltag, f_lpath }
+
+-- Option kinds carried in SYN/SYN-ACK payloads when the OPT flag is set
+local OPT_WSCALE = 1
+local OPT_MSS = 2
+local OPT_ACKFREQ = 3
+local OPT_RCVBUF = 4
+local OPT_FEC = 5
+local OPT_STREAMS = 6
+local OPT_TOKEN = 7
+local OPT_EARLY = 8
+local OPT_CRC = 9
+local OPT_LOCAL = 10
 
 function confundo.dissector(tvb, pInfo, root) -- Tvb, Pinfo, TreeItem
    if (tvb:len() ~= tvb:reported_len()) then
@@ -19,6 +51,14 @@ function confundo.dissector(tvb, pInfo, root) -- Tvb, Pinfo, TreeItem
    local f = t:add(f_flags, tvb(10,2))
 
    local flag = tvb(11,1):uint()
+   local flag_hi = tvb(10,1):uint()
+
+   -- With the CRC flag, the last 4 bytes are a CRC32C of the rest of the
+   -- datagram, not payload
+   local size = tvb:len()
+   if bit.band(flag_hi, 2) ~= 0 and size >= 16 then
+      size = size - 4
+   end
 
    if bit.band(flag, 1) ~= 0 then
       f:add(tvb(11,1), "FIN")
@@ -29,6 +69,95 @@ function confundo.dissector(tvb, pInfo, root) -- Tvb, Pinfo, TreeItem
    if bit.band(flag, 4) ~= 0 then
       f:add(tvb(11,1), "ACK")
    end
+
+   -- Length byte, then (kind, length, value) options. A window scale option
+   -- means the connection uses 32-bit serial sequence numbers instead of
+   -- wrapping at 102400.
+   if bit.band(flag, 8) ~= 0 and size > 12 then
+      f:add(tvb(11,1), "OPT")
+      local optlen = tvb(12,1):uint()
+      local o = t:add(f_optlen, tvb(12,1))
+      local i = 13
+      while i + 2 <= 13 + optlen and i + 2 <= size do
+         local kind = tvb(i,1):uint()
+         local len = tvb(i+1,1):uint()
+         if len < 2 or i + len > size then
+            break
+         end
+         if kind == OPT_WSCALE and len == 3 then
+            o:add(f_wscale, tvb(i+2,1))
+         elseif kind == OPT_MSS and len == 4 then
+            o:add(f_mss, tvb(i+2,2))
+         elseif kind == OPT_ACKFREQ and len == 3 then
+            o:add(f_ackfreq, tvb(i+2,1))
+         elseif kind == OPT_RCVBUF and len == 6 then
+            o:add(f_rcvbuf, tvb(i+2,4))
+         elseif kind == OPT_FEC and len == 3 then
+            o:add(f_fecblock, tvb(i+2,1))
+         elseif kind == OPT_STREAMS and len == 2 then
+            o:add(tvb(i,2), "Streams")
+         elseif kind == OPT_TOKEN and len == 10 then
+            o:add(f_token, tvb(i+2,8))
+         elseif kind == OPT_EARLY and len == 6 then
+            o:add(f_early, tvb(i+2,4))
+         elseif kind == OPT_CRC and len == 2 then
+            o:add(tvb(i,2), "CRC")
+         elseif kind == OPT_LOCAL and len == 2 then
+            o:add(tvb(i,2), "Same-Host Path")
+         elseif kind == OPT_LOCAL and len > 16 then
+            -- The server's offer: the client as it sees it, a tag and the
+            -- path of its rendezvous socket
+            o:add(f_laddr, tvb(i+2,4))
+            o:add(f_lport, tvb(i+6,2))
+            o:add(f_ltag, tvb(i+8,8))
+            o:add(f_lpath, tvb(i+16,len-16))
+         end
+         i = i + len
+      end
+      -- A SYN may carry the first segment after its options
+      if bit.band(flag, 2) ~= 0 and 13 + optlen < size then
+         t:add(tvb(13 + optlen, size - 13 - optlen), "Early Data (" .. (size - 13 - optlen) .. " bytes)")
+      end
+   end
+
+   -- Path MTU probe: padding only. The probe's ACK echoes the probe's
+   -- payload size in its sequence number.
+   if bit.band(flag, 16) ~= 0 then
+      f:add(tvb(11,1), "PRB")
+   end
+
+   -- Last segment before the sender waits: ACK it without delay
+   if bit.band(flag, 32) ~= 0 then
+      f:add(tvb(11,1), "IMM")
+   end
+
+   -- ACK followed by the bytes past the ACK number the server can take
+   if bit.band(flag, 64) ~= 0 and size >= 16 then
+      f:add(tvb(11,1), "WND")
+      t:add(f_window, tvb(12,4))
+   end
+
+   -- Forward error correction: a data segment carries its block's first
+   -- sequence number in the ACK field, and the parity segment (PAR, in the
+   -- high byte of the flags) the block's end
+   if bit.band(flag, 128) ~= 0 then
+      f:add(tvb(11,1), "FEC")
+      if bit.band(flag_hi, 1) ~= 0 then
+         f:add(tvb(10,1), "PAR")
+         t:add(f_blockend, tvb(4,4))
+      else
+         t:add(f_block, tvb(4,4))
+      end
+   end
+
+   -- A FIN with CRCs carries the CRC of the whole file in the ACK field
+   if size < tvb:len() then
+      f:add(tvb(10,1), "CRC")
+      t:add(f_crc, tvb(size,4))
+      if bit.band(flag, 1) ~= 0 and bit.band(flag, 4) == 0 then
+         t:add(f_filecrc, tvb(4,4))
+      end
+   end
   
    pInfo.cols.protocol = "Confundo"
 end
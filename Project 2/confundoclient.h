@@ -0,0 +1,625 @@
+#ifndef CONFUNDOCLIENT_H
+#define CONFUNDOCLIENT_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "netenv.h"
+#include "filesource.h"
+#include "sender.h"
+#include "resumption.h"
+
+#define CLIENT_RECV_BATCH 64  // datagrams read per wakeup before timers run
+#define CLIENT_RCVBUF (4 << 20)  // socket receive buffer, bytes
+#define CLIENT_EVENTS 16         // epoll events handled per wakeup
+
+using namespace std;
+
+// What a client asks for in its SYN; see ConfundoSender
+struct UploadOptions
+{
+  int wscale;
+  int mss;
+  int ackfreq;
+  bool flow;
+  int fecblock;
+  bool crc;
+  bool local;  // hand the file over through shared memory if the server
+               // is on this host (localpath.h)
+
+  UploadOptions() : wscale(-1), mss(0), ackfreq(0), flow(false), fecblock(0),
+    crc(false), local(false) {}
+};
+
+// Any number of concurrent Confundo uploads over one non-blocking UDP
+// socket, driven by an epoll loop. Each upload is a ConfundoSender; the
+// client only routes datagrams and timers to it.
+//
+// Replies are routed by connId and server address. Before the server has
+// assigned a connId, the SYN-ACK is routed by its ACK number: every upload
+// gets its own initial sequence number, so the ACK of its SYN names it.
+//
+// With a ResumeCache set, every upload asks its server for a token and
+// picks up from what the cache knows about the server, and every upload
+// that completes updates the cache.
+//
+// Deadlines sit in a heap with at most a few entries per upload: a sender
+// whose deadline moves later keeps its entry, which is put back at the new
+// time when it comes up. The epoll descriptor (fd()) can be added to
+// another epoll set, so the client can run inside an application's loop,
+// with poll(0) called whenever it becomes readable and by next_deadline().
+//
+// Nothing in the loop blocks. A same-host handoff (localpath.h) copies the
+// file into shared memory on a thread of its own, one per handoff, which
+// reports through an eventfd in the epoll set; the server's answer is then
+// read from the rendezvous connection, also in the set, while the other
+// uploads go on.
+class ConfundoClient
+{
+  public:
+    ConfundoClient() : sockfd(-1), epfd(-1), evfd(-1), sock(-1), log(NULL),
+      series(NULL), cache(NULL), next_isn(CLNT_DEFAULT_SEQ), running(0) {}
+
+    ~ConfundoClient()
+    {
+      for (size_t i = 0; i < uploads.size(); i++)
+      {
+        if (uploads[i]->copier.joinable())
+        {
+          uploads[i]->copier.join();  // it reads the file
+        }
+        if (uploads[i]->copied >= 0)
+        {
+          close(uploads[i]->copied);
+        }
+        close_handoff(*uploads[i]);
+        release(*uploads[i]);
+        delete uploads[i];
+      }
+      if (epfd >= 0)
+      {
+        close(epfd);
+      }
+      if (evfd >= 0)
+      {
+        close(evfd);
+      }
+      if (sockfd >= 0)
+      {
+        close(sockfd);
+      }
+    }
+
+    // Open the socket; false if it or the epoll instance cannot be created
+    bool open()
+    {
+      sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+      epfd = epoll_create1(0);
+      evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (sockfd < 0 || epfd < 0 || evfd < 0)
+      {
+        return false;
+      }
+      // Every upload's ACKs queue up here
+      int rcvbuf = CLIENT_RCVBUF;
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+      if (!watch(sockfd, EV_SOCKET, EPOLL_CTL_ADD) ||
+        !watch(evfd, EV_COPIED, EPOLL_CTL_ADD))
+      {
+        return false;
+      }
+      sock = UdpSocket(sockfd);
+      return true;
+    }
+
+    // Packets of every upload started from now on are logged to log, and
+    // the cwnd of the first one recorded in series
+    void set_log(EventLog* event_log)
+    {
+      log = event_log;
+    }
+
+    void set_series(CwndSeries* cwnd_series)
+    {
+      series = cwnd_series;
+    }
+
+    // Uploads started from now on resume from, and update, resume_cache
+    void set_cache(ResumeCache* resume_cache)
+    {
+      cache = resume_cache;
+    }
+
+    // Start sending size bytes at data to server; they must stay valid
+    // until the upload has finished. Returns the id of the upload.
+    int upload(const sockaddr_in& server, const char* data, long size,
+      const UploadOptions& opts = UploadOptions())
+    {
+      int id = prepare(server, data, size, opts);
+      begin(id);
+      return id;
+    }
+
+    // Start sending a file, which is mapped for the length of the upload;
+    // -1 if it cannot be read
+    int upload_file(const sockaddr_in& server, const char* path,
+      const UploadOptions& opts = UploadOptions())
+    {
+      FileSource m;
+      if (!map_file(path, m))
+      {
+        return -1;
+      }
+      int id = upload(server, m.data(), m.size, opts);
+      uploads[id]->maps.push_back(m);
+      return id;
+    }
+
+    // Start sending several files over one connection, each as a stream
+    // (streams.h) that the server writes to a file of its own; -1 if one of
+    // them cannot be read. The server must support streams.
+    int upload_files(const sockaddr_in& server, const vector<const char*>& paths,
+      const UploadOptions& opts = UploadOptions())
+    {
+      if (paths.empty() || paths.size() > MAXSTREAMS)
+      {
+        return -1;
+      }
+      vector<FileSource> maps;
+      for (size_t i = 0; i < paths.size(); i++)
+      {
+        FileSource m;
+        if (!map_file(paths[i], m))
+        {
+          for (size_t j = 0; j < maps.size(); j++)
+          {
+            unmap_file(maps[j]);
+          }
+          return -1;
+        }
+        maps.push_back(m);
+      }
+      int id = prepare(server, NULL, 0, opts);
+      for (size_t i = 0; i < maps.size(); i++)
+      {
+        uploads[id]->sender.add_stream(maps[i].data(), maps[i].size);
+      }
+      uploads[id]->maps = maps;
+      begin(id);
+      return id;
+    }
+
+    // Called with the id of each upload as it finishes, successfully or not
+    void on_finish(function<void(int)> callback)
+    {
+      finished = callback;
+    }
+
+    int fd() const
+    {
+      return epfd;
+    }
+
+    // Uploads started, and those not finished yet
+    size_t size() const
+    {
+      return uploads.size();
+    }
+
+    size_t active() const
+    {
+      return running;
+    }
+
+    ConfundoSender& sender(int id)
+    {
+      return uploads[id]->sender;
+    }
+
+    const ConnStats& stats(int id) const
+    {
+      return uploads[id]->stats;
+    }
+
+    // When the earliest timer is due, or 0 if none is pending
+    int64_t next_deadline() const
+    {
+      return timers.empty() ? 0 : timers.top().first;
+    }
+
+    // Wait up to timeout_ms for datagrams, or until the next timer if that
+    // comes first (-1: no other limit), then handle the datagrams, same-host
+    // handoffs and every timer that is due. An error from epoll other than
+    // EINTR ends the program, as it would the client's own loop.
+    void poll(int timeout_ms = -1)
+    {
+      int64_t due = next_deadline();
+      if (due)
+      {
+        int wait = (int) max((int64_t) 0, due - clock.now_ms());
+        timeout_ms = timeout_ms < 0 ? wait : min(timeout_ms, wait);
+      }
+      struct epoll_event evs[CLIENT_EVENTS];
+      int n = epoll_wait(epfd, evs, CLIENT_EVENTS, timeout_ms);
+      if (n < 0 && errno != EINTR)
+      {
+        cerr << "ERROR: Could not poll socket" << endl;
+        exit(1);
+      }
+      for (int i = 0; i < n; i++)
+      {
+        if (evs[i].data.u64 == EV_SOCKET)
+        {
+          receive();
+        }
+        else if (evs[i].data.u64 == EV_COPIED)
+        {
+          copied();
+        }
+        else
+        {
+          answered(evs[i].data.u64 - EV_ANSWER);
+        }
+      }
+      expire(clock.now_ms());
+    }
+
+    // Run until every upload has finished
+    void run()
+    {
+      while (running)
+      {
+        poll();
+      }
+    }
+
+  private:
+    // What an epoll event is for: the UDP socket, the eventfd of finished
+    // copies, or from EV_ANSWER on the rendezvous connection of an upload
+    enum
+    {
+      EV_SOCKET,
+      EV_COPIED,
+      EV_ANSWER
+    };
+
+    struct Upload
+    {
+      ConnStats stats;
+      ConfundoSender sender;
+      sockaddr_in server;
+      vector<FileSource> maps;  // the files, for uploads of mapped files
+      int64_t timer;    // time of the upload's entry in the heap, 0 if none
+      bool done;
+
+      // A same-host handoff: the job, the thread copying it and what it
+      // returned, and the connection the answer comes on
+      LocalJob job;
+      thread copier;
+      int copied;
+      int rendezvous;
+
+      Upload(Clock& clock, PacketSocket& sock, const sockaddr_in& server,
+        const char* data, long size, const UploadOptions& o) :
+        sender(clock, sock, server, data, size, stats, o.wscale, o.mss,
+        o.ackfreq, o.flow, o.fecblock, o.crc,
+        o.local && is_local_address(server.sin_addr)), server(server), timer(0),
+        done(false), copied(-1), rendezvous(-1) {}
+    };
+
+    typedef pair<int64_t, int> Timer;
+
+    int sockfd;
+    int epfd;
+    int evfd;
+    SystemClock clock;
+    UdpSocket sock;
+    EventLog* log;
+    CwndSeries* series;
+    ResumeCache* cache;
+    vector<Upload*> uploads;
+    unordered_map<unsigned int, int> handshakes;  // by the ACK of the SYN
+    unordered_map<uint64_t, int> conns;           // by server and connId
+    priority_queue<Timer, vector<Timer>, greater<Timer> > timers;
+    unsigned int next_isn;
+    size_t running;
+    function<void(int)> finished;
+    mutex copies_lock;
+    vector<int> copies_done;  // uploads whose copier has returned
+
+    int prepare(const sockaddr_in& server, const char* data, long size,
+      const UploadOptions& opts)
+    {
+      int id = uploads.size();
+      Upload* u = new Upload(clock, sock, server, data, size, opts);
+      uploads.push_back(u);
+      u->sender.set_log(log);
+      if (series && !id)
+      {
+        u->sender.set_series(series);
+      }
+      if (cache)
+      {
+        const ResumeState* known = cache->find(server);
+        u->sender.resume(known ? *known : ResumeState());
+      }
+      return id;
+    }
+
+    // Send the SYN of an upload, with an ISN no other handshake is using
+    void begin(int id)
+    {
+      Upload* u = uploads[id];
+
+      // An ISN below MAXSEQACKNUM never wraps, in either sequence space
+      while (handshakes.count(next_isn + 1))
+      {
+        next_isn = next_isn % (MAXSEQACKNUM - 1) + 1;
+      }
+      u->sender.set_isn(next_isn);
+      handshakes[next_isn + 1] = id;
+      next_isn = next_isn % (MAXSEQACKNUM - 1) + 1;
+      running++;
+      u->sender.start();
+      schedule(id);
+    }
+
+    static uint64_t key(const sockaddr_in& addr, short int connId)
+    {
+      return ((uint64_t) addr.sin_addr.s_addr << 32) |
+        ((uint64_t) addr.sin_port << 16) | (uint16_t) connId;
+    }
+
+    // Read what has arrived, a batch at a time
+    void receive()
+    {
+      char buf[MAXBUF];
+      for (int i = 0; i < CLIENT_RECV_BATCH; i++)
+      {
+        sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(sockfd, buf, MAXBUF, 0, (struct sockaddr*) &from,
+          &from_len);
+        if (len < 0)
+        {
+          return;
+        }
+        dispatch(buf, len, from);
+      }
+    }
+
+    void dispatch(const char* buf, int len, const sockaddr_in& from)
+    {
+      if (len < (int) sizeof(UDPheader))
+      {
+        return;
+      }
+      const UDPpacket* pkt = reinterpret_cast<const UDPpacket*> (buf);
+      int id = -1;
+      if (pkt->isSyn() && pkt->isAck())
+      {
+        unordered_map<unsigned int, int>::iterator it =
+          handshakes.find(pkt->getAck());
+        if (it != handshakes.end() &&
+          uploads[it->second]->server.sin_addr.s_addr == from.sin_addr.s_addr &&
+          uploads[it->second]->server.sin_port == from.sin_port)
+        {
+          id = it->second;
+        }
+      }
+      else
+      {
+        unordered_map<uint64_t, int>::iterator it =
+          conns.find(key(from, pkt->getconnID()));
+        if (it != conns.end())
+        {
+          id = it->second;
+        }
+      }
+      if (id < 0) // a late reply, or a SYN-ACK to a duplicate SYN
+      {
+        if (log)
+        {
+          log->record(LOG_DROP, pkt->getSeq(), pkt->getAck(),
+            pkt->getconnID(), 0, 0, (pkt->isAck() ? LOG_ACK : 0) |
+            (pkt->isSyn() ? LOG_SYN : 0) | (pkt->isFin() ? LOG_FIN : 0));
+        }
+        return;
+      }
+      Upload& u = *uploads[id];
+      ConfundoSender::State before = u.sender.state();
+      u.sender.on_datagram(buf, len);
+      update(id, before);
+    }
+
+    // Run the timers that are due
+    void expire(int64_t now)
+    {
+      while (!timers.empty() && timers.top().first <= now)
+      {
+        Timer t = timers.top();
+        timers.pop();
+        Upload& u = *uploads[t.second];
+        if (u.done || t.first != u.timer)  // superseded by an earlier entry
+        {
+          continue;
+        }
+        u.timer = 0;
+        ConfundoSender::State before = u.sender.state();
+        u.sender.on_timer();
+        update(t.second, before);
+      }
+    }
+
+    // Routes and timers of an upload after its sender has run
+    void update(int id, ConfundoSender::State before)
+    {
+      Upload& u = *uploads[id];
+      ConfundoSender::State st = u.sender.state();
+      if (before == ConfundoSender::SYN_SENT && st != before)
+      {
+        handshakes.erase(u.sender.initial_seq() + 1);
+        if (st != ConfundoSender::FAILED)
+        {
+          conns[key(u.server, u.sender.conn_id())] = id;
+        }
+      }
+      if (u.sender.handoff_wanted())
+      {
+        hand_off(id);
+      }
+      if (u.sender.finished())
+      {
+        ResumeState learned;
+        if (cache && st == ConfundoSender::DONE &&
+          u.sender.resume_state(learned))
+        {
+          cache->store(u.server, learned);
+        }
+        handshakes.erase(u.sender.initial_seq() + 1);
+        conns.erase(key(u.server, u.sender.conn_id()));
+        close_handoff(u);
+        release(u);
+        u.done = true;
+        running--;
+        if (finished)
+        {
+          finished(id);
+        }
+        return;
+      }
+      schedule(id);
+    }
+
+    // Make sure the heap has an entry for the upload by its deadline
+    void schedule(int id)
+    {
+      Upload& u = *uploads[id];
+      int64_t d = u.sender.deadline();
+      if (!u.timer || d < u.timer)
+      {
+        u.timer = d;
+        timers.push(Timer(d, id));
+      }
+    }
+
+    bool watch(int fd, uint64_t what, int op)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = what;
+      return epoll_ctl(epfd, op, fd, &ev) == 0;
+    }
+
+    // Copy and send an upload's same-host handoff on a thread of its own,
+    // which reports through the eventfd when it is done
+    void hand_off(int id)
+    {
+      Upload* u = uploads[id];
+      if (!u->sender.take_handoff(u->job))
+      {
+        return;
+      }
+      u->copier = thread([this, u, id]()
+      {
+        int fd = local_handoff_send(u->job);
+        {
+          lock_guard<mutex> lock(copies_lock);
+          u->copied = fd;
+          copies_done.push_back(id);
+        }
+        uint64_t one = 1;
+        if (write(evfd, &one, sizeof(one)) < 0)
+        {
+          // the eventfd is already readable
+        }
+      });
+    }
+
+    // Uploads whose handoff has been sent, or could not be: wait for the
+    // answer, or go on over UDP
+    void copied()
+    {
+      uint64_t count;
+      if (read(evfd, &count, sizeof(count)) < 0)
+      {
+        // read by an earlier wakeup
+      }
+      vector<int> done;
+      {
+        lock_guard<mutex> lock(copies_lock);
+        done.swap(copies_done);
+      }
+      for (size_t i = 0; i < done.size(); i++)
+      {
+        Upload& u = *uploads[done[i]];
+        u.copier.join();
+        int fd = u.copied;
+        u.copied = -1;
+        if (fd >= 0 && !watch(fd, EV_ANSWER + done[i], EPOLL_CTL_ADD))
+        {
+          close(fd);  // the request went out, but its answer cannot be read
+          ConfundoSender::State before = u.sender.state();
+          u.sender.handoff_sent(true);
+          u.sender.handoff_answer(LOCAL_FAILED);
+          update(done[i], before);
+          continue;
+        }
+        u.rendezvous = fd;
+        ConfundoSender::State before = u.sender.state();
+        u.sender.handoff_sent(fd >= 0);
+        update(done[i], before);
+      }
+    }
+
+    // The rendezvous connection of upload id is readable
+    void answered(int id)
+    {
+      Upload& u = *uploads[id];
+      if (u.rendezvous < 0)
+      {
+        return;
+      }
+      LocalResult r = local_answer(u.rendezvous);
+      if (r == LOCAL_PENDING)
+      {
+        return;
+      }
+      close_handoff(u);
+      ConfundoSender::State before = u.sender.state();
+      u.sender.handoff_answer(r);
+      update(id, before);
+    }
+
+    void close_handoff(Upload& u)
+    {
+      if (u.rendezvous >= 0)
+      {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, u.rendezvous, NULL);
+        close(u.rendezvous);
+        u.rendezvous = -1;
+      }
+    }
+
+    void release(Upload& u)
+    {
+      for (size_t i = 0; i < u.maps.size(); i++)
+      {
+        unmap_file(u.maps[i]);
+      }
+      u.maps.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,601 @@
+#include <unistd.h>
+#include <bits/stdc++.h>
+#include "netenv.h"
+#include "sender.h"
+#include "receiver.h"
+#include "linkmodel.h"
+
+#define SIM_SERVER_ADDR 0x0a000001  // 10.0.0.1, the clients follow it
+#define SIM_PORT 5000
+#define SIM_EXPIRE_US 1000000       // how often the server sweeps idle clients
+#define SIM_MAX_SECONDS 3600        // default virtual time a run may take
+#define SIM_MAX_EVENTS 50000000     // events a run may take, whatever the time
+
+using namespace std;
+
+// A deterministic discrete-event simulator for Confundo. The client and
+// server state machines (ConfundoSender, ConfundoReceiver) run unchanged
+// against a virtual clock, and every datagram crosses the emulated link of
+// linkmodel.h as an event, so nothing waits on real time: a transfer that
+// takes minutes over lossyproxy finishes in milliseconds. Runs are seeded,
+// so the same options and seed give the same results bit for bit.
+//
+// Each run transfers a random file from every client to one server and
+// prints a CSV row: whether every file arrived intact, the virtual time
+// until the last client sent its FIN, and how many segments the clients
+// sent and retransmitted. A run that is not over after the virtual time of
+// -t, or SIM_MAX_EVENTS events, is cut short and counts no client as ok, so
+// a livelock fails its run rather than hanging the batch.
+//
+// The server writes payloads to a simulated disk, shared by all clients, of
+// a given rate (-D): a connection's receive window only reopens as its data
+// drains to it, so a slow disk exercises flow control.
+
+class SimClock : public Clock
+{
+  public:
+    int64_t now_us = 0;
+
+    int64_t now_ms()
+    {
+      return now_us / 1000;
+    }
+};
+
+struct Event
+{
+  int64_t due;     // us
+  uint64_t order;  // keeps FIFO order among events due at the same time
+  int client;      // the client it concerns
+  enum { TO_SERVER, TO_CLIENT, TIMER, ACK_TIMER, EXPIRE, DISK } kind;
+  vector<char> data;
+  long bytes = 0;  // DISK: how many bytes of the client's upload were written
+
+  bool operator>(const Event& o) const
+  {
+    return due != o.due ? due > o.due : order > o.order;
+  }
+};
+
+class Simulation;
+
+// One end of the link: datagrams it sends become deliveries to the other end
+class SimSocket : public PacketSocket
+{
+  public:
+    SimSocket(Simulation& sim, Link& link, int client, bool to_server) :
+      sim(sim), link(link), client(client), to_server(to_server),
+      dont_fragment(false) {}
+
+    int send(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr);
+
+    void set_dont_fragment()
+    {
+      dont_fragment = true;
+    }
+
+  private:
+    Simulation& sim;
+    Link& link;
+    int client;
+    bool to_server;
+    bool dont_fragment;
+};
+
+struct SimOptions
+{
+  LinkParams link;
+  int clients = 1;
+  long file_size = 100000;
+  int mtu = 1500;         // larger datagrams are lost if they may not fragment
+  int wscale = -1;
+  int mss = 0;
+  int ackfreq = 0;
+  bool flow = false;
+  int fecblock = 0;
+  bool crc = false;
+  double disk_kbps = 0;   // 0 = writes complete at once
+  long backlog = COOKIE_BACKLOG;  // half-open connections before SYN cookies
+  double max_seconds = SIM_MAX_SECONDS;
+};
+
+struct SimClient
+{
+  vector<char> file;
+  ConnStats stats;
+  SimSocket* sock;
+  ConfundoSender* sender;
+  int64_t timer_at;   // us of the pending timer event, -1 if none
+  int64_t fin_at;     // us when the FIN went out, -1 until then
+  long stored;        // bytes the server handed to the disk
+  bool matches;       // and they are the file's
+  bool saved;
+  bool intact;
+};
+
+class Simulation : public FileSink
+{
+  public:
+    SimClock clock;
+    unsigned long events = 0;
+    unsigned long datagrams = 0;
+    unsigned long server_datagrams = 0;  // ACKs, mostly
+    bool cut_short = false;  // stopped at the time or event limit
+
+    Simulation(const SimOptions& opts, uint64_t seed, EventLog* log) :
+      opts(opts), rng(seed), up(opts.link, rng), down(opts.link, rng),
+      server_sock(*this, down, 0, false), cookies(seed, ~seed),
+      receiver(clock, server_sock, *this),
+      clients(opts.clients)
+    {
+      receiver.set_cookies(&cookies, opts.backlog);
+      // Every client sends its own random file
+      mt19937_64 file_rng(seed);
+      for (int i = 0; i < opts.clients; i++)
+      {
+        SimClient& c = clients[i];
+        c.file.resize(opts.file_size);
+        for (long j = 0; j < opts.file_size; j++)
+        {
+          c.file[j] = (char) file_rng();
+        }
+        c.sock = new SimSocket(*this, up, i, true);
+        c.sender = new ConfundoSender(clock, *c.sock, address(-1),
+          c.file.data(), opts.file_size, c.stats, opts.wscale, opts.mss,
+          opts.ackfreq, opts.flow, opts.fecblock, opts.crc);
+        c.sender->set_log(log);
+        c.timer_at = -1;
+        c.fin_at = -1;
+        c.stored = 0;
+        c.matches = true;
+        c.saved = false;
+        c.intact = false;
+      }
+    }
+
+    ~Simulation()
+    {
+      for (size_t i = 0; i < clients.size(); i++)
+      {
+        delete clients[i].sender;
+        delete clients[i].sock;
+      }
+    }
+
+    // Client i's address, or the server's for -1
+    static sockaddr_in address(int i)
+    {
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(SIM_PORT);
+      addr.sin_addr.s_addr = htonl(SIM_SERVER_ADDR + 1 + i);
+      return addr;
+    }
+
+    // Carry a datagram of len bytes over link, unless it is too large
+    void transmit(Link& link, int client, bool to_server, bool dont_fragment,
+      const UDPpacket* pkt, const char* payload, size_t len)
+    {
+      size_t size = sizeof(UDPheader) + len;
+      datagrams++;
+      if (!to_server)
+      {
+        server_datagrams++;
+      }
+      if (dont_fragment && size + 28 > (size_t) opts.mtu)  // IP + UDP headers
+      {
+        return;
+      }
+      int64_t due[2];
+      int copies = link.transmit(clock.now_us, size, due);
+      for (int i = 0; i < copies; i++)
+      {
+        Event e;
+        e.due = due[i];
+        e.client = client;
+        e.kind = to_server ? Event::TO_SERVER : Event::TO_CLIENT;
+        e.data.resize(size);
+        memcpy(e.data.data(), pkt, sizeof(UDPheader));
+        if (len)
+        {
+          memcpy(e.data.data() + sizeof(UDPheader), payload, len);
+        }
+        link.damage(e.data.data(), e.data.size());
+        push(e);
+      }
+    }
+
+    // Run until every client is done, or the run is over its limits
+    void run()
+    {
+      for (int i = 0; i < opts.clients; i++)
+      {
+        clients[i].sender->start();
+        schedule_timer(i);
+      }
+      Event expire;
+      expire.due = SIM_EXPIRE_US;
+      expire.client = -1;
+      expire.kind = Event::EXPIRE;
+      push(expire);
+
+      int running = opts.clients;
+      int64_t max_us = (int64_t) (opts.max_seconds * 1e6);
+      unsigned long max_events = events + SIM_MAX_EVENTS;
+      while (running > 0 && !queue.empty())
+      {
+        if (queue.top().due > max_us || events >= max_events)
+        {
+          cut_short = true;
+          return;
+        }
+        Event e = queue.top();
+        queue.pop();
+        clock.now_us = e.due;
+        events++;
+
+        if (e.kind == Event::EXPIRE)
+        {
+          receiver.expire(clock.now_ms(),
+            receiver.connections().capacity());
+          e.due += SIM_EXPIRE_US;
+          push(e);
+          continue;
+        }
+        if (e.kind == Event::ACK_TIMER)
+        {
+          ack_timer_at = -1;
+          receiver.send_delayed_acks(clock.now_ms());
+          schedule_ack_timer();
+          continue;
+        }
+        if (e.kind == Event::DISK)
+        {
+          receiver.written(address(e.client),
+            clients[e.client].stats.connId, e.bytes);
+          continue;
+        }
+        if (e.kind == Event::TO_SERVER)
+        {
+          if (e.data.size() >= sizeof(UDPheader))
+          {
+            receiver.handle((UDPpacket*) e.data.data(),
+              e.data.data() + sizeof(UDPheader),
+              e.data.size() - sizeof(UDPheader), address(e.client));
+            schedule_ack_timer();
+          }
+          continue;
+        }
+
+        SimClient& c = clients[e.client];
+        if (c.sender->finished())
+        {
+          continue;
+        }
+        if (e.kind == Event::TO_CLIENT)
+        {
+          c.sender->on_datagram(e.data.data(), e.data.size());
+        }
+        else if (e.due == c.timer_at)  // not superseded by a later deadline
+        {
+          c.timer_at = -1;
+          c.sender->on_timer();
+        }
+        if (c.fin_at < 0 && (c.sender->state() == ConfundoSender::FIN_SENT ||
+          c.sender->state() == ConfundoSender::DONE))
+        {
+          c.fin_at = clock.now_us;
+        }
+        if (c.sender->finished())
+        {
+          running--;
+        }
+        else
+        {
+          schedule_timer(e.client);
+        }
+      }
+    }
+
+    const vector<SimClient>& results() const
+    {
+      return clients;
+    }
+
+    // The server writes out part of an upload: check it against the file
+    // the client sent. On a rate-limited disk the bytes occupy the
+    // connection's buffer until the write completes.
+    void write(Connection& conn)
+    {
+      SimClient* c = client_of(conn);
+      if (c)
+      {
+        store(*c, conn);
+        if (opts.disk_kbps > 0)
+        {
+          conn.writing += conn.data.size();
+          disk_free = max(disk_free, clock.now_us) +
+            (int64_t) (conn.data.size() * 8 * 1000.0 / opts.disk_kbps);
+          Event e;
+          e.due = disk_free;
+          e.client = c - clients.data();
+          e.kind = Event::DISK;
+          e.bytes = conn.data.size();
+          push(e);
+        }
+      }
+      conn.data.clear();
+    }
+
+    // The server saves a finished (or aborted) upload
+    void finish(Connection& conn, bool aborted)
+    {
+      SimClient* c = client_of(conn);
+      if (!c)
+      {
+        return;
+      }
+      store(*c, conn);
+      c->saved = true;
+      c->intact = !aborted && c->matches &&
+        c->stored == (long) c->file.size();
+    }
+
+  private:
+    const SimOptions& opts;
+    mt19937_64 rng;
+    Link up, down;  // client -> server, server -> client
+    SimSocket server_sock;
+    SynCookies cookies;  // seeded, so runs repeat
+    ConfundoReceiver receiver;
+    vector<SimClient> clients;
+    priority_queue<Event, vector<Event>, greater<Event> > queue;
+    uint64_t next_order = 0;
+    int64_t ack_timer_at = -1;  // us of the pending ACK_TIMER event, -1 if none
+    int64_t disk_free = 0;      // us when the disk finishes its queued writes
+
+    void push(Event& e)
+    {
+      e.order = next_order++;
+      queue.push(move(e));
+    }
+
+    // Wake client i at its deadline, unless a timer is already pending then
+    void schedule_timer(int i)
+    {
+      SimClient& c = clients[i];
+      int64_t due = max(c.sender->deadline() * 1000, clock.now_us);
+      if (c.timer_at == due)
+      {
+        return;
+      }
+      c.timer_at = due;
+      Event e;
+      e.due = due;
+      e.client = i;
+      e.kind = Event::TIMER;
+      push(e);
+    }
+
+    // Wake the server when its earliest held-back ACK is due
+    void schedule_ack_timer()
+    {
+      int64_t due = receiver.next_ack_due() * 1000;
+      if (!due || (ack_timer_at >= 0 && ack_timer_at <= due))
+      {
+        return;
+      }
+      ack_timer_at = max(due, clock.now_us);
+      Event e;
+      e.due = ack_timer_at;
+      e.client = -1;
+      e.kind = Event::ACK_TIMER;
+      push(e);
+    }
+
+    // The client of a connection. A retransmitted SYN whose SYN-ACK the
+    // client never used opens a second connection, which only expires;
+    // that is not the upload.
+    SimClient* client_of(const Connection& conn)
+    {
+      int i = (int) (ntohl(conn.addr) - SIM_SERVER_ADDR - 1);
+      if (i < 0 || i >= opts.clients ||
+        clients[i].stats.connId != conn.connId)
+      {
+        return NULL;
+      }
+      return &clients[i];
+    }
+
+    // Compare the connection's buffered payload with the file at the
+    // offset reached so far
+    void store(SimClient& c, Connection& conn)
+    {
+      long n = conn.data.size();
+      if (c.stored + n > (long) c.file.size() || (n &&
+        memcmp(conn.data.data(), c.file.data() + c.stored, n) != 0))
+      {
+        c.matches = false;
+      }
+      c.stored += n;
+    }
+};
+
+int SimSocket::send(UDPpacket* pkt, const char* payload, size_t len,
+  const sockaddr_in& addr)
+{
+  int to = to_server ? client :
+    (int) (ntohl(addr.sin_addr.s_addr) - SIM_SERVER_ADDR - 1);
+  sim.transmit(link, to, to_server, dont_fragment, pkt, payload, len);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  SimOptions opts;
+  int runs = 1;
+  uint64_t seed = 1;
+  const char* log_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, LINK_OPTSTRING "n:s:c:f:m:W:M:K:FE:Ck:D:L:t:")) != -1)
+  {
+    if (parse_link_option(opt, optarg, opts.link))
+    {
+      continue;
+    }
+    if (opt == 'n')
+    {
+      runs = atoi(optarg);
+    }
+    else if (opt == 's')
+    {
+      seed = strtoull(optarg, NULL, 10);
+    }
+    else if (opt == 'c')
+    {
+      opts.clients = atoi(optarg);
+    }
+    else if (opt == 'f')
+    {
+      opts.file_size = atol(optarg);
+    }
+    else if (opt == 'm')
+    {
+      opts.mtu = atoi(optarg);
+    }
+    else if (opt == 'W')
+    {
+      opts.wscale = atoi(optarg);
+      if (opts.wscale < 0 || opts.wscale > MAXWSCALE)
+      {
+        cerr << "ERROR: Window scale must be between 0 and " << MAXWSCALE
+          << endl;
+        exit(1);
+      }
+    }
+    else if (opt == 'M')
+    {
+      opts.mss = atoi(optarg);
+      if (opts.mss < DATABUF || opts.mss > MAXMSS)
+      {
+        cerr << "ERROR: MSS must be between " << DATABUF << " and " << MAXMSS
+          << endl;
+        exit(1);
+      }
+    }
+    else if (opt == 'K')
+    {
+      opts.ackfreq = atoi(optarg);
+      if (opts.ackfreq < 1 || opts.ackfreq > MAXACKFREQ)
+      {
+        cerr << "ERROR: ACK frequency must be between 1 and " << MAXACKFREQ
+          << endl;
+        exit(1);
+      }
+    }
+    else if (opt == 'F')
+    {
+      opts.flow = true;
+    }
+    else if (opt == 'E')
+    {
+      opts.fecblock = atoi(optarg);
+      if (opts.fecblock < MINFECBLOCK || opts.fecblock > MAXFECBLOCK)
+      {
+        cerr << "ERROR: FEC block must be between " << MINFECBLOCK << " and "
+          << MAXFECBLOCK << endl;
+        exit(1);
+      }
+    }
+    else if (opt == 'C')
+    {
+      opts.crc = true;
+    }
+    else if (opt == 'k')
+    {
+      opts.backlog = atol(optarg);
+    }
+    else if (opt == 'D')
+    {
+      opts.disk_kbps = atof(optarg);
+    }
+    else if (opt == 'L')
+    {
+      log_path = optarg;
+    }
+    else if (opt == 't')
+    {
+      opts.max_seconds = atof(optarg);
+    }
+    else
+    {
+      cerr << "ERROR: usage: " << argv[0] << " [-n RUNS] [-s SEED]"
+        << " [-c CLIENTS] [-f FILE-SIZE] [-m MTU] [-W WSCALE] [-M MSS]"
+        << " [-K ACKS] [-F] [-E BLOCK] [-C] [-k BACKLOG] [-D DISK-KBIT/S]"
+        << " [-L LOGFILE] [-t MAX-SECONDS]"
+        << LINK_USAGE << endl;
+      exit(1);
+    }
+  }
+  if (runs < 1 || opts.clients < 1 || opts.clients > MAXCONNID ||
+    opts.file_size < 0 || opts.mtu < 1 || opts.backlog < 0 ||
+    opts.max_seconds <= 0)
+  {
+    cerr << "ERROR: Invalid simulation parameters" << endl;
+    exit(1);
+  }
+
+  // The clients' packets, as the client would log them
+  EventLog evlog;
+  if (log_path && !evlog.open(LOG_CLIENT, log_path))
+  {
+    cerr << "ERROR: Could not open log file" << endl;
+    exit(1);
+  }
+
+  cout << "run,seed,clients,size,ok,seconds,segments,retransmits,"
+    "retransmit_ratio,server_segments" << endl;
+  unsigned long events = 0, datagrams = 0;
+  auto start = chrono::steady_clock::now();
+  for (int run = 0; run < runs; run++)
+  {
+    Simulation sim(opts, seed + run, log_path ? &evlog : NULL);
+    sim.run();
+    events += sim.events;
+    datagrams += sim.datagrams;
+
+    int ok = 0;
+    int64_t last_fin = 0;
+    uint64_t segments = 0, retransmits = 0;
+    for (const SimClient& c : sim.results())
+    {
+      if (c.sender->state() == ConfundoSender::DONE && c.saved && c.intact &&
+        !sim.cut_short)
+      {
+        ok++;
+      }
+      last_fin = max(last_fin, c.fin_at);
+      segments += c.stats.segments_sent.load(memory_order_relaxed);
+      retransmits += c.stats.retransmits.load(memory_order_relaxed);
+    }
+    if (sim.cut_short)
+    {
+      cerr << "WARNING: run " << run + 1 << " (seed " << seed + run
+        << ") cut short at " << sim.clock.now_us / 1e6 << " s after "
+        << sim.events << " events" << endl;
+    }
+    printf("%d,%llu,%d,%ld,%d,%.6f,%llu,%llu,%.4f,%lu\n", run + 1,
+      (unsigned long long) (seed + run), opts.clients, opts.file_size, ok,
+      last_fin / 1e6, (unsigned long long) segments,
+      (unsigned long long) retransmits,
+      segments ? (double) retransmits / segments : 0.0,
+      sim.server_datagrams);
+  }
+  double wall = chrono::duration<double>(chrono::steady_clock::now() -
+    start).count();
+  cerr << "SIM: " << runs << " runs, " << datagrams << " datagrams, " << events
+    << " events in " << wall << " s (" << runs / wall << " runs/s)" << endl;
+  return 0;
+}
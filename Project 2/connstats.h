@@ -0,0 +1,489 @@
+#ifndef CONNSTATS_H
+#define CONNSTATS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "eventlog.h"
+
+#define RTT_BUCKETS 24     // bucket i counts RTTs below 2^i us, the last the rest
+#define CWND_SAMPLES 256   // most recent cwnd/ssthresh changes kept
+#define STATS_BACKLOG 16
+#define STATS_TIMEOUT 1000  // ms a query's read or write may block the server
+#define STATS_BACKOFF 100   // ms to wait after accept() fails
+
+using namespace std;
+
+// Congestion control phase of a sender
+enum CongPhase
+{
+  PHASE_SLOW_START = 0,
+  PHASE_AVOIDANCE,
+  PHASE_RECOVERY,
+  PHASES
+};
+
+enum StatsState
+{
+  STATS_UNUSED = 0,
+  STATS_OPEN,
+  STATS_CLOSED  // kept until the connId is handed out again
+};
+
+// Counters have a single writer, the thread that owns the connection, and
+// are read by the stats thread. A relaxed load and store instead of an
+// atomic increment keeps an update at the cost of a plain add.
+inline void stat_add(atomic<uint64_t>& c, uint64_t n = 1)
+{
+  c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Converts TSC ticks to nanoseconds, using the ticks that elapsed between
+// construction and the time of the call
+class TscClock
+{
+  public:
+    TscClock() : tsc0(log_tsc()), ns0(log_ns()) {}
+
+    double ticks_per_ns() const
+    {
+      uint64_t tsc = log_tsc();
+      int64_t ns = log_ns();
+      if (ns <= ns0 || tsc <= tsc0)
+      {
+        return 1.0;
+      }
+      return (double) (tsc - tsc0) / (ns - ns0);
+    }
+
+  private:
+    uint64_t tsc0;
+    int64_t ns0;
+};
+
+// The clock that all statistics convert TSC ticks with
+inline TscClock& tsc_clock()
+{
+  static TscClock clock;
+  return clock;
+}
+
+// Transport statistics of one connection
+struct ConnStats
+{
+  atomic<int> state;
+  atomic<int> connId;
+  atomic<uint64_t> bytes_sent;        // payload bytes
+  atomic<uint64_t> segments_sent;
+  atomic<uint64_t> bytes_received;
+  atomic<uint64_t> segments_received;
+  atomic<uint64_t> retransmits;       // segments sent (or seen) more than once
+  atomic<uint64_t> dup_acks;          // ACKs that acknowledged nothing new
+  atomic<uint64_t> repaired;          // segments rebuilt from parity
+  atomic<uint64_t> rtt_hist[RTT_BUCKETS];
+  atomic<uint64_t> rtt_sum_ns;
+  atomic<uint64_t> cwnd;
+  atomic<uint64_t> ssthresh;
+  atomic<int> phase;
+  atomic<uint64_t> phase_since;       // TSC when the current phase began
+  atomic<uint64_t> phase_ticks[PHASES];
+  uint64_t rtt_start;                 // owner only: TSC of the timed segment
+
+  ConnStats()
+  {
+    reset(0, 0);
+    state = STATS_UNUSED;
+  }
+
+  void reset(short int id, uint64_t now)
+  {
+    connId = id;
+    bytes_sent = segments_sent = bytes_received = segments_received = 0;
+    retransmits = dup_acks = repaired = 0;
+    for (int i = 0; i < RTT_BUCKETS; i++)
+    {
+      rtt_hist[i] = 0;
+    }
+    rtt_sum_ns = 0;
+    cwnd = ssthresh = 0;
+    phase = PHASE_SLOW_START;
+    phase_since = now;
+    for (int i = 0; i < PHASES; i++)
+    {
+      phase_ticks[i] = 0;
+    }
+    rtt_start = 0;
+    state = STATS_OPEN;
+  }
+
+  void add_rtt(uint64_t ns)
+  {
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (b < RTT_BUCKETS - 1 && us >= (1ULL << b))
+    {
+      b++;
+    }
+    stat_add(rtt_hist[b]);
+    stat_add(rtt_sum_ns, ns);
+  }
+
+  // Account the time spent in the phase that ends now
+  void set_phase(int p, uint64_t now)
+  {
+    int cur = phase.load(memory_order_relaxed);
+    if (p == cur)
+    {
+      return;
+    }
+    stat_add(phase_ticks[cur], now - phase_since.load(memory_order_relaxed));
+    phase_since.store(now, memory_order_relaxed);
+    phase.store(p, memory_order_relaxed);
+  }
+
+  // The connection is over: stop the phase clock
+  void close(uint64_t now)
+  {
+    int cur = phase.load(memory_order_relaxed);
+    stat_add(phase_ticks[cur], now - phase_since.load(memory_order_relaxed));
+    phase_since.store(now, memory_order_relaxed);
+    state = STATS_CLOSED;
+  }
+};
+
+// The most recent cwnd/ssthresh values of a sender, one sample per change
+class CwndSeries
+{
+  public:
+    CwndSeries() : count(0) {}
+
+    void add(uint64_t now, uint32_t cwnd, uint32_t ssthresh)
+    {
+      uint64_t n = count.load(memory_order_relaxed);
+      Sample& s = samples[n % CWND_SAMPLES];
+      s.tsc = now;
+      s.cwnd = cwnd;
+      s.ssthresh = ssthresh;
+      count.store(n + 1, memory_order_release);
+    }
+
+    struct Sample
+    {
+      uint64_t tsc;
+      uint32_t cwnd;
+      uint32_t ssthresh;
+    };
+
+    // Oldest first
+    vector<Sample> snapshot() const
+    {
+      uint64_t n = count.load(memory_order_acquire);
+      uint64_t first = n > CWND_SAMPLES ? n - CWND_SAMPLES : 0;
+      vector<Sample> out;
+      for (uint64_t i = first; i < n; i++)
+      {
+        out.push_back(samples[i % CWND_SAMPLES]);
+      }
+      return out;
+    }
+
+  private:
+    Sample samples[CWND_SAMPLES];
+    atomic<uint64_t> count;
+};
+
+inline void stats_printf(string& out, const char* fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+inline void stats_printf(string& out, const char* fmt, ...)
+{
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  out.append(buf, min(n, (int) sizeof(buf) - 1));
+}
+
+// Time spent in a phase so far, including the current stretch
+inline double phase_seconds(const ConnStats& s, int p, uint64_t now,
+  double ticks_per_ns)
+{
+  uint64_t ticks = s.phase_ticks[p].load(memory_order_relaxed);
+  if (s.state == STATS_OPEN && s.phase.load(memory_order_relaxed) == p)
+  {
+    ticks += now - s.phase_since.load(memory_order_relaxed);
+  }
+  return ticks / ticks_per_ns / 1e9;
+}
+
+// JSON document describing the given connections. Congestion control fields
+// are only included for senders, and the series only when given.
+inline void stats_json(string& out, const char* role,
+  const vector<const ConnStats*>& conns, bool sender,
+  const CwndSeries* series, const TscClock& clock, uint64_t start)
+{
+  static const char* phases[] = { "slow_start", "congestion_avoidance",
+    "recovery" };
+  double tpn = clock.ticks_per_ns();
+  uint64_t now = log_tsc();
+  stats_printf(out, "{\"role\":\"%s\",\"connections\":[", role);
+  for (size_t i = 0; i < conns.size(); i++)
+  {
+    const ConnStats& s = *conns[i];
+    stats_printf(out, "%s{\"connId\":%d,\"state\":\"%s\"", i ? "," : "",
+      s.connId.load(), s.state == STATS_OPEN ? "open" : "closed");
+    stats_printf(out, ",\"bytes_sent\":%llu,\"segments_sent\":%llu"
+      ",\"bytes_received\":%llu,\"segments_received\":%llu"
+      ",\"retransmits\":%llu,\"dup_acks\":%llu,\"repaired\":%llu",
+      (unsigned long long) s.bytes_sent, (unsigned long long) s.segments_sent,
+      (unsigned long long) s.bytes_received,
+      (unsigned long long) s.segments_received,
+      (unsigned long long) s.retransmits, (unsigned long long) s.dup_acks,
+      (unsigned long long) s.repaired);
+    out += ",\"rtt_us\":{\"buckets\":[";
+    for (int b = 0; b < RTT_BUCKETS; b++)
+    {
+      stats_printf(out, "%s%llu", b ? "," : "",
+        (unsigned long long) s.rtt_hist[b]);
+    }
+    stats_printf(out, "],\"sum\":%.3f}", s.rtt_sum_ns / 1000.0);
+    if (sender)
+    {
+      stats_printf(out, ",\"cwnd\":%llu,\"ssthresh\":%llu,\"phase\":\"%s\"",
+        (unsigned long long) s.cwnd, (unsigned long long) s.ssthresh,
+        phases[s.phase]);
+      out += ",\"phase_seconds\":{";
+      for (int p = 0; p < PHASES; p++)
+      {
+        stats_printf(out, "%s\"%s\":%.6f", p ? "," : "", phases[p],
+          phase_seconds(s, p, now, tpn));
+      }
+      out += "}";
+    }
+    if (series)
+    {
+      out += ",\"cwnd_series\":[";
+      vector<CwndSeries::Sample> samples = series->snapshot();
+      for (size_t j = 0; j < samples.size(); j++)
+      {
+        stats_printf(out, "%s[%.6f,%u,%u]", j ? "," : "",
+          ((int64_t) (samples[j].tsc - start)) / tpn / 1e9, samples[j].cwnd,
+          samples[j].ssthresh);
+      }
+      out += "]";
+    }
+    out += "}";
+  }
+  out += "]}\n";
+}
+
+// The same statistics in the Prometheus text exposition format
+inline void stats_prometheus(string& out, const char* role,
+  const vector<const ConnStats*>& conns, bool sender, const TscClock& clock)
+{
+  static const char* phases[] = { "slow_start", "congestion_avoidance",
+    "recovery" };
+  struct Counter
+  {
+    const char* name;
+    const char* help;
+    atomic<uint64_t> ConnStats::*field;
+  };
+  static const Counter counters[] = {
+    { "bytes_sent", "Payload bytes sent", &ConnStats::bytes_sent },
+    { "segments_sent", "Segments sent", &ConnStats::segments_sent },
+    { "bytes_received", "Payload bytes received", &ConnStats::bytes_received },
+    { "segments_received", "Segments received", &ConnStats::segments_received },
+    { "retransmits", "Segments sent or received more than once",
+      &ConnStats::retransmits },
+    { "dup_acks", "ACKs that acknowledged nothing new", &ConnStats::dup_acks },
+    { "repaired", "Segments rebuilt from parity", &ConnStats::repaired },
+  };
+  double tpn = clock.ticks_per_ns();
+  uint64_t now = log_tsc();
+
+  for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++)
+  {
+    stats_printf(out, "# HELP confundo_%s_total %s\n# TYPE confundo_%s_total "
+      "counter\n", counters[c].name, counters[c].help, counters[c].name);
+    for (size_t i = 0; i < conns.size(); i++)
+    {
+      stats_printf(out, "confundo_%s_total{role=\"%s\",conn=\"%d\"} %llu\n",
+        counters[c].name, role, conns[i]->connId.load(),
+        (unsigned long long) (conns[i]->*counters[c].field).load());
+    }
+  }
+
+  out += "# HELP confundo_rtt_seconds Round trip times\n"
+    "# TYPE confundo_rtt_seconds histogram\n";
+  for (size_t i = 0; i < conns.size(); i++)
+  {
+    const ConnStats& s = *conns[i];
+    uint64_t total = 0;
+    for (int b = 0; b < RTT_BUCKETS; b++)
+    {
+      total += s.rtt_hist[b];
+      if (b < RTT_BUCKETS - 1)
+      {
+        stats_printf(out, "confundo_rtt_seconds_bucket{role=\"%s\",conn=\"%d\","
+          "le=\"%g\"} %llu\n", role, s.connId.load(), (1ULL << b) / 1e6,
+          (unsigned long long) total);
+      }
+    }
+    stats_printf(out, "confundo_rtt_seconds_bucket{role=\"%s\",conn=\"%d\","
+      "le=\"+Inf\"} %llu\n", role, s.connId.load(), (unsigned long long) total);
+    stats_printf(out, "confundo_rtt_seconds_sum{role=\"%s\",conn=\"%d\"} %.9f\n",
+      role, s.connId.load(), s.rtt_sum_ns / 1e9);
+    stats_printf(out, "confundo_rtt_seconds_count{role=\"%s\",conn=\"%d\"} "
+      "%llu\n", role, s.connId.load(), (unsigned long long) total);
+  }
+
+  if (!sender)
+  {
+    return;
+  }
+  out += "# HELP confundo_cwnd_bytes Congestion window\n"
+    "# TYPE confundo_cwnd_bytes gauge\n";
+  for (size_t i = 0; i < conns.size(); i++)
+  {
+    stats_printf(out, "confundo_cwnd_bytes{role=\"%s\",conn=\"%d\"} %llu\n",
+      role, conns[i]->connId.load(), (unsigned long long) conns[i]->cwnd);
+  }
+  out += "# HELP confundo_ssthresh_bytes Slow start threshold\n"
+    "# TYPE confundo_ssthresh_bytes gauge\n";
+  for (size_t i = 0; i < conns.size(); i++)
+  {
+    stats_printf(out, "confundo_ssthresh_bytes{role=\"%s\",conn=\"%d\"} %llu\n",
+      role, conns[i]->connId.load(), (unsigned long long) conns[i]->ssthresh);
+  }
+  out += "# HELP confundo_phase_seconds_total Time spent in each congestion "
+    "control phase\n# TYPE confundo_phase_seconds_total counter\n";
+  for (size_t i = 0; i < conns.size(); i++)
+  {
+    for (int p = 0; p < PHASES; p++)
+    {
+      stats_printf(out, "confundo_phase_seconds_total{role=\"%s\",conn=\"%d\","
+        "phase=\"%s\"} %.6f\n", role, conns[i]->connId.load(), phases[p],
+        phase_seconds(*conns[i], p, now, tpn));
+    }
+  }
+}
+
+// Answers statistics queries on a UNIX stream socket from a background
+// thread. A client connects, writes a request line ("json" or
+// "prometheus"), and reads the reply until the server closes the
+// connection:
+//
+//     echo prometheus | nc -U /tmp/confundo.sock
+class StatsServer
+{
+  public:
+    typedef function<void(string& out, bool prometheus)> Render;
+
+    StatsServer() : fd(-1) {}
+
+    ~StatsServer()
+    {
+      if (fd >= 0)
+      {
+        unlink(path.c_str());
+      }
+    }
+
+    bool open(const char* socket_path, Render render_fn)
+    {
+      render = render_fn;
+      path = socket_path;
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path))
+      {
+        return false;
+      }
+      strcpy(addr.sun_path, path.c_str());
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+      {
+        return false;
+      }
+      unlink(path.c_str());
+      if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(fd, STATS_BACKLOG) == -1)
+      {
+        ::close(fd);
+        fd = -1;
+        return false;
+      }
+      thread(&StatsServer::serve, this).detach();
+      return true;
+    }
+
+  private:
+    int fd;
+    string path;
+    Render render;
+
+    void serve()
+    {
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+      string out;
+      while (true)
+      {
+        // Out of descriptors, say: try again later rather than spin
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0)
+        {
+          if (errno != EINTR)
+          {
+            this_thread::sleep_for(chrono::milliseconds(STATS_BACKOFF));
+          }
+          continue;
+        }
+
+        // One thread answers every query, so a client that sends nothing, or
+        // reads nothing, may only hold it up for a while
+        struct timeval tv;
+        tv.tv_sec = STATS_TIMEOUT / 1000;
+        tv.tv_usec = (STATS_TIMEOUT % 1000) * 1000;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[64];
+        ssize_t n = read(conn, req, sizeof(req) - 1);
+        req[n > 0 ? n : 0] = '\0';
+        out.clear();
+        render(out, strncmp(req, "prom", 4) == 0);
+        size_t sent = 0;
+        while (sent < out.size())
+        {
+          ssize_t w = send(conn, out.data() + sent, out.size() - sent,
+            MSG_NOSIGNAL);
+          if (w <= 0)
+          {
+            break;
+          }
+          sent += w;
+        }
+        ::close(conn);
+      }
+    }
+};
+
+#endif
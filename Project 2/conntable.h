@@ -0,0 +1,540 @@
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "udpfunctions.h"
+
+#define MAXCONNID 32767           // connId travels as a signed short
+#define CONN_IDLE_TIMEOUT 10000   // ms without packets before a client is aborted
+#define CONN_FIN_TIMEOUT 2000     // ms to wait for the ACK of our FIN
+#define CONN_TABLE_MIN 64
+#define CONN_SWEEP_BUDGET 8       // slots inspected per received packet
+#define CONN_ACK_DELAY 20         // ms an ACK may be held back to cover more segments
+#define CONN_RCVBUF 262144        // payload bytes a connection may hold before they are on disk
+#define CONN_FLUSH 65536          // buffered bytes that are handed over to be written
+
+using namespace std;
+
+enum ConnState
+{
+  CONN_EMPTY = 0,
+  CONN_SYN_RCVD,
+  CONN_ESTABLISHED,
+  CONN_FIN_RCVD
+};
+
+// Growable byte buffer whose spare capacity can be handed to recvmsg, so a
+// payload can be received straight into place and then committed
+class ByteBuffer
+{
+  public:
+    ByteBuffer() : buf(NULL), len(0), cap(0) {}
+
+    ~ByteBuffer()
+    {
+      delete[] buf;
+    }
+
+    char* data()
+    {
+      return buf;
+    }
+
+    size_t size() const
+    {
+      return len;
+    }
+
+    bool empty() const
+    {
+      return len == 0;
+    }
+
+    // Pointer to the first byte past the contents, with room for n more
+    char* tail(size_t n)
+    {
+      if (cap - len < n)
+      {
+        reserve(max(len + n, (size_t) cap * 2));
+      }
+      return buf + len;
+    }
+
+    // The first byte past the contents, where an in-place receive would land
+    const char* end() const
+    {
+      return buf + len;
+    }
+
+    // Append n bytes already written at tail()
+    void commit(size_t n)
+    {
+      len += n;
+    }
+
+    void append(const char* p, size_t n)
+    {
+      memcpy(tail(n), p, n);
+      len += n;
+    }
+
+    void assign(const char* p, size_t n)
+    {
+      len = 0;
+      append(p, n);
+    }
+
+    // Drop the contents but keep the memory
+    void clear()
+    {
+      len = 0;
+    }
+
+    void swap(ByteBuffer& other)
+    {
+      std::swap(buf, other.buf);
+      std::swap(len, other.len);
+      std::swap(cap, other.cap);
+    }
+
+    // Drop the contents and give the memory back
+    void release()
+    {
+      delete[] buf;
+      buf = NULL;
+      len = cap = 0;
+    }
+
+  private:
+    char* buf;
+    uint32_t len;  // 32 bits keep a connection slot within one cache line
+    uint32_t cap;
+
+    void reserve(size_t n)
+    {
+      char* p = new char[n];
+      if (len)
+      {
+        memcpy(p, buf, len);
+      }
+      delete[] buf;
+      buf = p;
+      cap = n;
+    }
+};
+
+// Per-connection state, one slot of the table. The lookup key and the fields
+// touched on every packet come first, and each slot is a single cache line.
+struct alignas(64) Connection
+{
+  uint32_t addr;          // client address, network order
+  uint16_t port;          // client port, network order
+  short int connId;
+  uint8_t state;
+  bool saved;             // payload already written to <connId>.file
+  uint8_t ack_every;      // segments per ACK; 1 unless negotiated
+  uint8_t unacked;        // segments received since the last ACK
+  unsigned int expected;  // next in-order sequence number
+  bool wide;              // 32-bit sequence numbers (window scaling negotiated)
+  uint8_t wscale;
+  uint16_t mss;           // largest segment payload the client may send
+  bool gap;               // segments were lost since the last in-order one
+  int64_t last_active;
+  ByteBuffer data;        // in-order payload not yet handed to be written
+  int64_t ack_due;        // when a held-back ACK must go out, 0 if none
+  uint32_t writing;       // bytes handed to be written but not on disk yet
+  bool flow;              // ACKs advertise the receive window
+  bool window_closed;     // the last ACK advertised less than a segment
+  bool streams;           // the payload is frames of several files (streams.h)
+  bool crc;               // packets carry a CRC32C trailer (crc32c.h)
+};
+
+static_assert(sizeof(Connection) == 64, "a connection slot is one cache line");
+
+// Open-addressing (linear probing) table of connections keyed by
+// (connId, client address, client port). Deletion uses backward shifting so
+// there are no tombstones, and connIds are handed out round-robin from a
+// bitmap so a freed id is only reused after every other id has been tried.
+// A table that is one of nshards owns exactly the connIds with
+// connId % nshards == shard.
+//
+// Pointers returned by find()/open() are valid until the next open()/release().
+class ConnTable
+{
+  public:
+    explicit ConnTable(int shard = 0, int nshards = 1) : slots(NULL), mask(0),
+      count(0), syn_rcvd(0), sweep_pos(0), shard(shard), nshards(nshards), last_id(shard),
+      idle_timeout(CONN_IDLE_TIMEOUT), ids((MAXCONNID + 64) / 64, 0)
+    {
+      rehash(CONN_TABLE_MIN);
+    }
+
+    ~ConnTable()
+    {
+      destroy(slots, mask + 1);
+    }
+
+    Connection* find(const sockaddr_in& addr, short int connId)
+    {
+      size_t i = home(addr.sin_addr.s_addr, addr.sin_port, connId);
+      while (slots[i].state != CONN_EMPTY)
+      {
+        if (slots[i].connId == connId && slots[i].port == addr.sin_port &&
+          slots[i].addr == addr.sin_addr.s_addr)
+        {
+          return &slots[i];
+        }
+        i = (i + 1) & mask;
+      }
+      return NULL;
+    }
+
+    // Assign a fresh connId to a new client; NULL when all ids are in use
+    Connection* open(const sockaddr_in& addr, int64_t now)
+    {
+      short int connId = alloc_id(true);
+      return connId ? place(addr, now, connId) : NULL;
+    }
+
+    // The connId open() would assign next, without taking it; 0 when all
+    // ids are in use. The next call moves on to the id after it, so clients
+    // handed ids this way before they have a connection get different ones
+    // until the ids wrap around.
+    short int next_id()
+    {
+      return alloc_id(false);
+    }
+
+    // Open a connection under a connId handed out by next_id(); NULL if the
+    // id has been taken since, or is not one of this table's
+    Connection* open(const sockaddr_in& addr, int64_t now, short int connId)
+    {
+      if (connId <= 0 || connId % nshards != shard || in_use(connId))
+      {
+        return NULL;
+      }
+      ids[connId / 64] |= 1ULL << (connId % 64);
+      return place(addr, now, connId);
+    }
+
+    // Remember the sequence number of the SYN that opened c, while c is
+    // half-open, so a copy of that SYN finds c instead of opening another
+    void opened_by(Connection* c, unsigned int isn)
+    {
+      syns.insert(make_pair(client_key(c->addr, c->port),
+        make_pair(c->connId, isn)));
+    }
+
+    // The half-open connection that addr opened with a SYN of sequence
+    // number isn; NULL if there is none
+    Connection* find_syn(const sockaddr_in& addr, unsigned int isn)
+    {
+      pair<SynMap::iterator, SynMap::iterator> range =
+        syns.equal_range(client_key(addr.sin_addr.s_addr, addr.sin_port));
+      for (SynMap::iterator it = range.first; it != range.second; ++it)
+      {
+        if (it->second.second == isn)
+        {
+          return find(addr, it->second.first);
+        }
+      }
+      return NULL;
+    }
+
+    // Move a connection to another state; states are changed through here
+    // so the table knows how many connections are half-open
+    void set_state(Connection* c, ConnState state)
+    {
+      if (c->state == CONN_SYN_RCVD && state != CONN_SYN_RCVD)
+      {
+        forget_syn(*c);
+      }
+      syn_rcvd += (state == CONN_SYN_RCVD) - (c->state == CONN_SYN_RCVD);
+      c->state = state;
+    }
+
+    // Drop the connection state and make its connId available again
+    void release(Connection* c)
+    {
+      free_id(c->connId);
+      count--;
+      if (c->state == CONN_SYN_RCVD)
+      {
+        forget_syn(*c);
+        syn_rcvd--;
+      }
+
+      // Backward-shift deletion: pull later members of the probe run into
+      // the hole so lookups never need tombstones
+      size_t i = c - slots;
+      size_t j = i;
+      while (true)
+      {
+        j = (j + 1) & mask;
+        if (slots[j].state == CONN_EMPTY)
+        {
+          break;
+        }
+        size_t k = home(slots[j].addr, slots[j].port, slots[j].connId);
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays)
+        {
+          move_slot(slots[i], slots[j]);
+          i = j;
+        }
+      }
+      slots[i].state = CONN_EMPTY;
+      slots[i].data.release();
+
+      if (mask + 1 > CONN_TABLE_MIN && count * 8 < mask + 1)
+      {
+        rehash((mask + 1) / 2);
+      }
+    }
+
+    // ms without packets before a connection is aborted (CONN_IDLE_TIMEOUT)
+    void set_idle_timeout(int64_t ms)
+    {
+      idle_timeout = ms;
+    }
+
+    // Inspect up to budget slots for connections that have been idle too
+    // long, calling on_expire(conn) before releasing each one
+    template <typename F>
+    void expire(int64_t now, size_t budget, F on_expire)
+    {
+      while (budget-- > 0 && count > 0)
+      {
+        sweep_pos &= mask;
+        Connection& c = slots[sweep_pos];
+        int64_t timeout = c.state == CONN_FIN_RCVD ? CONN_FIN_TIMEOUT
+          : idle_timeout;
+        if (c.state != CONN_EMPTY && now - c.last_active > timeout)
+        {
+          on_expire(c);
+          release(&c);  // may shift another entry into this slot; revisit it
+        }
+        else
+        {
+          sweep_pos++;
+        }
+      }
+    }
+
+    size_t size() const
+    {
+      return count;
+    }
+
+    size_t capacity() const
+    {
+      return mask + 1;
+    }
+
+    // Connections opened by a SYN that has not been answered yet
+    size_t half_open() const
+    {
+      return syn_rcvd;
+    }
+
+  private:
+    Connection* slots;
+    size_t mask;
+    size_t count;
+    size_t syn_rcvd;
+    size_t sweep_pos;
+    int shard;
+    int nshards;
+    int last_id;
+    int64_t idle_timeout;
+    vector<uint64_t> ids;  // bitmap of connIds in use
+    // (connId, SYN sequence number) of half-open connections, by client
+    typedef unordered_multimap<uint64_t, pair<short int, unsigned int> > SynMap;
+    SynMap syns;
+
+    static uint64_t client_key(uint32_t addr, uint16_t port)
+    {
+      return ((uint64_t) addr << 16) | port;
+    }
+
+    void forget_syn(const Connection& c)
+    {
+      pair<SynMap::iterator, SynMap::iterator> range =
+        syns.equal_range(client_key(c.addr, c.port));
+      for (SynMap::iterator it = range.first; it != range.second; ++it)
+      {
+        if (it->second.first == c.connId)
+        {
+          syns.erase(it);
+          return;
+        }
+      }
+    }
+
+    size_t home(uint32_t addr, uint16_t port, short int connId) const
+    {
+      uint64_t k = ((uint64_t) addr << 32) | ((uint64_t) port << 16) |
+        (uint16_t) connId;
+      k ^= k >> 33;
+      k *= 0xff51afd7ed558ccdULL;
+      k ^= k >> 33;
+      return k & mask;
+    }
+
+    static void move_slot(Connection& to, Connection& from)
+    {
+      to.addr = from.addr;
+      to.port = from.port;
+      to.connId = from.connId;
+      to.state = from.state;
+      to.saved = from.saved;
+      to.ack_every = from.ack_every;
+      to.unacked = from.unacked;
+      to.expected = from.expected;
+      to.wide = from.wide;
+      to.wscale = from.wscale;
+      to.mss = from.mss;
+      to.gap = from.gap;
+      to.last_active = from.last_active;
+      to.data.swap(from.data);
+      to.ack_due = from.ack_due;
+      to.writing = from.writing;
+      to.flow = from.flow;
+      to.window_closed = from.window_closed;
+      to.streams = from.streams;
+      to.crc = from.crc;
+      from.state = CONN_EMPTY;
+    }
+
+    static Connection* create(size_t n)
+    {
+      void* mem = NULL;
+      if (posix_memalign(&mem, alignof(Connection), n * sizeof(Connection)) != 0)
+      {
+        throw bad_alloc();
+      }
+      Connection* s = static_cast<Connection*>(mem);
+      for (size_t i = 0; i < n; i++)
+      {
+        new (&s[i]) Connection();
+        s[i].state = CONN_EMPTY;
+      }
+      return s;
+    }
+
+    static void destroy(Connection* s, size_t n)
+    {
+      if (!s)
+      {
+        return;
+      }
+      for (size_t i = 0; i < n; i++)
+      {
+        s[i].~Connection();
+      }
+      free(s);
+    }
+
+    void rehash(size_t n)
+    {
+      Connection* old = slots;
+      size_t old_n = old ? mask + 1 : 0;
+      slots = create(n);
+      mask = n - 1;
+      for (size_t i = 0; i < old_n; i++)
+      {
+        if (old[i].state == CONN_EMPTY)
+        {
+          continue;
+        }
+        size_t j = home(old[i].addr, old[i].port, old[i].connId);
+        while (slots[j].state != CONN_EMPTY)
+        {
+          j = (j + 1) & mask;
+        }
+        move_slot(slots[j], old[i]);
+      }
+      destroy(old, old_n);
+    }
+
+    // Put a new connection with a taken connId into the table
+    Connection* place(const sockaddr_in& addr, int64_t now, short int connId)
+    {
+      if ((count + 1) * 2 > mask + 1)
+      {
+        rehash((mask + 1) * 2);
+      }
+
+      size_t i = home(addr.sin_addr.s_addr, addr.sin_port, connId);
+      while (slots[i].state != CONN_EMPTY)
+      {
+        i = (i + 1) & mask;
+      }
+      Connection& c = slots[i];
+      c.addr = addr.sin_addr.s_addr;
+      c.port = addr.sin_port;
+      c.connId = connId;
+      c.state = CONN_SYN_RCVD;
+      syn_rcvd++;
+      c.saved = false;
+      c.ack_every = 1;
+      c.unacked = 0;
+      c.expected = 0;
+      c.wide = false;
+      c.wscale = 0;
+      c.mss = DATABUF;
+      c.gap = false;
+      c.last_active = now;
+      c.ack_due = 0;
+      c.writing = 0;
+      c.flow = false;
+      c.window_closed = false;
+      c.streams = false;
+      c.crc = false;
+      count++;
+      return &c;
+    }
+
+    // The next free connId round-robin, marked in use if take is set
+    short int alloc_id(bool take)
+    {
+      for (int n = 0; n <= MAXCONNID / nshards; n++)
+      {
+        int id = last_id + nshards;
+        if (id > MAXCONNID)
+        {
+          id = shard ? shard : nshards;
+        }
+        last_id = id;
+        if (!in_use(id))
+        {
+          if (take)
+          {
+            ids[id / 64] |= 1ULL << (id % 64);
+          }
+          return id;
+        }
+      }
+      return 0;
+    }
+
+    bool in_use(int id) const
+    {
+      return ids[id / 64] & (1ULL << (id % 64));
+    }
+
+    void free_id(short int id)
+    {
+      ids[id / 64] &= ~(1ULL << (id % 64));
+    }
+};
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "udpheader.h"
+
+#define CRC32C_POLY 0x82f63b78   // Castagnoli polynomial, bit-reflected
+#define CRC_TRAILER 4            // bytes of the checksum that ends a packet
+#define CRC32C_LONG 1024         // bytes per stream in the 3-way kernel
+#define CRC32C_SHORT 128         // and for what is left after the long blocks
+
+using namespace std;
+
+// CRC32C (the iSCSI checksum) in three kernels, picked once at run time:
+//
+// - slicing-by-8 tables, on any CPU
+// - the SSE4.2 crc32 instruction, 8 bytes at a time
+// - with PCLMULQDQ as well, three independent crc32 streams over adjacent
+//   blocks, which keeps the instruction's pipeline full, joined by shifting
+//   the first two CRCs past the blocks after them with a carry-less multiply
+//
+// The kernels work on the raw CRC register; crc32c() takes and returns
+// finished CRCs, so crc32c(crc32c(0, a, n), b, m) is the CRC of a then b.
+
+typedef uint32_t (*Crc32cKernel)(uint32_t crc, const uint8_t* p, size_t n);
+
+// Product of two polynomials mod the CRC polynomial, bit-reflected
+inline uint32_t crc32c_multmod(uint32_t a, uint32_t b)
+{
+  uint32_t m = 1u << 31, p = 0;
+  while (m)
+  {
+    if (a & m)
+    {
+      p ^= b;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+// x^n mod the CRC polynomial, bit-reflected
+inline uint32_t crc32c_xpow(uint64_t n)
+{
+  uint32_t p = 1u << 31;   // x^0
+  uint32_t sq = 1u << 30;  // x^1, squared at every bit of n
+  for (; n; n >>= 1)
+  {
+    if (n & 1)
+    {
+      p = crc32c_multmod(p, sq);
+    }
+    sq = crc32c_multmod(sq, sq);
+  }
+  return p;
+}
+
+struct Crc32cTables
+{
+  uint32_t t[8][256];
+
+  Crc32cTables()
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+      {
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      }
+      t[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+      for (int k = 1; k < 8; k++)
+      {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+inline const Crc32cTables& crc32c_tables()
+{
+  static const Crc32cTables tables;
+  return tables;
+}
+
+inline uint32_t crc32c_portable(uint32_t c, const uint8_t* p, size_t n)
+{
+  const Crc32cTables& k = crc32c_tables();
+  for (; n >= 8; p += 8, n -= 8)
+  {
+    uint32_t lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+    c = k.t[7][lo & 0xff] ^ k.t[6][(lo >> 8) & 0xff] ^
+      k.t[5][(lo >> 16) & 0xff] ^ k.t[4][lo >> 24] ^ k.t[3][p[4]] ^
+      k.t[2][p[5]] ^ k.t[1][p[6]] ^ k.t[0][p[7]];
+  }
+  while (n--)
+  {
+    c = (c >> 8) ^ k.t[0][(c ^ *p++) & 0xff];
+  }
+  return c;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t c, const uint8_t* p, size_t n)
+{
+  for (; n && ((uintptr_t) p & 7); n--)
+  {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  uint64_t c64 = c;
+  for (; n >= 8; p += 8, n -= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c64 = _mm_crc32_u64(c64, v);
+  }
+  c = (uint32_t) c64;
+  while (n--)
+  {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return c;
+}
+
+// Multipliers that shift a CRC past 1 and 2 blocks of each size:
+// x^(8 * bytes - 33), since the carry-less product of two reflected values
+// is one degree short and crc32 of the product multiplies it by x^32
+struct Crc32cShifts
+{
+  uint32_t long1, long2, short1, short2;
+
+  Crc32cShifts() : long1(crc32c_xpow(8 * CRC32C_LONG - 33)),
+    long2(crc32c_xpow(16 * CRC32C_LONG - 33)),
+    short1(crc32c_xpow(8 * CRC32C_SHORT - 33)),
+    short2(crc32c_xpow(16 * CRC32C_SHORT - 33)) {}
+};
+
+inline const Crc32cShifts& crc32c_shifts()
+{
+  static const Crc32cShifts shifts;
+  return shifts;
+}
+
+// CRCs of three adjacent blocks of size bytes, the first one continuing c,
+// joined into one
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_blocks(uint32_t c, const uint8_t* p, size_t size,
+  uint32_t shift1, uint32_t shift2)
+{
+  uint64_t a = c, b = 0, d = 0;
+  for (size_t i = 0; i < size; i += 8)
+  {
+    uint64_t va, vb, vd;
+    memcpy(&va, p + i, 8);
+    memcpy(&vb, p + size + i, 8);
+    memcpy(&vd, p + 2 * size + i, 8);
+    a = _mm_crc32_u64(a, va);
+    b = _mm_crc32_u64(b, vb);
+    d = _mm_crc32_u64(d, vd);
+  }
+  __m128i pa = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int) a),
+    _mm_cvtsi32_si128((int) shift2), 0);
+  __m128i pb = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int) b),
+    _mm_cvtsi32_si128((int) shift1), 0);
+  uint64_t shifted = _mm_cvtsi128_si64(_mm_xor_si128(pa, pb));
+  return (uint32_t) d ^ (uint32_t) _mm_crc32_u64(0, shifted);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_3way(uint32_t c, const uint8_t* p, size_t n)
+{
+  const Crc32cShifts& k = crc32c_shifts();
+  for (; n >= 3 * CRC32C_LONG; p += 3 * CRC32C_LONG, n -= 3 * CRC32C_LONG)
+  {
+    c = crc32c_blocks(c, p, CRC32C_LONG, k.long1, k.long2);
+  }
+  for (; n >= 3 * CRC32C_SHORT; p += 3 * CRC32C_SHORT, n -= 3 * CRC32C_SHORT)
+  {
+    c = crc32c_blocks(c, p, CRC32C_SHORT, k.short1, k.short2);
+  }
+  return crc32c_sse42(c, p, n);
+}
+
+#endif
+
+// The fastest kernel this CPU runs, and its name
+inline Crc32cKernel crc32c_kernel(const char** name = NULL)
+{
+  const char* which = "portable";
+  Crc32cKernel kernel = crc32c_portable;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    which = "sse4.2";
+    kernel = crc32c_sse42;
+    if (__builtin_cpu_supports("pclmul"))
+    {
+      which = "sse4.2+pclmul";
+      kernel = crc32c_3way;
+    }
+  }
+#endif
+  if (name)
+  {
+    *name = which;
+  }
+  return kernel;
+}
+
+inline uint32_t crc32c(uint32_t crc, const void* p, size_t n)
+{
+  static const Crc32cKernel kernel = crc32c_kernel();
+  return ~kernel(~crc, static_cast<const uint8_t*>(p), n);
+}
+
+// The CRC a packet's trailer carries: of its header, then its payload
+inline uint32_t packet_crc(const UDPpacket* pkt, const char* payload,
+  size_t len)
+{
+  return crc32c(crc32c(0, pkt, sizeof(UDPheader)), payload, len);
+}
+
+// Check the trailer at the end of the len bytes of payload of a packet
+// flagged CRC; if it matches, len drops to the payload before it
+inline bool check_crc(const UDPpacket* pkt, const char* payload, int& len)
+{
+  if (len < CRC_TRAILER)
+  {
+    return false;
+  }
+  uint32_t carried;
+  memcpy(&carried, payload + len - CRC_TRAILER, CRC_TRAILER);
+  if (ntohl(carried) != packet_crc(pkt, payload, len - CRC_TRAILER))
+  {
+    return false;
+  }
+  len -= CRC_TRAILER;
+  return true;
+}
+
+#endif
@@ -0,0 +1,552 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "conntable.h"
+#include "spscqueue.h"
+#include "streams.h"
+
+#define DISK_QUEUE 64    // chunks a worker may have queued for the disk thread
+#define DISK_BATCH 64    // writes submitted to the kernel at once
+#define DISK_MAP_CHUNK (8 << 20)  // bytes of a handed-over memfd per write
+
+using namespace std;
+
+// The server's disk thread. Workers never touch files: they pass payload
+// chunks through a lock-free queue, and the disk thread writes them and
+// reports back how many bytes are on disk, which is what reopens a
+// connection's receive window.
+
+enum DiskOp
+{
+  DISK_WRITE,   // append the chunk
+  DISK_FINISH,  // append the rest and close the file
+  DISK_ABORT    // replace the file with a single ERROR string and close it
+};
+
+// A chunk on its way to the disk. Slots are filled in place and their
+// buffers swapped with the connections', so buffers go round between the
+// worker and the disk thread instead of being allocated or copied.
+struct DiskJob
+{
+  int op;
+  bool streams;  // the chunk is frames of several files
+  short int connId;
+  sockaddr_in addr;
+  ByteBuffer data;
+  // A sealed memfd a client handed over (localpath.h), whose first fd_len
+  // bytes follow the chunk; -1 if none. The disk thread closes it.
+  int fd;
+  size_t fd_len;
+};
+
+// The bytes of a DISK_WRITE that are on disk
+struct DiskDone
+{
+  sockaddr_in addr;
+  short int connId;
+  size_t bytes;
+};
+
+// A worker's queues to and from the disk thread. evfd is the worker's, and
+// is signalled when something is done.
+struct DiskChannel
+{
+  SPSCQueue<DiskJob> jobs;
+  SPSCQueue<DiskDone> done;
+  int evfd;
+
+  explicit DiskChannel(int evfd) : jobs(DISK_QUEUE), done(DISK_QUEUE),
+    evfd(evfd) {}
+};
+
+// Just enough of io_uring to submit a batch of writes and wait for them,
+// through the raw system calls
+class IoUring
+{
+  public:
+    IoUring() : fd(-1), pending(0) {}
+
+    // False when the kernel does not offer io_uring
+    bool open(unsigned entries)
+    {
+      struct io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      fd = syscall(__NR_io_uring_setup, entries, &p);
+      if (fd < 0)
+      {
+        return false;
+      }
+      size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      size_t cq_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+      bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+      if (single)
+      {
+        sq_size = cq_size = max(sq_size, cq_size);
+      }
+      char* sq = (char*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      char* cq = single ? sq : (char*) mmap(NULL, cq_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_CQ_RING);
+      sqes = (struct io_uring_sqe*) mmap(NULL,
+        p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+      {
+        ::close(fd);
+        fd = -1;
+        return false;
+      }
+      sq_tail = (unsigned*) (sq + p.sq_off.tail);
+      sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+      sq_array = (unsigned*) (sq + p.sq_off.array);
+      cq_head = (unsigned*) (cq + p.cq_off.head);
+      cq_tail = (unsigned*) (cq + p.cq_off.tail);
+      cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+      cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+      return true;
+    }
+
+    // Queue a write of len bytes at offset off; at most the number of
+    // entries the ring was opened with may be queued before wait()
+    void write(int file, const char* buf, unsigned len, uint64_t off,
+      uint64_t tag)
+    {
+      unsigned tail = *sq_tail;
+      unsigned i = tail & sq_mask;
+      struct io_uring_sqe* sqe = &sqes[i];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = file;
+      sqe->addr = (uint64_t) (uintptr_t) buf;
+      sqe->len = len;
+      sqe->off = off;
+      sqe->user_data = tag;
+      sq_array[i] = i;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      pending++;
+    }
+
+    // Submit the queued writes and wait for all of them, calling
+    // done(tag, result) for each
+    template <typename F>
+    void wait(F done)
+    {
+      unsigned submit = pending;
+      while (pending)
+      {
+        int r = syscall(__NR_io_uring_enter, fd, submit, pending,
+          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR)
+        {
+          cerr<<"ERROR: io_uring_enter failed: "<<strerror(errno)<<endl;
+          exit(1);
+        }
+        if (r >= 0)
+        {
+          submit -= min((unsigned) r, submit);
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+          struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+          done(cqe->user_data, cqe->res);
+          pending--;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      }
+    }
+
+  private:
+    int fd;
+    unsigned pending;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+// Writes <connId>.file under a directory for every channel's jobs, or
+// <connId>.<stream>.file for each stream of a connection that carries
+// several. Each round takes up to DISK_BATCH jobs from a channel and submits
+// their writes together through io_uring, or with pwrite() where io_uring is
+// missing. Jobs of one connection come through one channel, in order, and a
+// file is closed only once all its writes are done.
+class DiskWriter
+{
+  public:
+    DiskWriter() : evfd(-1), uring(false)
+    {
+      for (int i = 0; i <= MAXCONNID; i++)
+      {
+        fds[i] = -1;
+        offsets[i] = 0;
+      }
+      writes.reserve(DISK_BATCH);
+    }
+
+    // Start the disk thread; false if it cannot be woken up
+    bool start(const string& dir, const vector<DiskChannel*>& chans)
+    {
+      directory = dir;
+      channels = chans;
+      evfd = eventfd(0, 0);
+      if (evfd < 0)
+      {
+        return false;
+      }
+      uring = ring.open(DISK_BATCH);
+      thread(&DiskWriter::run, this).detach();
+      return true;
+    }
+
+    bool using_io_uring() const
+    {
+      return uring;
+    }
+
+    // Wake the disk thread after queueing jobs
+    void notify()
+    {
+      uint64_t one = 1;
+      if (::write(evfd, &one, sizeof(one)) < 0)
+      {
+        cerr<<"ERROR: Could not wake the disk thread"<<endl;
+      }
+    }
+
+  private:
+    struct Write
+    {
+      int fd;
+      const char* p;
+      size_t n;
+      off_t off;
+    };
+
+    // A stream's file, open until its last frame is written
+    struct StreamFile
+    {
+      int stream;
+      int fd;
+      off_t off;
+    };
+
+    string directory;
+    vector<DiskChannel*> channels;
+    int evfd;
+    bool uring;
+    IoUring ring;
+    int fds[MAXCONNID + 1];
+    off_t offsets[MAXCONNID + 1];
+    StreamParser parsers[MAXCONNID + 1];
+    vector<StreamFile> open_streams[MAXCONNID + 1];
+    DiskJob* batch[DISK_BATCH];
+    vector<Write> writes;       // submitted to io_uring, not complete yet
+    vector<int> ended;          // files to close once the writes are done
+    vector<int> failed;         // files to replace with ERROR, likewise
+    vector<pair<void*, size_t> > mapped;  // memfds, to unmap likewise
+
+    void run()
+    {
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+      while (true)
+      {
+        uint64_t n;
+        if (read(evfd, &n, sizeof(n)) < 0 && errno != EINTR)
+        {
+          cerr<<"ERROR: Disk thread wakeup failed"<<endl;
+          exit(1);
+        }
+        bool busy = true;
+        while (busy)
+        {
+          busy = false;
+          for (size_t i = 0; i < channels.size(); i++)
+          {
+            busy |= drain(*channels[i]);
+          }
+        }
+      }
+    }
+
+    // One batch of a channel's jobs; false if there was none
+    bool drain(DiskChannel& chan)
+    {
+      int n = 0;
+      DiskJob* job;
+      while (n < DISK_BATCH && (job = chan.jobs.peek(n)))
+      {
+        batch[n++] = job;
+        if (job->streams)
+        {
+          split(*job);
+        }
+        else if (job->op != DISK_ABORT && !job->data.empty())
+        {
+          int fd = file(job->connId);
+          queue(fd, job->data.data(), job->data.size(),
+            offsets[job->connId]);
+          offsets[job->connId] += job->data.size();
+        }
+        if (job->fd >= 0)
+        {
+          queue_memfd(*job);
+        }
+      }
+      if (!n)
+      {
+        return false;
+      }
+      complete();
+
+      bool signal = false;
+      for (int i = 0; i < n; i++)
+      {
+        DiskJob* j = batch[i];
+        if (j->op == DISK_WRITE)
+        {
+          DiskDone* d;
+          while (!(d = chan.done.reserve()))
+          {
+            this_thread::yield();  // the worker is behind on completions
+          }
+          d->addr = j->addr;
+          d->connId = j->connId;
+          d->bytes = j->data.size();
+          chan.done.commit();
+          signal = true;
+        }
+        else if (!j->streams)
+        {
+          int fd = file(j->connId);
+          if (j->op == DISK_ABORT)
+          {
+            replace_with_error(fd);
+          }
+          ::close(fd);
+          fds[j->connId] = -1;
+          offsets[j->connId] = 0;
+        }
+        j->data.clear();
+        chan.jobs.consume();
+      }
+      if (signal)
+      {
+        uint64_t one = 1;
+        if (::write(chan.evfd, &one, sizeof(one)) < 0)
+        {
+          cerr<<"ERROR: Could not wake a worker"<<endl;
+        }
+      }
+      return true;
+    }
+
+    // Queue the writes of a chunk of frames. A stream's file is closed once
+    // its last frame is written; when the connection ends, streams that did
+    // not end get an ERROR file.
+    void split(DiskJob& job)
+    {
+      short int connId = job.connId;
+      vector<StreamFile>& open = open_streams[connId];
+      parsers[connId].feed(job.data.data(), job.data.size(),
+        [&](int stream, const char* p, size_t n) {
+          StreamFile& f = stream_file(connId, stream);
+          queue(f.fd, p, n, f.off);
+          f.off += n;
+        },
+        [&](int stream) {
+          StreamFile& f = stream_file(connId, stream);
+          ended.push_back(f.fd);
+          f = open.back();
+          open.pop_back();
+        });
+      if (job.op != DISK_WRITE)
+      {
+        for (size_t i = 0; i < open.size(); i++)
+        {
+          failed.push_back(open[i].fd);
+        }
+        open.clear();
+        parsers[connId].reset();
+      }
+    }
+
+    // Queue the writes of a memfd a client handed over, straight from a
+    // mapping of it, which stays until the writes are done
+    void queue_memfd(DiskJob& job)
+    {
+      int fd = file(job.connId);
+      if (job.fd_len)
+      {
+        void* map = mmap(NULL, job.fd_len, PROT_READ, MAP_SHARED, job.fd, 0);
+        if (map == MAP_FAILED)
+        {
+          cerr<<"ERROR: Could not map a handed-over file"<<endl;
+          exit(1);
+        }
+        for (size_t off = 0; off < job.fd_len; off += DISK_MAP_CHUNK)
+        {
+          queue(fd, (const char*) map + off, min(job.fd_len - off,
+            (size_t) DISK_MAP_CHUNK), offsets[job.connId] + off);
+        }
+        offsets[job.connId] += job.fd_len;
+        mapped.push_back(make_pair(map, job.fd_len));
+      }
+      ::close(job.fd);
+      job.fd = -1;
+    }
+
+    // Wait for the writes, then close the files that are done
+    void complete()
+    {
+      flush();
+      for (size_t i = 0; i < mapped.size(); i++)
+      {
+        munmap(mapped[i].first, mapped[i].second);
+      }
+      mapped.clear();
+      for (size_t i = 0; i < ended.size(); i++)
+      {
+        ::close(ended[i]);
+      }
+      for (size_t i = 0; i < failed.size(); i++)
+      {
+        replace_with_error(failed[i]);
+        ::close(failed[i]);
+      }
+      ended.clear();
+      failed.clear();
+    }
+
+    void queue(int fd, const char* p, size_t n, off_t off)
+    {
+      if (!uring)
+      {
+        write_at(fd, p, n, off);
+        return;
+      }
+      if (writes.size() == DISK_BATCH)
+      {
+        flush();
+      }
+      Write w = { fd, p, n, off };
+      ring.write(fd, p, n, off, writes.size());
+      writes.push_back(w);
+    }
+
+    void flush()
+    {
+      if (writes.empty())
+      {
+        return;
+      }
+      ring.wait([this](uint64_t i, int res) {
+        const Write& w = writes[i];
+        if (res < 0)
+        {
+          cerr<<"ERROR: Could not write file: "<<strerror(-res)<<endl;
+          exit(1);
+        }
+        if ((size_t) res < w.n) // short write, finish it here
+        {
+          write_at(w.fd, w.p + res, w.n - res, w.off + res);
+        }
+      });
+      writes.clear();
+    }
+
+    // The file of a connection, created on first use
+    int file(short int connId)
+    {
+      if (fds[connId] < 0)
+      {
+        fds[connId] = create(to_string(connId) + ".file");
+        offsets[connId] = 0;
+      }
+      return fds[connId];
+    }
+
+    StreamFile& stream_file(short int connId, int stream)
+    {
+      vector<StreamFile>& open = open_streams[connId];
+      for (size_t i = 0; i < open.size(); i++)
+      {
+        if (open[i].stream == stream)
+        {
+          return open[i];
+        }
+      }
+      StreamFile f = { stream,
+        create(to_string(connId) + "." + to_string(stream) + ".file"), 0 };
+      open.push_back(f);
+      return open.back();
+    }
+
+    int create(const string& name)
+    {
+      string file_path = directory + name;
+      int fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0)
+      {
+        cerr<<"ERROR: Could not open file"<<endl;
+        exit(1);
+      }
+      return fd;
+    }
+
+    void replace_with_error(int fd)
+    {
+      if (ftruncate(fd, 0) < 0)
+      {
+        cerr<<"ERROR: Could not truncate file"<<endl;
+        exit(1);
+      }
+      write_at(fd, "ERROR", 5, 0);
+    }
+
+    void write_at(int fd, const char* p, size_t n, off_t off)
+    {
+      while (n > 0)
+      {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (w <= 0)
+        {
+          cerr<<"ERROR: Could not write file"<<endl;
+          exit(1);
+        }
+        p += w;
+        n -= w;
+        off += w;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "spscqueue.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LOG_RING 65536      // events buffered per logging thread
+#define LOG_PRODUCERS 64    // threads that may log
+#define LOG_IDLE_US 1000    // drain thread sleep when every ring is empty
+#define LOG_MAGIC "CFLG"
+#define LOG_VERSION 1
+
+using namespace std;
+
+enum LogType
+{
+  LOG_RECV = 0,
+  LOG_SEND,
+  LOG_DROP
+};
+
+enum LogFlag
+{
+  LOG_ACK = 0x1,
+  LOG_SYN = 0x2,
+  LOG_FIN = 0x4,
+  LOG_DUP = 0x8
+};
+
+// Which program wrote a log, and so which text format it decodes to
+enum LogKind
+{
+  LOG_SERVER = 0,  // SEND/RECV/DROP seq ack connId FLAGS
+  LOG_CLIENT       // SEND/RECV/DROP seq ack connId cwnd ssthresh FLAGS
+};
+
+// One packet event, exactly as it goes to the binary log
+struct LogEvent
+{
+  uint64_t tsc;
+  uint32_t seq;
+  uint32_t ack;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  int16_t connId;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t pad;
+};
+
+// Start of a binary log. The TSC and the monotonic clock are sampled when
+// the log opens and again when it closes, which gives the decoder the TSC
+// rate; tsc_end is 0 if the program died before closing the log.
+struct LogFileHeader
+{
+  char magic[4];
+  uint16_t version;
+  uint8_t kind;
+  uint8_t pad;
+  uint64_t tsc_start;
+  int64_t ns_start;
+  uint64_t tsc_end;
+  int64_t ns_end;
+};
+
+// Timestamp counter, or the monotonic clock where there is no TSC
+inline uint64_t log_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline int64_t log_ns()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Text line of an event, as print_log used to write it, without the newline
+inline int format_event(int kind, const LogEvent& e, char* out, size_t size)
+{
+  static const char* names[] = { "RECV", "SEND", "DROP" };
+  const char* name = e.type <= LOG_DROP ? names[e.type] : "????";
+  int n;
+  if (kind == LOG_CLIENT)
+  {
+    n = snprintf(out, size, "%s %u %u %d %u %u", name, e.seq, e.ack,
+      e.connId, e.cwnd, e.ssthresh);
+  }
+  else
+  {
+    n = snprintf(out, size, "%s %u %u %d", name, e.seq, e.ack, e.connId);
+  }
+  n += snprintf(out + n, size - n, "%s%s%s%s",
+    e.flags & LOG_ACK ? " ACK" : "", e.flags & LOG_SYN ? " SYN" : "",
+    e.flags & LOG_FIN ? " FIN" : "", e.flags & LOG_DUP ? " DUP" : "");
+  return n;
+}
+
+// Asynchronous packet log. Each thread that logs gets its own lock-free ring
+// of fixed-size events, and a background thread drains the rings, merges
+// them by timestamp, and writes either the usual text lines to stdout or
+// the raw events to a binary log file for the decoder (logdecode). A thread
+// only blocks in record() when its ring is full.
+//
+// There is one EventLog per program: the ring of each thread is cached in a
+// thread_local.
+class EventLog
+{
+  public:
+    EventLog() : kind(LOG_SERVER), out(NULL), binary(false), nrings(0),
+      running(false) {}
+
+    ~EventLog()
+    {
+      close();
+    }
+
+    // Start the drain thread. With a path, events go to that binary log
+    // file; otherwise they are written to stdout as text.
+    bool open(int log_kind, const char* path = NULL)
+    {
+      kind = log_kind;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, LOG_MAGIC, 4);
+      header.version = LOG_VERSION;
+      header.kind = kind;
+      header.tsc_start = log_tsc();
+      header.ns_start = log_ns();
+      if (path)
+      {
+        out = fopen(path, "wb");
+        if (!out)
+        {
+          return false;
+        }
+        binary = true;
+        fwrite(&header, sizeof(header), 1, out);
+      }
+      else
+      {
+        out = stdout;
+      }
+      running = true;
+      drainer = thread(&EventLog::drain_loop, this);
+      return true;
+    }
+
+    // Drain what is left and stop; called again at exit, where it is a no-op
+    void close()
+    {
+      if (!running.exchange(false))
+      {
+        return;
+      }
+      drainer.join();
+      if (binary)
+      {
+        header.tsc_end = log_tsc();
+        header.ns_end = log_ns();
+        fseek(out, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, out);
+        fclose(out);
+      }
+      else
+      {
+        fflush(out);
+      }
+    }
+
+    void record(int type, uint32_t seq, uint32_t ack, short int connId,
+      uint32_t cwnd, uint32_t ssthresh, int flags)
+    {
+      static thread_local SPSCQueue<LogEvent>* mine = NULL;
+      if (!mine)
+      {
+        mine = add_ring();
+      }
+      LogEvent* e;
+      while (!(e = mine->reserve()))
+      {
+        this_thread::yield();
+      }
+      e->tsc = log_tsc();
+      e->seq = seq;
+      e->ack = ack;
+      e->cwnd = cwnd;
+      e->ssthresh = ssthresh;
+      e->connId = connId;
+      e->type = type;
+      e->flags = flags;
+      e->pad = 0;
+      mine->commit();
+    }
+
+  private:
+    int kind;
+    FILE* out;
+    bool binary;
+    LogFileHeader header;
+    SPSCQueue<LogEvent>* rings[LOG_PRODUCERS];
+    atomic<int> nrings;
+    mutex add_mutex;  // only taken the first time a thread logs
+    atomic<bool> running;
+    thread drainer;
+    vector<LogEvent> batch;
+
+    SPSCQueue<LogEvent>* add_ring()
+    {
+      lock_guard<mutex> lock(add_mutex);
+      int n = nrings.load(memory_order_relaxed);
+      if (n == LOG_PRODUCERS)
+      {
+        fprintf(stderr, "ERROR: Too many logging threads\n");
+        exit(1);
+      }
+      rings[n] = new SPSCQueue<LogEvent>(LOG_RING);
+      nrings.store(n + 1, memory_order_release);
+      return rings[n];
+    }
+
+    // Move everything currently in the rings to the output; false if there
+    // was nothing
+    bool drain()
+    {
+      batch.clear();
+      int n = nrings.load(memory_order_acquire);
+      int sources = 0;
+      for (int i = 0; i < n; i++)
+      {
+        size_t before = batch.size();
+        LogEvent* e;
+        while ((e = rings[i]->front()))
+        {
+          batch.push_back(*e);
+          rings[i]->consume();
+        }
+        sources += batch.size() > before;
+      }
+      if (batch.empty())
+      {
+        return false;
+      }
+      if (sources > 1)
+      {
+        sort(batch.begin(), batch.end(),
+          [](const LogEvent& a, const LogEvent& b) { return a.tsc < b.tsc; });
+      }
+
+      if (binary)
+      {
+        fwrite(batch.data(), sizeof(LogEvent), batch.size(), out);
+        return true;
+      }
+      char line[128];
+      for (size_t i = 0; i < batch.size(); i++)
+      {
+        int len = format_event(kind, batch[i], line, sizeof(line) - 1);
+        line[len++] = '\n';
+        fwrite(line, 1, len, out);
+      }
+      fflush(out);
+      return true;
+    }
+
+    void drain_loop()
+    {
+      // Signals go to the other threads, whose exit() joins this one
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+      batch.reserve(LOG_RING);
+      while (running.load(memory_order_acquire))
+      {
+        if (!drain())
+        {
+          this_thread::sleep_for(chrono::microseconds(LOG_IDLE_US));
+        }
+      }
+      while (drain())
+      {
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "seqnum.h"
+#include "options.h"
+
+#define FEC_EPOCH 64       // fresh segments per loss rate sample
+#define FEC_TARGET 0.5     // expected losses per block the block size aims for
+
+using namespace std;
+
+// Forward error correction for Confundo. The sender groups fresh data
+// segments into blocks, tags each with the sequence number of its block's
+// first byte (in the ACK field, which data segments do not use otherwise),
+// and follows each block with a parity segment: the XOR of the block's
+// payloads, with the block's first and end sequence numbers in the header.
+// The receiver XORs everything it has of a block, so when a single segment
+// of it is lost, parity and the rest give it back without a round trip.
+//
+// A block ends after the number of segments the loss rate calls for, at the
+// end of the window, and before the segment size grows, so every segment of
+// a block but the last has the same size and two missing segments are always
+// more than the parity covers.
+
+// dst ^= src over n bytes, a word at a time
+inline void fec_xor(char* dst, const char* src, size_t n)
+{
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+  {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < n; i++)
+  {
+    dst[i] ^= src[i];
+  }
+}
+
+// The sender's side: the open block and its parity, and the block size. The
+// loss rate is sampled every FEC_EPOCH fresh segments from the losses the
+// sender noticed, and the block is sized for FEC_TARGET losses per block.
+class FecEncoder
+{
+  public:
+    FecEncoder() : max_block(0), block(0), count(0), start(0), len(0),
+      seg_size(0), last_size(0), loss(0), epoch_segments(0), epoch_losses(0) {}
+
+    void enable(int max_blocksize, int max_mss)
+    {
+      max_block = block = max_blocksize;
+      parity.assign(max_mss, 0);
+    }
+
+    bool enabled() const
+    {
+      return max_block > 0;
+    }
+
+    // Segments a block is closed at
+    int block_size() const
+    {
+      return block;
+    }
+
+    // A block has segments and no parity yet
+    bool open() const
+    {
+      return count > 0;
+    }
+
+    // Size of the block's segments, all but a shorter last one
+    int segment_size() const
+    {
+      return seg_size;
+    }
+
+    // A fresh segment of n bytes at byte offset off goes out; returns the
+    // offset of its block's first byte
+    long add(long off, const char* data, int n)
+    {
+      if (!count)
+      {
+        start = off;
+        seg_size = n;
+      }
+      fec_xor(parity.data(), data, n);
+      len = max(len, n);
+      last_size = n;
+      count++;
+      if (++epoch_segments >= FEC_EPOCH)
+      {
+        loss = 0.75 * loss + 0.25 * epoch_losses / epoch_segments;
+        block = loss > 0 ? max(MINFECBLOCK, min(max_block,
+          (int) (FEC_TARGET / loss))) : max_block;
+        epoch_segments = epoch_losses = 0;
+      }
+      return start;
+    }
+
+    // The block has its segments, or its last, shorter one
+    bool full() const
+    {
+      return count >= block || last_size < seg_size;
+    }
+
+    long block_start() const
+    {
+      return start;
+    }
+
+    const char* data() const
+    {
+      return parity.data();
+    }
+
+    int length() const
+    {
+      return len;
+    }
+
+    // The parity went out, or the block is abandoned
+    void close()
+    {
+      memset(parity.data(), 0, len);
+      count = len = 0;
+    }
+
+    // The sender saw a segment go missing
+    void on_loss()
+    {
+      epoch_losses++;
+    }
+
+  private:
+    int max_block;
+    int block;
+    int count;
+    long start;
+    int len;
+    int seg_size;
+    int last_size;
+    vector<char> parity;
+    double loss;
+    int epoch_segments;
+    int epoch_losses;
+};
+
+// The receiver's side for one connection: the XOR of the in-order segments
+// of the current block, and the segments that arrived past a gap in it,
+// which are kept (up to a block of them) and XORed too. A parity segment
+// whose block lacks a single segment, at the gap, rebuilds it.
+class FecRepair
+{
+  public:
+    FecRepair(int max_block, int mss) : mss(mss), acc(mss, 0),
+      stash_acc(mss, 0), repaired(mss, 0), stash_buf((size_t) max_block * mss),
+      acc_valid(false), acc_block(0), acc_next(0), acc_len(0), stash_block(0),
+      stash_end(0), stash_len(0), stash_used(0), head(0)
+    {
+      segs.reserve(max_block);
+    }
+
+    // An in-order segment of n bytes at seq; tagged with the first sequence
+    // number of its block unless it is a retransmission
+    void in_order(const SeqSpace& seqs, bool tagged, unsigned int block,
+      unsigned int seq, const char* p, int n)
+    {
+      if (!n)
+      {
+        return;
+      }
+      if (tagged && seq == block)  // first segment of a block
+      {
+        memset(acc.data(), 0, acc_len);
+        acc_len = 0;
+        acc_valid = true;
+        acc_block = block;
+      }
+      else if (!tagged || block != acc_block || seq != acc_next)
+      {
+        acc_valid = false;
+      }
+      if (acc_valid && n <= mss)
+      {
+        fec_xor(acc.data(), p, n);
+        acc_len = max(acc_len, n);
+        acc_next = seqs.add(seq, n);
+      }
+      else
+      {
+        acc_valid = false;
+      }
+    }
+
+    // A tagged segment of n bytes at seq, past the gap at expected; true if
+    // it was kept
+    bool keep(const SeqSpace& seqs, unsigned int block, unsigned int expected,
+      unsigned int seq, const char* p, int n)
+    {
+      if (n <= 0 || n > mss)
+      {
+        return false;
+      }
+      bool extends = head < segs.size() && block == stash_block &&
+        seq == stash_end;
+      if (!extends)
+      {
+        // Only the first segment after a gap in its own block starts over
+        if (!seqs.le(block, expected) || !seqs.lt(expected, seq) ||
+          (head < segs.size() && block == stash_block))
+        {
+          return false;
+        }
+        segs.clear();
+        head = 0;
+        stash_used = 0;
+        memset(stash_acc.data(), 0, stash_len);
+        stash_len = 0;
+        stash_block = block;
+      }
+      if (stash_used + n > stash_buf.size())
+      {
+        return false;
+      }
+      memcpy(stash_buf.data() + stash_used, p, n);
+      Kept k = { seq, n, stash_used };
+      segs.push_back(k);
+      stash_used += n;
+      stash_end = seqs.add(seq, n);
+      fec_xor(stash_acc.data(), p, n);
+      stash_len = max(stash_len, n);
+      return true;
+    }
+
+    // A kept segment that continues the in-order data at expected, if any
+    bool next_kept(const SeqSpace& seqs, unsigned int expected,
+      const char*& p, int& n)
+    {
+      while (head < segs.size() && seqs.lt(segs[head].seq, expected))
+      {
+        head++;
+      }
+      if (head == segs.size() || segs[head].seq != expected)
+      {
+        return false;
+      }
+      p = stash_buf.data() + segs[head].offset;
+      n = segs[head].len;
+      return true;
+    }
+
+    void pop_kept()
+    {
+      head++;
+      acc_valid = false;  // the block is no longer being tracked in order
+    }
+
+    // A parity segment of n bytes for the block [start, end): the missing
+    // segment at expected if it is the only one, and its length, or 0
+    int repair(const SeqSpace& seqs, unsigned int expected, unsigned int start,
+      unsigned int end, const char* p, int n, const char*& out)
+    {
+      int len = 0;
+      if (n > 0 && n <= mss && seqs.le(start, expected) &&
+        seqs.lt(expected, end) &&
+        (expected == start || (acc_valid && acc_block == start &&
+        acc_next == expected)))
+      {
+        bool kept = head < segs.size() && stash_block == start;
+        if (!kept || stash_end == end)
+        {
+          uint64_t gap = seqs.dist(expected, kept ? segs[head].seq : end);
+          if (gap > 0 && gap <= (uint64_t) n)
+          {
+            memcpy(repaired.data(), p, n);
+            if (expected != start)
+            {
+              fec_xor(repaired.data(), acc.data(), acc_len);
+            }
+            if (kept)
+            {
+              fec_xor(repaired.data(), stash_acc.data(), stash_len);
+            }
+            out = repaired.data();
+            len = (int) gap;
+          }
+        }
+      }
+      acc_valid = false;  // the block is over either way
+      return len;
+    }
+
+  private:
+    struct Kept
+    {
+      unsigned int seq;
+      int len;
+      size_t offset;
+    };
+
+    int mss;
+    vector<char> acc;        // XOR of the block's in-order segments
+    vector<char> stash_acc;  // XOR of the kept segments
+    vector<char> repaired;
+    vector<char> stash_buf;
+    vector<Kept> segs;
+    bool acc_valid;
+    unsigned int acc_block;
+    unsigned int acc_next;   // sequence number after the last one XORed
+    int acc_len;
+    unsigned int stash_block;
+    unsigned int stash_end;
+    int stash_len;
+    size_t stash_used;
+    size_t head;             // first kept segment not yet delivered
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef FILESOURCE_H
+#define FILESOURCE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A file to upload, mapped into memory for the length of the upload, so
+// every transport sends straight out of the page cache
+struct FileSource
+{
+  void* map;
+  long size;
+
+  FileSource() : map(NULL), size(0) {}
+
+  const char* data() const
+  {
+    return static_cast<const char*>(map);
+  }
+};
+
+// Map the file at path; false if it cannot be read
+inline bool map_file(const char* path, FileSource& f)
+{
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1)
+  {
+    close(fd);
+    return false;
+  }
+  f.size = file_stat.st_size;
+  f.map = NULL;
+  if (f.size > 0)
+  {
+    f.map = mmap(NULL, f.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f.map == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+    madvise(f.map, f.size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return true;
+}
+
+inline void unmap_file(FileSource& f)
+{
+  if (f.map)
+  {
+    munmap(f.map, f.size);
+    f.map = NULL;
+  }
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef LINKMODEL_H
+#define LINKMODEL_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include <random>
+#include <algorithm>
+
+using namespace std;
+
+// The emulated link shared by lossyproxy and confundosim. Each direction
+// applies:
+//
+// * a fixed one-way delay plus uniform jitter
+// * random loss, or Gilbert-Elliott loss: a good and a bad state with
+//   per-packet transition probabilities and a loss rate in each
+// * reordering: a packet is held back by an extra delay
+// * duplication
+// * corruption: a random bit of the datagram flipped
+// * a bandwidth cap, which serializes packets on the link
+//
+// All randomness comes from the generator passed in, so a seeded run can be
+// repeated.
+
+struct LinkParams
+{
+  double delay_ms = 0;
+  double jitter_ms = 0;
+  double loss = 0;       // random loss probability
+  bool gilbert = false;  // use Gilbert-Elliott loss instead
+  double ge_p = 0;       // good -> bad
+  double ge_r = 1;       // bad -> good
+  double ge_loss_bad = 1;
+  double ge_loss_good = 0;
+  double reorder = 0;
+  double duplicate = 0;
+  double corrupt = 0;
+  double kbps = 0;       // 0 = unlimited
+};
+
+// One direction of the emulated link
+class Link
+{
+  public:
+    unsigned long passed = 0, lost = 0, reordered = 0, duplicated = 0,
+      corrupted = 0;
+
+    Link(const LinkParams& params, mt19937_64& rng) : params(params),
+      rng(rng), uniform(0.0, 1.0) {}
+
+    // A datagram of len bytes enters the link at now (us). Fills due with
+    // the times its copies come out and returns how many there are: none
+    // when it is lost, two when it is duplicated.
+    int transmit(int64_t now, size_t len, int64_t due[2])
+    {
+      if (lose())
+      {
+        lost++;
+        return 0;
+      }
+      int copies = chance(params.duplicate) ? 2 : 1;
+      duplicated += copies - 1;
+      for (int i = 0; i < copies; i++)
+      {
+        // Serialization on a capped link delays everything behind it
+        int64_t start = now;
+        if (params.kbps > 0)
+        {
+          start = max(now, free_at);
+          free_at = start + (int64_t) (len * 8 * 1000.0 / params.kbps);
+        }
+        double delay = params.delay_ms +
+          params.jitter_ms * (2 * uniform(rng) - 1);
+        if (chance(params.reorder))
+        {
+          delay += params.delay_ms + 2 * params.jitter_ms + 1;
+          reordered++;
+        }
+        due[i] = start + (int64_t) (max(delay, 0.0) * 1000);
+        passed++;
+      }
+      return copies;
+    }
+
+    // Flip one random bit of a copy of a datagram of len bytes, as often as
+    // the link corrupts them
+    void damage(char* data, size_t len)
+    {
+      if (len && chance(params.corrupt))
+      {
+        size_t bit = rng() % (len * 8);
+        data[bit / 8] ^= (char) (1 << (bit % 8));
+        corrupted++;
+      }
+    }
+
+  private:
+    const LinkParams& params;
+    mt19937_64& rng;
+    uniform_real_distribution<double> uniform;
+    bool bad = false;      // Gilbert-Elliott state
+    int64_t free_at = 0;   // us when the last queued packet finishes serializing
+
+    bool chance(double p)
+    {
+      return p > 0 && uniform(rng) < p;
+    }
+
+    bool lose()
+    {
+      if (!params.gilbert)
+      {
+        return chance(params.loss);
+      }
+      bad = bad ? !chance(params.ge_r) : chance(params.ge_p);
+      return chance(bad ? params.ge_loss_bad : params.ge_loss_good);
+    }
+};
+
+inline double parse_prob(const char* s)
+{
+  double p = atof(s);
+  if (p < 0 || p > 1)
+  {
+    cerr << "ERROR: Probabilities must be between 0 and 1" << endl;
+    exit(1);
+  }
+  return p;
+}
+
+// The getopt letters of the link options, and their usage
+#define LINK_OPTSTRING "d:j:l:g:o:u:x:b:"
+#define LINK_USAGE " [-d DELAY-MS] [-j JITTER-MS]" \
+  " [-l LOSS | -g P,R[,BAD-LOSS[,GOOD-LOSS]]] [-o REORDER] [-u DUPLICATE]" \
+  " [-x CORRUPT] [-b KBIT/S]"
+
+// Apply one link option to params; returns false if opt is not one
+inline bool parse_link_option(int opt, const char* arg, LinkParams& params)
+{
+  if (opt == 'd')
+  {
+    params.delay_ms = atof(arg);
+  }
+  else if (opt == 'j')
+  {
+    params.jitter_ms = atof(arg);
+  }
+  else if (opt == 'l')
+  {
+    params.loss = parse_prob(arg);
+  }
+  else if (opt == 'g')
+  {
+    // p,r[,loss in bad state[,loss in good state]]
+    double v[4] = { 0, 1, 1, 0 };
+    int n = sscanf(arg, "%lf,%lf,%lf,%lf", &v[0], &v[1], &v[2], &v[3]);
+    if (n < 2)
+    {
+      cerr << "ERROR: -g takes P,R[,BAD-LOSS[,GOOD-LOSS]]" << endl;
+      exit(1);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      if (v[i] < 0 || v[i] > 1)
+      {
+        cerr << "ERROR: Probabilities must be between 0 and 1" << endl;
+        exit(1);
+      }
+    }
+    params.gilbert = true;
+    params.ge_p = v[0];
+    params.ge_r = v[1];
+    params.ge_loss_bad = v[2];
+    params.ge_loss_good = v[3];
+  }
+  else if (opt == 'o')
+  {
+    params.reorder = parse_prob(arg);
+  }
+  else if (opt == 'u')
+  {
+    params.duplicate = parse_prob(arg);
+  }
+  else if (opt == 'x')
+  {
+    params.corrupt = parse_prob(arg);
+  }
+  else if (opt == 'b')
+  {
+    params.kbps = atof(arg);
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+#endif
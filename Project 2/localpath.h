@@ -0,0 +1,388 @@
+#ifndef LOCALPATH_H
+#define LOCALPATH_H
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include "options.h"
+#include "siphash.h"
+
+#define LOCAL_SOCKET ".confundo.sock"  // the rendezvous, in the server's directory
+#define LOCAL_BACKLOG 64
+#define LOCAL_TIMEOUT 5000             // ms a client waits for the server's answer,
+                                       // once the request is sent
+#define LOCAL_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+using namespace std;
+
+// The same-host path: a client whose server runs on the same machine hands
+// it the file through shared memory instead of sending it over UDP.
+//
+// The client asks for it with a local option in its SYN. A server with a
+// rendezvous socket echoes the option with the client's address and port
+// as it sees them, a SipHash tag of those and the connId under a secret of
+// its own, and the path of the socket, a SOCK_SEQPACKET UNIX socket in its
+// file directory. After the handshake, the client copies the rest of its
+// file into a memfd, seals it so it can no longer change, and sends it over
+// the socket with a LocalRequest naming the connection and the sequence
+// number it starts at. The server's answer is a single byte: 1 when it has
+// taken the data as the connection's next bytes, 0 when it has taken
+// nothing. The client then closes the connection with its FIN as usual.
+// The client library (confundoclient.h) copies and sends on a thread of
+// its own and waits for the answer in its event loop.
+
+// What the client sends with the memfd; both ends are on the same host, so
+// in host byte order
+struct LocalRequest
+{
+  uint32_t addr;  // client address and port, network order, from the offer
+  uint16_t port;
+  int16_t connId;
+  uint32_t seq;   // sequence number of the first byte handed over
+  uint64_t tag;   // from the offer
+  uint64_t len;   // bytes handed over, from the start of the memfd
+};
+
+// A request the server's rendezvous has accepted: a sealed memfd holding at
+// least len bytes, and the socket to answer on
+struct LocalHandoff
+{
+  sockaddr_in addr;
+  short int connId;
+  unsigned int seq;
+  int fd;
+  size_t len;
+  int conn;
+};
+
+enum LocalResult
+{
+  LOCAL_TAKEN,    // the server has the data
+  LOCAL_REFUSED,  // the server took nothing, send it over UDP
+  LOCAL_FAILED,   // no answer, so the server may or may not have it
+  LOCAL_PENDING   // no answer yet
+};
+
+// Whether addr is one of this host's: a loopback address, or one a socket
+// can be bound to
+inline bool is_local_address(const in_addr& addr)
+{
+  if ((ntohl(addr.s_addr) >> 24) == 127)
+  {
+    return true;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    return false;
+  }
+  sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr = addr;
+  bool local = bind(fd, (struct sockaddr*) &a, sizeof(a)) == 0;
+  close(fd);
+  return local;
+}
+
+// A handoff for the sender's owner to carry out: the len bytes at data, as
+// the bytes of connection connId from sequence number seq on, to the server
+// that made offer
+struct LocalJob
+{
+  ConfundoOptions offer;
+  short int connId;
+  unsigned int seq;
+  const char* data;
+  size_t len;
+};
+
+// Copy a job's data into a sealed memfd and send it to the server with the
+// request. Returns the connection to the rendezvous, now non-blocking, on
+// which the answer arrives (local_answer()), or -1 when nothing was sent and
+// the data must go over UDP. It copies all of the data and may wait for the
+// rendezvous to accept, so it is run off the client's event loop.
+inline int local_handoff_send(const LocalJob& job)
+{
+  struct sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if (strlen(job.offer.local_path) >= sizeof(sun.sun_path))
+  {
+    return -1;
+  }
+  strcpy(sun.sun_path, job.offer.local_path);
+
+  int mfd = memfd_create("confundo", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mfd < 0)
+  {
+    return -1;
+  }
+  size_t done = 0;
+  while (done < job.len)
+  {
+    ssize_t w = write(mfd, job.data + done, job.len - done);
+    if (w < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (w <= 0)
+    {
+      close(mfd);
+      return -1;
+    }
+    done += w;
+  }
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fcntl(mfd, F_ADD_SEALS, LOCAL_SEALS) == -1 || sock < 0 ||
+    connect(sock, (struct sockaddr*) &sun, sizeof(sun)) == -1)
+  {
+    close(mfd);
+    if (sock >= 0)
+    {
+      close(sock);
+    }
+    return -1;
+  }
+
+  LocalRequest req;
+  memset(&req, 0, sizeof(req));
+  req.addr = job.offer.local_addr;
+  req.port = job.offer.local_port;
+  req.connId = job.connId;
+  req.seq = job.seq;
+  req.tag = job.offer.local_tag;
+  req.len = job.len;
+  struct iovec iov;
+  iov.iov_base = &req;
+  iov.iov_len = sizeof(req);
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &mfd, sizeof(int));
+  bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(req);
+  close(mfd);  // the server has its own descriptor now
+  if (!sent || fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Read the server's answer from a connection of local_handoff_send();
+// LOCAL_PENDING until it has come
+inline LocalResult local_answer(int sock)
+{
+  char answer;
+  ssize_t n = recv(sock, &answer, 1, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+  {
+    return LOCAL_PENDING;
+  }
+  if (n != 1)
+  {
+    return LOCAL_FAILED;
+  }
+  return answer == 1 ? LOCAL_TAKEN : LOCAL_REFUSED;
+}
+
+// The server's end: the rendezvous socket, which a thread of its own
+// serves, and the secret of the tags. Requests whose tag and memfd check out
+// go to the callback, which must answer them with reply(), possibly from
+// another thread.
+class LocalRendezvous
+{
+  public:
+    typedef function<void(LocalHandoff& h)> Deliver;
+
+    LocalRendezvous() : fd(-1)
+    {
+      random_device rd;
+      k0 = ((uint64_t) rd() << 32) | rd();
+      k1 = ((uint64_t) rd() << 32) | rd();
+    }
+
+    ~LocalRendezvous()
+    {
+      if (fd >= 0)
+      {
+        unlink(path.c_str());
+      }
+    }
+
+    // Listen at socket_path, an absolute path, and serve requests
+    bool open(const string& socket_path, Deliver deliver_fn)
+    {
+      deliver = deliver_fn;
+      path = socket_path;
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path) || path.size() >= MAXLOCALPATH)
+      {
+        return false;
+      }
+      strcpy(addr.sun_path, path.c_str());
+      fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+      {
+        return false;
+      }
+      unlink(path.c_str());
+      if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(fd, LOCAL_BACKLOG) == -1)
+      {
+        ::close(fd);
+        fd = -1;
+        return false;
+      }
+      thread(&LocalRendezvous::serve, this).detach();
+      return true;
+    }
+
+    // Fill in the local option of a SYN-ACK to a client at cliaddr given
+    // connId; false, leaving opts alone, when the client is not on this
+    // host or there is no rendezvous
+    bool offer(ConfundoOptions& opts, const sockaddr_in& cliaddr,
+      short int connId) const
+    {
+      if (fd < 0 || !is_local_address(cliaddr.sin_addr))
+      {
+        return false;
+      }
+      opts.local_addr = cliaddr.sin_addr.s_addr;
+      opts.local_port = cliaddr.sin_port;
+      opts.local_tag = tag(opts.local_addr, opts.local_port, connId);
+      strcpy(opts.local_path, path.c_str());
+      return true;
+    }
+
+    // Answer a request, and close the memfd unless it was taken
+    static void reply(LocalHandoff& h, bool taken)
+    {
+      char answer = taken ? 1 : 0;
+      send(h.conn, &answer, 1, MSG_NOSIGNAL);
+      ::close(h.conn);
+      if (!taken)
+      {
+        ::close(h.fd);
+      }
+    }
+
+  private:
+    int fd;
+    string path;
+    uint64_t k0, k1;
+    Deliver deliver;
+
+    uint64_t tag(uint32_t addr, uint16_t port, short int connId) const
+    {
+      char buf[8];
+      memcpy(buf, &addr, 4);
+      memcpy(buf + 4, &port, 2);
+      memcpy(buf + 6, &connId, 2);
+      return siphash24(k0, k1, buf, sizeof(buf));
+    }
+
+    void serve()
+    {
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+      while (true)
+      {
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+          continue;
+        }
+        struct timeval tv;
+        tv.tv_sec = LOCAL_TIMEOUT / 1000;
+        tv.tv_usec = (LOCAL_TIMEOUT % 1000) * 1000;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        LocalHandoff h;
+        if (receive(conn, h))
+        {
+          deliver(h);
+        }
+        else
+        {
+          char answer = 0;
+          send(conn, &answer, 1, MSG_NOSIGNAL);
+          ::close(conn);
+        }
+      }
+    }
+
+    // Read a request and its memfd, and check that the tag is the server's
+    // and the memfd sealed and large enough
+    bool receive(int conn, LocalHandoff& h)
+    {
+      LocalRequest req;
+      struct iovec iov;
+      iov.iov_base = &req;
+      iov.iov_len = sizeof(req);
+      char control[CMSG_SPACE(sizeof(int))];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+      struct cmsghdr* cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+      if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(int)))
+      {
+        return false;
+      }
+      int mfd;
+      memcpy(&mfd, CMSG_DATA(cm), sizeof(int));
+      struct stat st;
+      if (n != (ssize_t) sizeof(req) || (msg.msg_flags & MSG_CTRUNC) ||
+        req.tag != tag(req.addr, req.port, req.connId) ||
+        (fcntl(mfd, F_GET_SEALS) & LOCAL_SEALS) != LOCAL_SEALS ||
+        fstat(mfd, &st) == -1 || (uint64_t) st.st_size < req.len)
+      {
+        ::close(mfd);
+        return false;
+      }
+      memset(&h.addr, 0, sizeof(h.addr));
+      h.addr.sin_family = AF_INET;
+      h.addr.sin_addr.s_addr = req.addr;
+      h.addr.sin_port = req.port;
+      h.connId = req.connId;
+      h.seq = req.seq;
+      h.fd = mfd;
+      h.len = req.len;
+      h.conn = conn;
+      return true;
+    }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <bits/stdc++.h>
+#include "eventlog.h"
+
+using namespace std;
+
+// Turns a binary log written with -L back into the text lines the server or
+// client would have printed. With -t every line is prefixed by the seconds
+// since the log was opened.
+int main(int argc, char *argv[])
+{
+  bool timestamps = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t")) != -1)
+  {
+    if (opt == 't')
+    {
+      timestamps = true;
+    }
+    else
+    {
+      cerr<<"ERROR: usage: "<<argv[0]<<" [-t] <LOGFILE>"<<endl;
+      exit(1);
+    }
+  }
+
+  if (argc - optind != 1)
+  {
+    cerr<<"ERROR: Invalid number of arguments"<<endl;
+    exit(1);
+  }
+
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd < 0)
+  {
+    cerr<<"ERROR: Could not open log file"<<endl;
+    exit(1);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  if (size < sizeof(LogFileHeader))
+  {
+    cerr<<"ERROR: Not a Confundo log"<<endl;
+    exit(1);
+  }
+  const char* map = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+    fd, 0);
+  if (map == MAP_FAILED)
+  {
+    cerr<<"ERROR: Could not map log file"<<endl;
+    exit(1);
+  }
+
+  LogFileHeader header;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, LOG_MAGIC, 4) != 0 || header.version != LOG_VERSION)
+  {
+    cerr<<"ERROR: Not a Confundo log"<<endl;
+    exit(1);
+  }
+
+  // TSC ticks per nanosecond, from the samples taken when the log was opened
+  // and closed. A log that was never closed has no rate; assume 1 GHz.
+  double ticks_per_ns = 1.0;
+  if (header.tsc_end > header.tsc_start && header.ns_end > header.ns_start)
+  {
+    ticks_per_ns = (double) (header.tsc_end - header.tsc_start) /
+      (header.ns_end - header.ns_start);
+  }
+  else if (timestamps)
+  {
+    cerr<<"WARNING: log was not closed, timestamps assume a 1 GHz TSC"<<endl;
+  }
+
+  size_t count = (size - sizeof(header)) / sizeof(LogEvent);
+  const LogEvent* events = (const LogEvent*) (map + sizeof(header));
+  char line[160];
+  for (size_t i = 0; i < count; i++)
+  {
+    int n = 0;
+    if (timestamps)
+    {
+      double secs = ((int64_t) (events[i].tsc - header.tsc_start)) /
+        ticks_per_ns / 1e9;
+      n = snprintf(line, sizeof(line), "%.6f ", secs);
+    }
+    n += format_event(header.kind, events[i], line + n, sizeof(line) - n - 1);
+    line[n++] = '\n';
+    fwrite(line, 1, n, stdout);
+  }
+
+  munmap((void*) map, size);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,253 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <bits/stdc++.h>
+#include <poll.h>
+#include "linkmodel.h"
+
+#define MAXFLOWS 1024
+
+using namespace std;
+
+// A UDP proxy for loopback experiments: clients send to the proxy's port,
+// and every client gets its own socket towards the server, so the server
+// still sees one address per client. Datagrams in both directions pass
+// through the same emulated link (see linkmodel.h), seeded so that a run can
+// be repeated.
+
+struct Pending
+{
+  int64_t due;      // us
+  uint64_t order;   // keeps FIFO order among packets due at the same time
+  int fd;
+  bool to_client;
+  sockaddr_in addr;
+  vector<char> data;
+
+  bool operator>(const Pending& o) const
+  {
+    return due != o.due ? due > o.due : order > o.order;
+  }
+};
+
+struct Flow
+{
+  int fd;  // connected to the server
+  sockaddr_in client;
+};
+
+LinkParams params;
+mt19937_64 rng;
+Link up(params, rng), down(params, rng);  // client -> server, server -> client
+priority_queue<Pending, vector<Pending>, greater<Pending> > pending;
+uint64_t next_order = 0;
+
+void signalHandler(int signum)
+{
+  cerr << "INTERRUPT: Interrupt signal (" << signum << ") received.\n";
+  cerr << "PROXY: up " << up.passed << " passed " << up.lost << " lost "
+    << up.reordered << " reordered " << up.duplicated << " duplicated "
+    << up.corrupted << " corrupted, down " << down.passed << " passed "
+    << down.lost << " lost " << down.reordered << " reordered "
+    << down.duplicated << " duplicated " << down.corrupted << " corrupted\n";
+  exit(signum);
+}
+
+int64_t now_us()
+{
+  return chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Put a datagram on the link; it is sent when it comes due
+void enqueue(Link& link, int fd, bool to_client, const sockaddr_in& addr,
+  const char* buf, int len)
+{
+  int64_t due[2];
+  int copies = link.transmit(now_us(), len, due);
+  for (int i = 0; i < copies; i++)
+  {
+    Pending p;
+    p.due = due[i];
+    p.order = next_order++;
+    p.fd = fd;
+    p.to_client = to_client;
+    p.addr = addr;
+    p.data.assign(buf, buf + len);
+    link.damage(p.data.data(), len);
+    pending.push(p);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  signal(SIGINT, signalHandler);
+  signal(SIGTERM, signalHandler);
+  signal(SIGQUIT, signalHandler);
+
+  unsigned long seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, LINK_OPTSTRING "s:")) != -1)
+  {
+    if (parse_link_option(opt, optarg, params))
+    {
+      continue;
+    }
+    if (opt == 's')
+    {
+      seed = strtoul(optarg, NULL, 10);
+    }
+    else
+    {
+      cerr << "ERROR: usage: " << argv[0] << LINK_USAGE << " [-s SEED]"
+        << " <PORT> <SERVER-HOSTNAME-OR-IP> <SERVER-PORT>" << endl;
+      exit(1);
+    }
+  }
+  rng.seed(seed);
+
+  if (argc - optind != 3)
+  {
+    cerr << "ERROR: Invalid number of arguments" << endl;
+    exit(1);
+  }
+  int port = atoi(argv[optind]);
+  int server_port = atoi(argv[optind + 2]);
+  if (port < 1023 || port > 65535 || server_port < 1023 ||
+    server_port > 65535)
+  {
+    cerr << "ERROR: Incorrect port" << endl;
+    exit(1);
+  }
+
+  struct hostent* host = gethostbyname(argv[optind + 1]);
+  if (!host)
+  {
+    cerr << "ERROR: Invalid hostname" << endl;
+    exit(1);
+  }
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(server_port);
+  memcpy(&server.sin_addr, host->h_addr, host->h_length);
+
+  int lfd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (lfd < 0 || bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+  {
+    cerr << "ERROR: Binding error" << endl;
+    exit(1);
+  }
+
+  map<pair<uint32_t, uint16_t>, Flow> flows;
+  vector<pollfd> pfds;
+  vector<Flow*> pflows;  // pflows[i] belongs to pfds[i + 1]
+  bool rebuild = true;
+  vector<char> buf(65536);
+
+  while (true)
+  {
+    if (rebuild)
+    {
+      pfds.assign(1, pollfd());
+      pfds[0].fd = lfd;
+      pfds[0].events = POLLIN;
+      pflows.clear();
+      for (auto& f : flows)
+      {
+        pollfd p;
+        p.fd = f.second.fd;
+        p.events = POLLIN;
+        pfds.push_back(p);
+        pflows.push_back(&f.second);
+      }
+      rebuild = false;
+    }
+
+    // Sleep until the next packet is due or a datagram arrives
+    int timeout = -1;
+    if (!pending.empty())
+    {
+      int64_t wait = pending.top().due - now_us();
+      timeout = wait <= 0 ? 0 : (int) ((wait + 999) / 1000);
+    }
+    if (poll(pfds.data(), pfds.size(), timeout) == -1 && errno != EINTR)
+    {
+      cerr << "ERROR: Could not poll sockets" << endl;
+      exit(1);
+    }
+
+    // Client -> server
+    if (pfds[0].revents & POLLIN)
+    {
+      sockaddr_in from;
+      socklen_t fromlen = sizeof(from);
+      int n = recvfrom(lfd, buf.data(), buf.size(), 0,
+        (struct sockaddr*) &from, &fromlen);
+      if (n >= 0)
+      {
+        pair<uint32_t, uint16_t> key(from.sin_addr.s_addr, from.sin_port);
+        auto it = flows.find(key);
+        if (it == flows.end() && flows.size() < MAXFLOWS)
+        {
+          Flow f;
+          f.client = from;
+          f.fd = socket(AF_INET, SOCK_DGRAM, 0);
+          if (f.fd < 0 || connect(f.fd, (struct sockaddr*) &server,
+            sizeof(server)) == -1)
+          {
+            cerr << "ERROR: Could not open a socket to the server" << endl;
+            exit(1);
+          }
+          it = flows.insert(make_pair(key, f)).first;
+          rebuild = true;
+        }
+        if (it != flows.end())
+        {
+          enqueue(up, it->second.fd, false, server, buf.data(), n);
+        }
+      }
+    }
+
+    // Server -> client
+    for (size_t i = 1; i < pfds.size(); i++)
+    {
+      if (!(pfds[i].revents & POLLIN))
+      {
+        continue;
+      }
+      int n = recv(pfds[i].fd, buf.data(), buf.size(), 0);
+      if (n >= 0)
+      {
+        enqueue(down, lfd, true, pflows[i - 1]->client, buf.data(), n);
+      }
+    }
+
+    // Deliver what is due
+    int64_t now = now_us();
+    while (!pending.empty() && pending.top().due <= now)
+    {
+      const Pending& p = pending.top();
+      if (p.to_client)
+      {
+        sendto(p.fd, p.data.data(), p.data.size(), 0,
+          (const struct sockaddr*) &p.addr, sizeof(p.addr));
+      }
+      else
+      {
+        send(p.fd, p.data.data(), p.data.size(), 0);
+      }
+      pending.pop();
+    }
+  }
+}
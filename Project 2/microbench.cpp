@@ -0,0 +1,896 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <bits/stdc++.h>
+#include "udpfunctions.h"
+#include "alloccount.h"
+#include "sender.h"
+#include "receiver.h"
+
+#define BATCH 1024                 // operations per timed batch
+#define SAMPLES 7                  // timings per benchmark; the median is reported
+#define PIPELINE_FILE 1048576      // bytes moved by one pipeline transfer
+#define WIRE_SLOTS 1024            // datagrams in flight in the pipeline
+#define WIRE_SLOT_SIZE (sizeof(UDPheader) + DATABUF + MAXOPTIONS + 1 + 63) / 64 * 64
+
+using namespace std;
+
+// Microbenchmarks of the packet path: building and parsing Confundo
+// headers, sending a segment, the server's dispatch of each packet type,
+// the CRC32C kernels, and a whole transfer between a sender and a receiver
+// wired together in memory. Every benchmark reports nanoseconds, user-space instructions
+// (from a perf_event_open counter, when the kernel allows one) and heap
+// allocations per operation, and can be compared with a baseline recorded
+// on the same machine.
+
+// Keep the compiler from optimizing a value away
+template <typename T> inline void sink(const T& v)
+{
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+// A counter of user-space instructions retired by this thread
+class InstructionCounter
+{
+  public:
+    InstructionCounter() : fd(-1)
+    {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fd < 0)
+      {
+        error = errno;
+      }
+    }
+
+    ~InstructionCounter()
+    {
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+    }
+
+    bool available() const
+    {
+      return fd >= 0;
+    }
+
+    int open_error() const
+    {
+      return error;
+    }
+
+    void start()
+    {
+      if (fd >= 0)
+      {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+
+    void stop()
+    {
+      if (fd >= 0)
+      {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+
+    uint64_t read_count()
+    {
+      uint64_t n = 0;
+      if (fd < 0 || read(fd, &n, sizeof(n)) != sizeof(n))
+      {
+        return 0;
+      }
+      return n;
+    }
+
+  private:
+    int fd;
+    int error = 0;
+};
+
+// Accumulates what happens between start() and stop() over all batches of
+// one benchmark; setup outside those calls is not measured
+class Bench
+{
+  public:
+    uint64_t ops = 0;
+
+    Bench(InstructionCounter& counter) : counter(counter),
+      base_instructions(counter.read_count()) {}
+
+    void start()
+    {
+      allocs_at = heap_allocations();
+      counter.start();
+      started = chrono::steady_clock::now();
+    }
+
+    void stop(uint64_t n)
+    {
+      chrono::steady_clock::time_point now = chrono::steady_clock::now();
+      counter.stop();
+      allocs += heap_allocations() - allocs_at;
+      ns += chrono::duration_cast<chrono::nanoseconds>(now - started).count();
+      ops += n;
+    }
+
+    double instructions_per_op()
+    {
+      return ops && counter.available() ?
+        (double) (counter.read_count() - base_instructions) / ops : -1;
+    }
+
+    double allocs_per_op() const
+    {
+      return ops ? (double) allocs / ops : 0;
+    }
+
+    uint64_t elapsed_ns() const
+    {
+      return ns;
+    }
+
+  private:
+    InstructionCounter& counter;
+    uint64_t base_instructions;
+    chrono::steady_clock::time_point started;
+    unsigned long allocs_at = 0;
+    uint64_t allocs = 0;
+    uint64_t ns = 0;
+};
+
+// Time stands still unless the benchmark moves it
+class ManualClock : public Clock
+{
+  public:
+    int64_t now = 0;
+
+    int64_t now_ms()
+    {
+      return now;
+    }
+};
+
+// Throws datagrams away
+class NullSocket : public PacketSocket
+{
+  public:
+    int send(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      sink(pkt);
+      return 0;
+    }
+};
+
+// A one-way in-memory link: a ring of preallocated datagram slots
+class Wire : public PacketSocket
+{
+  public:
+    Wire() : buf(WIRE_SLOTS * WIRE_SLOT_SIZE), head(0), tail(0) {}
+
+    int send(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      put(pkt, payload, len, 0, false);
+      return 0;
+    }
+
+    // The trailer is written straight into the slot, like a socket gathers
+    // it, rather than after a copy of the payload
+    int send_crc(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      pkt->setCrc();
+      put(pkt, payload, len, htonl(packet_crc(pkt, payload, len)), true);
+      return 0;
+    }
+
+    // The oldest datagram and its length, or NULL when there is none
+    char* front(size_t& len)
+    {
+      if (head == tail)
+      {
+        return NULL;
+      }
+      size_t i = head % WIRE_SLOTS;
+      len = sizes[i];
+      return &buf[i * WIRE_SLOT_SIZE];
+    }
+
+    void pop()
+    {
+      head++;
+    }
+
+  private:
+    vector<char> buf;
+    size_t sizes[WIRE_SLOTS];
+    size_t head, tail;
+
+    void put(UDPpacket* pkt, const char* payload, size_t len, uint32_t crc,
+      bool trailer)
+    {
+      size_t size = sizeof(UDPheader) + len + (trailer ? CRC_TRAILER : 0);
+      if (tail - head == WIRE_SLOTS || size > WIRE_SLOT_SIZE)
+      {
+        cerr << "ERROR: Pipeline wire overflow" << endl;
+        exit(1);
+      }
+      size_t i = tail++ % WIRE_SLOTS;
+      char* slot = &buf[i * WIRE_SLOT_SIZE];
+      memcpy(slot, pkt, sizeof(UDPheader));
+      if (len)
+      {
+        memcpy(slot + sizeof(UDPheader), payload, len);
+      }
+      if (trailer)
+      {
+        memcpy(slot + sizeof(UDPheader) + len, &crc, CRC_TRAILER);
+      }
+      sizes[i] = size;
+    }
+};
+
+sockaddr_in client_address(int i)
+{
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(5000);
+  addr.sin_addr.s_addr = htonl(0x0a000000 + i);
+  return addr;
+}
+
+// A receiver with n connections through the handshake
+void open_connections(ConfundoReceiver& r, int n)
+{
+  char buf[64] __attribute__((aligned(8)));
+  for (int i = 0; i < n; i++)
+  {
+    sockaddr_in addr = client_address(i);
+    UDPpacket* syn = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ), 0, 0, 0, 1,
+      0, NULL);
+    r.handle(syn, syn->getpayload(), 0, addr);
+    Connection* c = r.connections().find(addr, i + 1);
+    UDPpacket* ack = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ + 1),
+      htonl(SRVR_DEFAULT_SEQ + 1), htons(c->connId), 1, 0, 0, NULL);
+    r.handle(ack, ack->getpayload(), 0, addr);
+  }
+}
+
+// Drops payloads instead of writing them
+class NullSink : public FileSink
+{
+  public:
+    void write(Connection& c)
+    {
+      sink(c);
+      c.data.clear();
+    }
+
+    void finish(Connection& c, bool)
+    {
+      sink(c);
+    }
+};
+
+NullSink save_nothing;
+
+// Construct headers in place, as the pool does
+void bench_packet_construct(Bench& b)
+{
+  char buf[BATCH][sizeof(UDPheader)] __attribute__((aligned(8)));
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    UDPpacket* p = new (buf[i]) UDPpacket(htonl(CLNT_DEFAULT_SEQ + i),
+      htonl(SRVR_DEFAULT_SEQ), htons(1), 1, 0, 0, NULL);
+    sink(p);
+  }
+  b.stop(BATCH);
+}
+
+// Take a buffer from a warm pool, build a header in it and give it back
+void bench_pool_make(Bench& b)
+{
+  static PacketPool pool;
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    PacketRef p = pool.make(htonl(CLNT_DEFAULT_SEQ + i),
+      htonl(SRVR_DEFAULT_SEQ), htons(1), 1, 0, 0);
+    sink(p);
+  }
+  b.stop(BATCH);
+}
+
+// Byte-swap the numbers out of received headers
+void bench_header_decode(Bench& b)
+{
+  static vector<UDPheader> hdrs;
+  if (hdrs.empty())
+  {
+    hdrs.resize(BATCH);
+    for (int i = 0; i < BATCH; i++)
+    {
+      new (&hdrs[i]) UDPpacket(htonl(CLNT_DEFAULT_SEQ + i * DATABUF),
+        htonl(SRVR_DEFAULT_SEQ), htons(i), i & 1, 0, 0, NULL);
+    }
+  }
+  unsigned int sum = 0;
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    const UDPpacket* p = reinterpret_cast<const UDPpacket*> (&hdrs[i]);
+    sum += p->getSeq() + p->getAck() + p->getconnID();
+  }
+  b.stop(BATCH);
+  sink(sum);
+}
+
+// Classify received headers by their flags
+void bench_flag_accessors(Bench& b)
+{
+  static vector<UDPheader> hdrs;
+  if (hdrs.empty())
+  {
+    hdrs.resize(BATCH);
+    for (int i = 0; i < BATCH; i++)
+    {
+      new (&hdrs[i]) UDPpacket(0, 0, 0, i & 1, (i >> 1) & 1, (i >> 2) & 1,
+        NULL);
+    }
+  }
+  int kinds[5] = { 0, 0, 0, 0, 0 };
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    const UDPpacket* p = reinterpret_cast<const UDPpacket*> (&hdrs[i]);
+    kinds[p->isSyn() ? 0 : p->isProbe() ? 1 : p->isAck() ? 2 :
+      p->isFin() ? 3 : 4]++;
+  }
+  b.stop(BATCH);
+  sink(kinds);
+}
+
+// A loopback socket to send to, drained between batches
+class SendTarget
+{
+  public:
+    int fd, sink_fd;
+    sockaddr_in addr;
+
+    SendTarget()
+    {
+      sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+      fd = socket(AF_INET, SOCK_DGRAM, 0);
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof(addr);
+      if (sink_fd < 0 || fd < 0 ||
+        bind(sink_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        getsockname(sink_fd, (struct sockaddr*) &addr, &len) == -1)
+      {
+        cerr << "ERROR: Could not open a loopback socket" << endl;
+        exit(1);
+      }
+      fcntl(sink_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    void drain()
+    {
+      char buf[MAXDGRAM];
+      while (recv(sink_fd, buf, sizeof(buf), 0) > 0)
+      {
+      }
+    }
+};
+
+// A header-plus-payload packet through sendto
+void bench_udpsend(Bench& b)
+{
+  static SendTarget target;
+  static char buf[sizeof(UDPheader) + DATABUF] __attribute__((aligned(8)));
+  UDPpacket* p = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ), 0, htons(1), 0,
+    0, 0, NULL);
+  target.drain();
+  b.start();
+  for (int i = 0; i < BATCH / 16; i++)
+  {
+    UDPsend(p, target.fd, target.addr);
+  }
+  b.stop(BATCH / 16);
+}
+
+// A pooled header and a payload elsewhere, gathered by sendmsg
+void bench_udpsendv(Bench& b)
+{
+  static SendTarget target;
+  static char payload[DATABUF];
+  char buf[sizeof(UDPheader)] __attribute__((aligned(8)));
+  UDPpacket* p = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ), 0, htons(1), 0,
+    0, 0, NULL);
+  target.drain();
+  b.start();
+  for (int i = 0; i < BATCH / 16; i++)
+  {
+    UDPsendv(p, payload, DATABUF, target.fd, target.addr);
+  }
+  b.stop(BATCH / 16);
+}
+
+// The server's handling of each kind of packet, minus the socket
+void bench_dispatch_syn(Bench& b)
+{
+  ManualClock clock;
+  NullSocket sock;
+  ConfundoReceiver r(clock, sock, save_nothing);
+  char buf[64] __attribute__((aligned(8)));
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    UDPpacket* syn = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ), 0, 0, 0, 1,
+      0, NULL);
+    r.handle(syn, syn->getpayload(), 0, client_address(i));
+  }
+  b.stop(BATCH);
+}
+
+// The same SYNs answered with cookies, as under a SYN flood
+void bench_dispatch_syn_cookie(Bench& b)
+{
+  ManualClock clock;
+  NullSocket sock;
+  SynCookies cookies(1, 2);
+  ConfundoReceiver r(clock, sock, save_nothing);
+  r.set_cookies(&cookies, 0);
+  char buf[64] __attribute__((aligned(8)));
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    UDPpacket* syn = new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ), 0, 0, 0, 1,
+      0, NULL);
+    r.handle(syn, syn->getpayload(), 0, client_address(i));
+  }
+  b.stop(BATCH);
+}
+
+void bench_dispatch_data(Bench& b)
+{
+  static vector<char> segs;
+  if (segs.empty())
+  {
+    segs.resize(BATCH * (sizeof(UDPheader) + DATABUF));
+  }
+  ManualClock clock;
+  NullSocket sock;
+  ConfundoReceiver r(clock, sock, save_nothing);
+  open_connections(r, 1);
+  SeqSpace seqs;
+  for (int i = 0; i < BATCH; i++)
+  {
+    new (&segs[i * (sizeof(UDPheader) + DATABUF)]) UDPpacket(
+      htonl(seqs.add(CLNT_DEFAULT_SEQ + 1, (uint64_t) i * DATABUF)), 0,
+      htons(1), 0, 0, 0, NULL);
+  }
+  sockaddr_in addr = client_address(0);
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    UDPpacket* p = reinterpret_cast<UDPpacket*> (
+      &segs[i * (sizeof(UDPheader) + DATABUF)]);
+    r.handle(p, p->getpayload(), DATABUF, addr);
+  }
+  b.stop(BATCH);
+}
+
+// A FIN, then the ACK of the server's FIN, on each of BATCH connections
+void bench_dispatch_fin(Bench& b, bool ack)
+{
+  ManualClock clock;
+  NullSocket sock;
+  ConfundoReceiver r(clock, sock, save_nothing);
+  open_connections(r, BATCH);
+  char buf[64] __attribute__((aligned(8)));
+  for (int pass = 0; pass < 2; pass++)
+  {
+    bool timed = (pass == 1) == ack;
+    if (timed)
+    {
+      b.start();
+    }
+    for (int i = 0; i < BATCH; i++)
+    {
+      UDPpacket* p = pass == 0 ?
+        new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ + 1), 0, htons(i + 1), 0,
+          0, 1, NULL) :
+        new (buf) UDPpacket(htonl(CLNT_DEFAULT_SEQ + 2),
+          htonl(SRVR_DEFAULT_SEQ + 2), htons(i + 1), 1, 0, 0, NULL);
+      r.handle(p, p->getpayload(), 0, client_address(i));
+    }
+    if (timed)
+    {
+      b.stop(BATCH);
+    }
+  }
+}
+
+void bench_dispatch_fin(Bench& b)
+{
+  bench_dispatch_fin(b, false);
+}
+
+void bench_dispatch_ack(Bench& b)
+{
+  bench_dispatch_fin(b, true);
+}
+
+// CRC32C of BATCH segments of DATABUF bytes with one kernel, or with the
+// portable one on a CPU without the instructions
+void bench_crc32c(Bench& b, Crc32cKernel kernel)
+{
+  static vector<char> segs;
+  if (segs.empty())
+  {
+    segs.resize(BATCH * DATABUF);
+    mt19937 rng(1);
+    for (size_t i = 0; i < segs.size(); i++)
+    {
+      segs[i] = (char) rng();
+    }
+  }
+  uint32_t crc = 0;
+  b.start();
+  for (int i = 0; i < BATCH; i++)
+  {
+    crc = kernel(crc, (const uint8_t*) &segs[i * DATABUF], DATABUF);
+  }
+  b.stop(BATCH);
+  sink(crc);
+}
+
+void bench_crc32c_portable(Bench& b)
+{
+  bench_crc32c(b, crc32c_portable);
+}
+
+#if defined(__x86_64__)
+void bench_crc32c_sse42(Bench& b)
+{
+  __builtin_cpu_init();
+  bench_crc32c(b, __builtin_cpu_supports("sse4.2") ? crc32c_sse42 :
+    crc32c_portable);
+}
+
+void bench_crc32c_3way(Bench& b)
+{
+  __builtin_cpu_init();
+  bench_crc32c(b, __builtin_cpu_supports("sse4.2") &&
+    __builtin_cpu_supports("pclmul") ? crc32c_3way : crc32c_portable);
+}
+#endif
+
+// A whole transfer, handshake to FIN wait, between a sender and a receiver
+// joined by in-memory wires; one operation is one data segment and its ACK.
+// With crc, every packet carries a CRC trailer and the file is checked at
+// the FIN.
+void bench_pipeline(Bench& b, bool crc)
+{
+  static vector<char> file;
+  static Wire up, down;
+  if (file.empty())
+  {
+    file.resize(PIPELINE_FILE, 'x');
+  }
+  ManualClock clock;
+  ConnStats stats;
+  ConfundoReceiver r(clock, down, save_nothing);
+  ConfundoSender s(clock, up, client_address(-1), file.data(), file.size(),
+    stats, -1, 0, 0, false, 0, crc);
+  sockaddr_in addr = client_address(0);
+  b.start();
+  s.start();
+  while (!s.finished())
+  {
+    bool moved = false;
+    size_t len;
+    while (char* d = up.front(len))
+    {
+      r.handle(reinterpret_cast<UDPpacket*> (d), d + sizeof(UDPheader),
+        len - sizeof(UDPheader), addr);
+      up.pop();
+      moved = true;
+    }
+    while (char* d = down.front(len))
+    {
+      s.on_datagram(d, len);
+      down.pop();
+      moved = true;
+    }
+    if (!moved)
+    {
+      int64_t ack_due = r.next_ack_due();
+      clock.now = ack_due ? min(ack_due, s.deadline()) : s.deadline();
+      r.send_delayed_acks(clock.now);
+      s.on_timer();
+    }
+  }
+  b.stop(PIPELINE_FILE / DATABUF);
+}
+
+void bench_pipeline(Bench& b)
+{
+  bench_pipeline(b, false);
+}
+
+void bench_pipeline_crc(Bench& b)
+{
+  bench_pipeline(b, true);
+}
+
+struct Benchmark
+{
+  const char* name;
+  void (*run)(Bench&);
+};
+
+const Benchmark benchmarks[] = {
+  { "packet_construct", bench_packet_construct },
+  { "pool_make", bench_pool_make },
+  { "header_decode", bench_header_decode },
+  { "flag_accessors", bench_flag_accessors },
+  { "udpsend", bench_udpsend },
+  { "udpsendv", bench_udpsendv },
+  { "dispatch_syn", bench_dispatch_syn },
+  { "dispatch_syn_cookie", bench_dispatch_syn_cookie },
+  { "dispatch_data", bench_dispatch_data },
+  { "dispatch_fin", bench_dispatch_fin },
+  { "dispatch_ack", bench_dispatch_ack },
+  { "crc32c_portable", bench_crc32c_portable },
+#if defined(__x86_64__)
+  { "crc32c_sse42", bench_crc32c_sse42 },
+  { "crc32c_3way", bench_crc32c_3way },
+#endif
+  { "pipeline", bench_pipeline },
+  { "pipeline_crc", bench_pipeline_crc },
+};
+
+struct Result
+{
+  double ns, instructions, allocs;
+};
+
+// The machine a baseline was recorded on: its host name and CPU model.
+// Times only compare between runs on the same one.
+string machine_id()
+{
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  string cpu;
+  ifstream info("/proc/cpuinfo");
+  string line;
+  while (getline(info, line))
+  {
+    if (line.compare(0, 10, "model name") == 0)
+    {
+      cpu = line.substr(line.find(':') + 2);
+      break;
+    }
+  }
+  return string(host) + " / " + cpu;
+}
+
+// name,ns,instructions,allocs per line; instructions are -1 if not counted.
+// A "# machine: " line names the machine it was recorded on.
+map<string, Result> read_baseline(const char* path, string& machine)
+{
+  map<string, Result> results;
+  ifstream in(path);
+  if (!in)
+  {
+    cerr << "ERROR: Could not read baseline " << path << endl;
+    exit(1);
+  }
+  string line;
+  while (getline(in, line))
+  {
+    if (line.compare(0, 11, "# machine: ") == 0)
+    {
+      machine = line.substr(11);
+      continue;
+    }
+    char name[64];
+    Result r;
+    if (line.empty() || line[0] == '#' || sscanf(line.c_str(),
+      "%63[^,],%lf,%lf,%lf", name, &r.ns, &r.instructions, &r.allocs) != 4)
+    {
+      continue;
+    }
+    results[name] = r;
+  }
+  return results;
+}
+
+// Relative change from the baseline, as a column
+string change(double now, double base)
+{
+  if (now < 0 || base < 0)
+  {
+    return "n/a";
+  }
+  if (base == 0)
+  {
+    return now == 0 ? "=" : "new";
+  }
+  char s[32];
+  snprintf(s, sizeof(s), "%+.1f%%", (now - base) * 100 / base);
+  return s;
+}
+
+int main(int argc, char *argv[])
+{
+  double min_seconds = 0.2;
+  double threshold = 25;
+  const char* baseline_path = NULL;
+  const char* output_path = NULL;
+  const char* filter = "";
+  int opt;
+  while ((opt = getopt(argc, argv, "t:b:o:r:f:")) != -1)
+  {
+    if (opt == 't')
+    {
+      min_seconds = atof(optarg);
+    }
+    else if (opt == 'b')
+    {
+      baseline_path = optarg;
+    }
+    else if (opt == 'o')
+    {
+      output_path = optarg;
+    }
+    else if (opt == 'r')
+    {
+      threshold = atof(optarg);
+    }
+    else if (opt == 'f')
+    {
+      filter = optarg;
+    }
+    else
+    {
+      cerr << "ERROR: usage: " << argv[0] << " [-t SECONDS] [-f FILTER]"
+        << " [-b BASELINE] [-r PERCENT] [-o OUTPUT]" << endl;
+      exit(1);
+    }
+  }
+  map<string, Result> baseline;
+  string machine = machine_id(), base_machine;
+  if (baseline_path)
+  {
+    baseline = read_baseline(baseline_path, base_machine);
+    if (base_machine != machine)
+    {
+      cerr << "WARNING: Baseline recorded on another machine ("
+        << (base_machine.empty() ? "unknown" : base_machine)
+        << "), times are not compared" << endl;
+    }
+  }
+
+  // Keep freed memory in the heap rather than returning it to the kernel,
+  // or whether a connection's buffer comes back with fresh pages to fault
+  // in varies from batch to batch
+  mallopt(M_MMAP_THRESHOLD, 1 << 30);
+  mallopt(M_TRIM_THRESHOLD, 1 << 30);
+
+  InstructionCounter counter;
+  if (!counter.available())
+  {
+    cerr << "WARNING: No instruction counter (perf_event_open: "
+      << strerror(counter.open_error()) << ")" << endl;
+  }
+
+  printf("%-18s %10s %10s %10s", "benchmark", "ns/op", "instr/op",
+    "allocs/op");
+  if (baseline_path)
+  {
+    printf(" %9s %9s %9s", "ns", "instr", "allocs");
+  }
+  printf("\n");
+
+  ofstream out;
+  if (output_path)
+  {
+    out.open(output_path);
+    out << "# machine: " << machine << endl;
+    out << "# name,ns,instructions,allocs per operation" << endl;
+  }
+  int regressions = 0;
+  for (const Benchmark& bm : benchmarks)
+  {
+    if (!strstr(bm.name, filter))
+    {
+      continue;
+    }
+    // One batch to warm up, then samples of batches until each has run its
+    // share of the time. The median sample is the least disturbed by
+    // whatever else the machine is doing.
+    Bench warmup(counter);
+    bm.run(warmup);
+    Bench b(counter);
+    vector<double> samples;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+      uint64_t ns = b.elapsed_ns(), ops = b.ops;
+      while (b.elapsed_ns() - ns < min_seconds * 1e9 / SAMPLES)
+      {
+        bm.run(b);
+      }
+      samples.push_back((double) (b.elapsed_ns() - ns) / (b.ops - ops));
+    }
+    sort(samples.begin(), samples.end());
+    Result r = { samples[SAMPLES / 2], b.instructions_per_op(),
+      b.allocs_per_op() };
+
+    printf("%-18s %10.1f ", bm.name, r.ns);
+    if (r.instructions >= 0)
+    {
+      printf("%10.1f", r.instructions);
+    }
+    else
+    {
+      printf("%10s", "n/a");
+    }
+    printf(" %10.3f", r.allocs);
+    if (output_path)
+    {
+      out << bm.name << "," << r.ns << "," << r.instructions << "," << r.allocs
+        << endl;
+    }
+
+    // Instruction and allocation counts are stable enough to gate on, where
+    // both runs have them; time only without instruction counts, and only
+    // against a baseline from this machine
+    auto base = baseline.find(bm.name);
+    if (base != baseline.end())
+    {
+      const Result& o = base->second;
+      printf(" %9s %9s %9s", change(r.ns, o.ns).c_str(),
+        change(r.instructions, o.instructions).c_str(),
+        change(r.allocs, o.allocs).c_str());
+      bool counted = r.instructions >= 0 && o.instructions >= 0;
+      bool timed = !counted && base_machine == machine;
+      if ((counted && r.instructions > o.instructions * (1 + threshold / 100)) ||
+        (timed && r.ns > o.ns * (1 + threshold / 100)) ||
+        (o.allocs >= 0 && r.allocs > o.allocs * (1 + threshold / 100) + 0.001))
+      {
+        printf("  REGRESSION");
+        regressions++;
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+  return regressions ? 1 : 0;
+}
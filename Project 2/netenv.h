@@ -0,0 +1,106 @@
+#ifndef NETENV_H
+#define NETENV_H
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <vector>
+#include "udpfunctions.h"
+#include "crc32c.h"
+
+// ms a TCP upload may go without progress, on either end; Project 1's TIMEOUT
+#define TCP_TIMEOUT 15000
+
+using namespace std;
+
+// What a Confundo endpoint needs from the outside world: the time, and a way
+// to send datagrams. The programs use the system clock and a UDP socket;
+// the simulator (confundosim) substitutes virtual time and a modeled link.
+
+class Clock
+{
+  public:
+    virtual ~Clock() {}
+    virtual int64_t now_ms() = 0;
+};
+
+class PacketSocket
+{
+  public:
+    virtual ~PacketSocket() {}
+
+    // Send the header of pkt followed by len bytes of payload to addr;
+    // returns 0, or the errno value if the datagram could not be sent
+    virtual int send(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr) = 0;
+
+    // The same with a CRC trailer (crc32c.h): the packet is flagged, and
+    // the CRC of its header and payload follows the payload. Sockets that
+    // cannot gather the trailer get a copy of the payload with it.
+    virtual int send_crc(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      pkt->setCrc();
+      uint32_t crc = htonl(packet_crc(pkt, payload, len));
+      staging.resize(len + CRC_TRAILER);
+      if (len)
+      {
+        memcpy(staging.data(), payload, len);
+      }
+      memcpy(staging.data() + len, &crc, CRC_TRAILER);
+      return send(pkt, staging.data(), staging.size(), addr);
+    }
+
+    // Have datagrams larger than the path MTU dropped rather than
+    // fragmented, for path MTU probing
+    virtual void set_dont_fragment() {}
+
+  private:
+    vector<char> staging;
+};
+
+class SystemClock : public Clock
+{
+  public:
+    int64_t now_ms()
+    {
+      return ::now_ms();
+    }
+};
+
+class UdpSocket : public PacketSocket
+{
+  public:
+    explicit UdpSocket(int sockfd = -1) : sockfd(sockfd) {}
+
+    int send(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      return UDPsendv(pkt, payload, len, sockfd, addr) ? 0 : errno;
+    }
+
+    int send_crc(UDPpacket* pkt, const char* payload, size_t len,
+      const sockaddr_in& addr)
+    {
+      pkt->setCrc();
+      uint32_t crc = htonl(packet_crc(pkt, payload, len));
+      return UDPsendv(pkt, payload, len, sockfd, addr, (const char*) &crc,
+        CRC_TRAILER) ? 0 : errno;
+    }
+
+    void set_dont_fragment()
+    {
+      int pmtudisc = IP_PMTUDISC_PROBE;
+      setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc,
+        sizeof(pmtudisc));
+    }
+
+    int fd() const
+    {
+      return sockfd;
+    }
+
+  private:
+    int sockfd;
+};
+
+#endif
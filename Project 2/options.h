@@ -0,0 +1,250 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OPT_WSCALE 1      // 1 byte: window shift, implies 32-bit sequence numbers
+#define OPT_MSS 2         // 2 bytes: largest segment payload the sender accepts
+#define OPT_ACKFREQ 3     // 1 byte: data segments per ACK the receiver may wait for
+#define OPT_RCVBUF 4      // 4 bytes: receive buffer; ACKs then advertise a window
+#define OPT_FEC 5         // 1 byte: largest block of segments sent with one parity
+#define OPT_STREAMS 6     // no value: the byte stream carries frames of several files
+#define OPT_TOKEN 7       // 8 bytes: resumption token (resumption.h)
+#define OPT_EARLY 8       // 4 bytes: bytes of the SYN's data the server took
+#define OPT_CRC 9         // no value: packets end with a CRC32C (crc32c.h)
+#define OPT_LOCAL 10      // no value, or the same-host path's rendezvous (localpath.h)
+#define MAXWSCALE 14
+#define MAXACKFREQ 32
+#define MINFECBLOCK 2
+#define MAXFECBLOCK 16
+#define MAXOPTIONS 255    // longest option block
+#define MAXLOCALPATH 108  // longest rendezvous path, with its terminator
+
+// Options negotiated in the SYN/SYN-ACK exchange. When a packet has the OPT
+// flag set, its payload starts with a length byte followed by that many bytes
+// of (kind, length, value) options; unknown kinds are skipped.
+struct ConfundoOptions
+{
+  int wscale;  // -1 when absent
+  int mss;     // 0 when absent
+  int ackfreq; // 0 when absent
+  long rcvbuf; // -1 when absent; a client asks with 0
+  int fecblock; // 0 when absent
+  bool streams;
+  int64_t token; // -1 when absent; a client asks with 0
+  long early;    // -1 when absent
+  bool crc;
+  bool local;
+  // With local, the server's offer: the client's address and port as the
+  // server sees them (network order), a tag, and the rendezvous socket's
+  // path; an empty path when the client asks
+  uint32_t local_addr;
+  uint16_t local_port;
+  uint64_t local_tag;
+  char local_path[MAXLOCALPATH];
+
+  ConfundoOptions() : wscale(-1), mss(0), ackfreq(0), rcvbuf(-1),
+    fecblock(0), streams(false), token(-1), early(-1), crc(false),
+    local(false), local_addr(0), local_port(0), local_tag(0)
+  {
+    local_path[0] = '\0';
+  }
+
+  bool empty() const
+  {
+    return wscale < 0 && mss == 0 && ackfreq == 0 && rcvbuf < 0 &&
+      fecblock == 0 && !streams && token < 0 && early < 0 && !crc && !local;
+  }
+
+  // Serialize into buf, returning the bytes written (length byte included)
+  size_t encode(char* buf) const
+  {
+    size_t n = 1;
+    if (wscale >= 0)
+    {
+      buf[n++] = OPT_WSCALE;
+      buf[n++] = 3;
+      buf[n++] = (char) wscale;
+    }
+    if (mss > 0)
+    {
+      buf[n++] = OPT_MSS;
+      buf[n++] = 4;
+      buf[n++] = (char) (mss >> 8);
+      buf[n++] = (char) (mss & 0xff);
+    }
+    if (ackfreq > 0)
+    {
+      buf[n++] = OPT_ACKFREQ;
+      buf[n++] = 3;
+      buf[n++] = (char) ackfreq;
+    }
+    if (rcvbuf >= 0)
+    {
+      buf[n++] = OPT_RCVBUF;
+      buf[n++] = 6;
+      for (int shift = 24; shift >= 0; shift -= 8)
+      {
+        buf[n++] = (char) (rcvbuf >> shift);
+      }
+    }
+    if (fecblock > 0)
+    {
+      buf[n++] = OPT_FEC;
+      buf[n++] = 3;
+      buf[n++] = (char) fecblock;
+    }
+    if (streams)
+    {
+      buf[n++] = OPT_STREAMS;
+      buf[n++] = 2;
+    }
+    if (token >= 0)
+    {
+      buf[n++] = OPT_TOKEN;
+      buf[n++] = 10;
+      for (int shift = 56; shift >= 0; shift -= 8)
+      {
+        buf[n++] = (char) (token >> shift);
+      }
+    }
+    if (early >= 0)
+    {
+      buf[n++] = OPT_EARLY;
+      buf[n++] = 6;
+      for (int shift = 24; shift >= 0; shift -= 8)
+      {
+        buf[n++] = (char) (early >> shift);
+      }
+    }
+    if (crc)
+    {
+      buf[n++] = OPT_CRC;
+      buf[n++] = 2;
+    }
+    if (local)
+    {
+      size_t path_len = strlen(local_path);
+      buf[n++] = OPT_LOCAL;
+      buf[n++] = (char) (path_len ? 16 + path_len : 2);
+      if (path_len)
+      {
+        memcpy(buf + n, &local_addr, 4);
+        memcpy(buf + n + 4, &local_port, 2);
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+          buf[n + 6 + (56 - shift) / 8] = (char) (local_tag >> shift);
+        }
+        memcpy(buf + n + 14, local_path, path_len);
+        n += 14 + path_len;
+      }
+    }
+    buf[0] = (char) (n - 1);
+    return n;
+  }
+
+  // Parse the option block at the start of a payload of size bytes. Returns
+  // the bytes consumed, or 0 when the block is malformed.
+  size_t decode(const char* buf, size_t size)
+  {
+    if (size < 1 || (uint8_t) buf[0] + 1u > size)
+    {
+      return 0;
+    }
+    size_t end = (uint8_t) buf[0] + 1;
+    size_t i = 1;
+    while (i + 2 <= end)
+    {
+      uint8_t kind = buf[i];
+      uint8_t len = buf[i + 1];
+      if (len < 2 || i + len > end)
+      {
+        return 0;
+      }
+      if (kind == OPT_WSCALE && len == 3)
+      {
+        wscale = (uint8_t) buf[i + 2];
+        if (wscale > MAXWSCALE)
+        {
+          wscale = MAXWSCALE;
+        }
+      }
+      else if (kind == OPT_MSS && len == 4)
+      {
+        mss = ((uint8_t) buf[i + 2] << 8) | (uint8_t) buf[i + 3];
+      }
+      else if (kind == OPT_ACKFREQ && len == 3)
+      {
+        ackfreq = (uint8_t) buf[i + 2];
+        if (ackfreq > MAXACKFREQ)
+        {
+          ackfreq = MAXACKFREQ;
+        }
+      }
+      else if (kind == OPT_RCVBUF && len == 6)
+      {
+        rcvbuf = 0;
+        for (int j = 2; j < 6; j++)
+        {
+          rcvbuf = (rcvbuf << 8) | (uint8_t) buf[i + j];
+        }
+      }
+      else if (kind == OPT_FEC && len == 3)
+      {
+        fecblock = (uint8_t) buf[i + 2];
+        if (fecblock > MAXFECBLOCK)
+        {
+          fecblock = MAXFECBLOCK;
+        }
+      }
+      else if (kind == OPT_STREAMS && len == 2)
+      {
+        streams = true;
+      }
+      else if (kind == OPT_TOKEN && len == 10)
+      {
+        uint64_t t = 0;
+        for (int j = 2; j < 10; j++)
+        {
+          t = (t << 8) | (uint8_t) buf[i + j];
+        }
+        token = (int64_t) (t & 0x7fffffffffffffffULL);
+      }
+      else if (kind == OPT_CRC && len == 2)
+      {
+        crc = true;
+      }
+      else if (kind == OPT_LOCAL && (len == 2 ||
+        (len > 16 && len - 16 < MAXLOCALPATH)))
+      {
+        local = true;
+        if (len > 2)
+        {
+          memcpy(&local_addr, buf + i + 2, 4);
+          memcpy(&local_port, buf + i + 6, 2);
+          local_tag = 0;
+          for (int j = 8; j < 16; j++)
+          {
+            local_tag = (local_tag << 8) | (uint8_t) buf[i + j];
+          }
+          memcpy(local_path, buf + i + 16, len - 16);
+          local_path[len - 16] = '\0';
+        }
+      }
+      else if (kind == OPT_EARLY && len == 6)
+      {
+        early = 0;
+        for (int j = 2; j < 6; j++)
+        {
+          early = (early << 8) | (uint8_t) buf[i + j];
+        }
+      }
+      i += len;
+    }
+    return end;
+  }
+};
+
+#endif
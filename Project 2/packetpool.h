@@ -0,0 +1,117 @@
+#ifndef PACKETPOOL_H
+#define PACKETPOOL_H
+
+#include <stdlib.h>
+#include <memory>
+#include <new>
+#include <vector>
+#include "udpheader.h"
+
+// Header plus a default-size payload, in whole cache lines
+#define PACKET_SLOT ((sizeof(UDPheader) + DATABUF + 63) / 64 * 64)
+#define POOL_PACKETS 64  // slots per arena chunk
+
+using namespace std;
+
+class PacketPool;
+
+// Returns a packet to the pool it came from when its PacketRef goes away
+struct PacketRelease
+{
+  PacketPool* pool;
+  void operator()(UDPpacket* p) const;
+};
+
+// Unique owner of a pooled packet buffer
+typedef unique_ptr<UDPpacket, PacketRelease> PacketRef;
+
+// Arena of preallocated, cache-line aligned packet buffers. Buffers are
+// recycled through a free list, so once the pool has grown to the number of
+// packets a connection keeps in flight, sending does no heap allocation.
+// Not thread-safe; each thread that builds packets owns its own pool.
+class PacketPool
+{
+  public:
+    explicit PacketPool(size_t n = POOL_PACKETS) : chunk(n), live(0), peak(0)
+    {
+      grow();
+    }
+
+    ~PacketPool()
+    {
+      for (size_t i = 0; i < chunks.size(); i++)
+      {
+        free(chunks[i]);
+      }
+    }
+
+    // Build a packet in place in a free buffer; the arguments are the same as
+    // for the UDPpacket constructor. Payloads larger than DATABUF must be
+    // sent from their own buffer with UDPsendv.
+    PacketRef make(unsigned int seqnum, unsigned int acknum, short int connId,
+      int ack, int syn, int fin, char* payload = NULL, size_t payload_size = 0)
+    {
+      if (free_slots.empty())
+      {
+        grow();
+      }
+      char* slot = free_slots.back();
+      free_slots.pop_back();
+      live++;
+      peak = max(peak, live);
+      PacketRelease r = { this };
+      return PacketRef(new (slot) UDPpacket(seqnum, acknum, connId, ack, syn,
+        fin, payload, payload_size), r);
+    }
+
+    void put(UDPpacket* p)
+    {
+      free_slots.push_back(reinterpret_cast<char*>(p));
+      live--;
+    }
+
+    // Number of buffers the pool has allocated in total
+    size_t capacity() const
+    {
+      return chunks.size() * chunk;
+    }
+
+    size_t in_use() const
+    {
+      return live;
+    }
+
+    size_t peak_in_use() const
+    {
+      return peak;
+    }
+
+  private:
+    size_t chunk;
+    size_t live;
+    size_t peak;
+    vector<char*> chunks;
+    vector<char*> free_slots;
+
+    void grow()
+    {
+      void* mem = NULL;
+      if (posix_memalign(&mem, 64, chunk * PACKET_SLOT) != 0)
+      {
+        throw bad_alloc();
+      }
+      chunks.push_back(static_cast<char*>(mem));
+      free_slots.reserve(chunks.size() * chunk);
+      for (size_t i = chunk; i > 0; i--)
+      {
+        free_slots.push_back(static_cast<char*>(mem) + (i - 1) * PACKET_SLOT);
+      }
+    }
+};
+
+inline void PacketRelease::operator()(UDPpacket* p) const
+{
+  pool->put(p);
+}
+
+#endif
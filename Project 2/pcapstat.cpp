@@ -0,0 +1,912 @@
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <bits/stdc++.h>
+#include "udpheader.h"
+#include "options.h"
+#include "seqnum.h"
+#include "filesource.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4     // microsecond timestamps
+#define PCAP_MAGIC_NS 0xa1b23c4d  // nanosecond timestamps
+#define PCAP_HEADER 24
+#define PCAP_RECORD 16
+#define LINKTYPE_NULL 0       // 4-byte address family in the capturer's order
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101      // bare IP
+#define LINKTYPE_LOOP 108     // 4-byte address family in network order
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+#define REORDER_WINDOW 3000000  // ns a hole may wait to be reordered, before
+                                // there is an RTT to go by
+
+using namespace std;
+
+// Reconstructs what happened to every Confundo connection in a pcap capture
+// (tcpdump -w, Wireshark): throughput and goodput, retransmissions and
+// reordering, RTT samples, and the bytes in flight, which is the sender's
+// congestion window as far as the wire shows it. Prints a CSV row per
+// connection, or with -i a row per connection and interval of that many ms;
+// -j prints JSON instead. -p keeps only datagrams to or from a server port.
+//
+// The capture is mapped and read once front to back, with nothing copied
+// and no state kept per packet, so it goes at the speed of the disk. IPv4 is
+// read off Ethernet, loopback, Linux cooked and raw IP links.
+//
+// A connection is known by the client's and the server's address and port
+// and its connId. Its handshake, when in the capture, gives the initial
+// sequence number and whether it uses 32-bit sequence numbers; one caught
+// midway starts at its first data segment. Data that was all seen before is
+// a retransmission, and data that fills a hole is reordered if it comes
+// within the smallest RTT of the hole opening, and retransmitted if later.
+// An ACK that moves forward samples the RTT of the segment it covers,
+// unless that was sent more than once (Karn). The RTTs are those from the
+// point of capture, so capture on the client for the path's own.
+
+struct Frame
+{
+  int64_t t;  // ns since the first packet
+  uint32_t saddr;
+  uint32_t daddr;
+  uint16_t sport;
+  uint16_t dport;
+  const UDPpacket* pkt;
+  long payload_size;  // on the wire, less any window and CRC trailer
+  long captured;      // of that, in the capture
+};
+
+struct Bin
+{
+  uint64_t bytes;
+  uint64_t acked;
+  long retransmits;
+  long reordered;
+  long rtt_samples;
+  double rtt_sum;
+  uint64_t flight_max;
+
+  Bin() : bytes(0), acked(0), retransmits(0), reordered(0), rtt_samples(0),
+    rtt_sum(0), flight_max(0) {}
+};
+
+// New data as it was first sent, until ACKed
+struct Sent
+{
+  uint64_t start;
+  uint64_t end;
+  int64_t t;
+  bool ambiguous;  // sent more than once: no RTT sample
+};
+
+struct Flow
+{
+  uint32_t caddr;
+  uint32_t saddr;
+  uint16_t cport;
+  uint16_t sport;
+  uint16_t connId;
+  SeqSpace seqs;
+  unsigned int isn;  // the client's; data at offset n has sequence isn+1+n
+  int64_t start;
+  int64_t last;
+  int64_t handshake_rtt;  // -1 without a handshake, or when the SYN was resent
+
+  uint64_t highest;  // end of the furthest data sent
+  uint64_t acked;
+  uint64_t fin;      // offset of the FIN, or 0
+  bool fin_sent;
+  bool closed;       // the FIN is ACKed
+  map<uint64_t, uint64_t> covered;  // data sent past acked, start to end
+  map<uint64_t, int64_t> holes;     // start of a gap in it, to when it opened
+  deque<Sent> sent;
+
+  long segments;
+  uint64_t bytes;
+  long retransmits;
+  long reordered;
+  long rtt_samples;
+  int64_t rtt_min;
+  int64_t rtt_max;
+  double rtt_sum;
+  long flight_samples;
+  double flight_sum;
+  uint64_t flight_max;
+
+  int64_t first_bin;
+  vector<Bin> bins;
+
+  Flow() : caddr(0), saddr(0), cport(0), sport(0), connId(0), isn(0),
+    start(0), last(0), handshake_rtt(-1), highest(0), acked(0), fin(0),
+    fin_sent(false), closed(false), segments(0), bytes(0), retransmits(0),
+    reordered(0), rtt_samples(0), rtt_min(0), rtt_max(0), rtt_sum(0),
+    flight_samples(0), flight_sum(0), flight_max(0), first_bin(0) {}
+};
+
+// A SYN waiting for its SYN-ACK
+struct Syn
+{
+  unsigned int isn;
+  int64_t t;
+  bool resent;
+  long early;  // bytes of data it carried
+};
+
+struct FlowKey
+{
+  uint64_t addrs;
+  uint64_t ports;  // and connId
+
+  FlowKey(uint32_t caddr, uint16_t cport, uint32_t saddr, uint16_t sport,
+    uint16_t connId) : addrs((uint64_t) caddr << 32 | saddr),
+    ports((uint64_t) cport << 32 | (uint64_t) sport << 16 | connId) {}
+
+  bool operator==(const FlowKey& o) const
+  {
+    return addrs == o.addrs && ports == o.ports;
+  }
+};
+
+struct FlowKeyHash
+{
+  size_t operator()(const FlowKey& k) const
+  {
+    uint64_t h = k.addrs * 0x9e3779b97f4a7c15ULL ^ k.ports;
+    return h ^ (h >> 29);
+  }
+};
+
+uint16_t get16(const unsigned char* p)
+{
+  return p[0] << 8 | p[1];
+}
+
+uint32_t get32(const unsigned char* p, bool swapped)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+class Analyzer
+{
+  public:
+    Analyzer(int64_t interval, int port) : interval(interval), port(port),
+      datagrams(0), confundo(0) {}
+
+    // A datagram between two ports: a Confundo packet if it is one
+    void add(const Frame& f)
+    {
+      datagrams++;
+      if (port && f.sport != port && f.dport != port)
+      {
+        return;
+      }
+      const UDPpacket* pkt = f.pkt;
+      uint16_t connId = pkt->getconnID();
+      if (pkt->isSyn() && !pkt->isAck())
+      {
+        confundo++;
+        syn(f);
+        return;
+      }
+      if (pkt->isSyn())
+      {
+        confundo++;
+        syn_ack(f);
+        return;
+      }
+      Flow* flow = find(f.saddr, f.sport, f.daddr, f.dport, connId);
+      if (flow)
+      {
+        confundo++;
+        flow->last = f.t;
+        from_client(*flow, f);
+        return;
+      }
+      flow = find(f.daddr, f.dport, f.saddr, f.sport, connId);
+      if (flow)
+      {
+        confundo++;
+        flow->last = f.t;
+        from_server(*flow, f);
+        return;
+      }
+      // Caught midway: data, which only clients send, starts a connection
+      bool to_server = port ? f.dport == port : !pkt->isAck();
+      if (!to_server || f.payload_size <= 0 || pkt->isParity() ||
+        pkt->isProbe())
+      {
+        return;
+      }
+      confundo++;
+      Flow& fresh = open(f.saddr, f.sport, f.daddr, f.dport, connId, f.t);
+      fresh.seqs = SeqSpace(pkt->getSeq() > MAXSEQACKNUM);
+      fresh.isn = fresh.seqs.add(pkt->getSeq(), fresh.seqs.wide() ?
+        0xffffffffULL : MAXSEQACKNUM);  // one before the first data
+      from_client(fresh, f);
+    }
+
+    void print_csv() const
+    {
+      if (interval)
+      {
+        printf("flow,connId,time_s,bytes,throughput_mbps,goodput_mbps,"
+          "retransmits,reordered,rtt_samples,rtt_avg_ms,flight_max\n");
+        for (size_t i = 0; i < flows.size(); i++)
+        {
+          const Flow& f = flows[i];
+          for (size_t b = 0; b < f.bins.size(); b++)
+          {
+            const Bin& bin = f.bins[b];
+            printf("%zu,%u,%.6f,%" PRIu64 ",%.3f,%.3f,%ld,%ld,%ld,%.3f,%"
+              PRIu64 "\n", i, f.connId, (f.first_bin + b) * interval / 1e9,
+              bin.bytes, mbps(bin.bytes, interval), mbps(bin.acked, interval),
+              bin.retransmits, bin.reordered, bin.rtt_samples,
+              bin.rtt_samples ? bin.rtt_sum / bin.rtt_samples / 1e6 : 0.0,
+              bin.flight_max);
+          }
+        }
+        return;
+      }
+      printf("flow,client,server,connId,start_s,duration_s,segments,bytes,"
+        "unique_bytes,acked_bytes,retransmits,retransmit_rate,reordered,"
+        "reorder_rate,handshake_ms,rtt_samples,rtt_min_ms,rtt_avg_ms,"
+        "rtt_max_ms,flight_avg,flight_max,throughput_mbps,goodput_mbps,"
+        "closed\n");
+      for (size_t i = 0; i < flows.size(); i++)
+      {
+        const Flow& f = flows[i];
+        int64_t duration = f.last - f.start;
+        printf("%zu,%s,%s,%u,%.6f,%.6f,%ld,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+          ",%ld,%.4f,%ld,%.4f,%.3f,%ld,%.3f,%.3f,%.3f,%.0f,%" PRIu64
+          ",%.3f,%.3f,%d\n", i, endpoint(f.caddr, f.cport).c_str(),
+          endpoint(f.saddr, f.sport).c_str(), f.connId, f.start / 1e9,
+          duration / 1e9, f.segments, f.bytes, f.highest, f.acked,
+          f.retransmits, rate(f.retransmits, f.segments), f.reordered,
+          rate(f.reordered, f.segments), ms(f.handshake_rtt), f.rtt_samples,
+          f.rtt_samples ? f.rtt_min / 1e6 : 0.0,
+          f.rtt_samples ? f.rtt_sum / f.rtt_samples / 1e6 : 0.0,
+          f.rtt_samples ? f.rtt_max / 1e6 : 0.0,
+          f.flight_samples ? f.flight_sum / f.flight_samples : 0.0,
+          f.flight_max, mbps(f.bytes, duration), mbps(f.acked, duration),
+          f.closed);
+      }
+    }
+
+    void print_json() const
+    {
+      printf("{\"datagrams\":%ld,\"confundo_packets\":%ld,\"flows\":[",
+        datagrams, confundo);
+      for (size_t i = 0; i < flows.size(); i++)
+      {
+        const Flow& f = flows[i];
+        int64_t duration = f.last - f.start;
+        printf("%s\n{\"flow\":%zu,\"client\":\"%s\",\"server\":\"%s\","
+          "\"connId\":%u,\"start_s\":%.6f,\"duration_s\":%.6f,"
+          "\"segments\":%ld,\"bytes\":%" PRIu64 ",\"unique_bytes\":%" PRIu64
+          ",\"acked_bytes\":%" PRIu64 ",\"retransmits\":%ld,"
+          "\"retransmit_rate\":%.4f,\"reordered\":%ld,\"reorder_rate\":%.4f,",
+          i ? "," : "", i, endpoint(f.caddr, f.cport).c_str(),
+          endpoint(f.saddr, f.sport).c_str(), f.connId, f.start / 1e9,
+          duration / 1e9, f.segments, f.bytes, f.highest, f.acked,
+          f.retransmits, rate(f.retransmits, f.segments), f.reordered,
+          rate(f.reordered, f.segments));
+        if (f.handshake_rtt >= 0)
+        {
+          printf("\"handshake_ms\":%.3f,", f.handshake_rtt / 1e6);
+        }
+        printf("\"rtt_samples\":%ld,", f.rtt_samples);
+        if (f.rtt_samples)
+        {
+          printf("\"rtt_min_ms\":%.3f,\"rtt_avg_ms\":%.3f,"
+            "\"rtt_max_ms\":%.3f,", f.rtt_min / 1e6,
+            f.rtt_sum / f.rtt_samples / 1e6, f.rtt_max / 1e6);
+        }
+        printf("\"flight_avg\":%.0f,\"flight_max\":%" PRIu64 ","
+          "\"throughput_mbps\":%.3f,\"goodput_mbps\":%.3f,\"closed\":%s",
+          f.flight_samples ? f.flight_sum / f.flight_samples : 0.0,
+          f.flight_max, mbps(f.bytes, duration), mbps(f.acked, duration),
+          f.closed ? "true" : "false");
+        if (interval)
+        {
+          printf(",\"series\":[");
+          for (size_t b = 0; b < f.bins.size(); b++)
+          {
+            const Bin& bin = f.bins[b];
+            printf("%s{\"time_s\":%.6f,\"bytes\":%" PRIu64 ","
+              "\"throughput_mbps\":%.3f,\"goodput_mbps\":%.3f,"
+              "\"retransmits\":%ld,\"reordered\":%ld,\"rtt_samples\":%ld,"
+              "\"rtt_avg_ms\":%.3f,\"flight_max\":%" PRIu64 "}",
+              b ? "," : "", (f.first_bin + b) * interval / 1e9, bin.bytes,
+              mbps(bin.bytes, interval), mbps(bin.acked, interval),
+              bin.retransmits, bin.reordered, bin.rtt_samples,
+              bin.rtt_samples ? bin.rtt_sum / bin.rtt_samples / 1e6 : 0.0,
+              bin.flight_max);
+          }
+          printf("]");
+        }
+        printf("}");
+      }
+      printf("\n]}\n");
+    }
+
+  private:
+    int64_t interval;  // ns per bin, 0 for none
+    int port;
+    long datagrams;  // UDP over IPv4
+    long confundo;
+    vector<Flow> flows;  // in the order they started
+    unordered_map<FlowKey, size_t, FlowKeyHash> index;
+    unordered_map<FlowKey, vector<Syn>, FlowKeyHash> syns;  // connId 0
+
+    static double mbps(uint64_t bytes, int64_t ns)
+    {
+      return ns > 0 ? bytes * 8e3 / ns : 0.0;
+    }
+
+    static double rate(long n, long of)
+    {
+      return of ? (double) n / of : 0.0;
+    }
+
+    static double ms(int64_t ns)
+    {
+      return ns >= 0 ? ns / 1e6 : -1.0;
+    }
+
+    static string endpoint(uint32_t addr, uint16_t port)
+    {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%u.%u.%u.%u:%u", addr >> 24,
+        (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, port);
+      return buf;
+    }
+
+    Flow* find(uint32_t caddr, uint16_t cport, uint32_t saddr, uint16_t sport,
+      uint16_t connId)
+    {
+      unordered_map<FlowKey, size_t, FlowKeyHash>::iterator it =
+        index.find(FlowKey(caddr, cport, saddr, sport, connId));
+      return it == index.end() ? NULL : &flows[it->second];
+    }
+
+    Flow& open(uint32_t caddr, uint16_t cport, uint32_t saddr, uint16_t sport,
+      uint16_t connId, int64_t t)
+    {
+      index[FlowKey(caddr, cport, saddr, sport, connId)] = flows.size();
+      flows.push_back(Flow());
+      Flow& f = flows.back();
+      f.caddr = caddr;
+      f.cport = cport;
+      f.saddr = saddr;
+      f.sport = sport;
+      f.connId = connId;
+      f.start = f.last = t;
+      return f;
+    }
+
+    Bin* bin(Flow& f, int64_t t)
+    {
+      if (!interval)
+      {
+        return NULL;
+      }
+      int64_t b = t / interval;
+      if (f.bins.empty())
+      {
+        f.first_bin = b;
+      }
+      b = max(b - f.first_bin, (int64_t) 0);  // a clock that stepped back
+      if ((size_t) b >= f.bins.size())
+      {
+        f.bins.resize(b + 1);
+      }
+      return &f.bins[b];
+    }
+
+    // The offset of a sequence number, taken to be within half the space
+    // of the offset ref
+    static uint64_t offset(const Flow& f, unsigned int seq, uint64_t ref)
+    {
+      unsigned int at = f.seqs.add(f.isn + 1, ref);
+      if (f.seqs.le(at, seq))
+      {
+        return ref + f.seqs.dist(at, seq);
+      }
+      uint64_t back = f.seqs.dist(seq, at);
+      return back > ref ? 0 : ref - back;
+    }
+
+    // Size of the option block at the start of a payload, 0 without one
+    static long options(const Frame& f, ConfundoOptions& opts)
+    {
+      if (!f.pkt->hasOpt() || f.captured < 1)
+      {
+        return 0;
+      }
+      const char* payload = (const char*) f.pkt + sizeof(UDPheader);
+      long n = opts.decode(payload, f.captured);
+      return n ? n : min((long) (uint8_t) payload[0] + 1, f.payload_size);
+    }
+
+    void syn(const Frame& f)
+    {
+      ConfundoOptions opts;
+      long early = max(f.payload_size - options(f, opts), 0L);
+      vector<Syn>& waiting = syns[FlowKey(f.saddr, f.sport, f.daddr, f.dport,
+        0)];
+      for (size_t i = 0; i < waiting.size(); i++)
+      {
+        if (waiting[i].isn == f.pkt->getSeq())
+        {
+          waiting[i].resent = true;
+          return;
+        }
+      }
+      Syn s;
+      s.isn = f.pkt->getSeq();
+      s.t = f.t;
+      s.resent = false;
+      s.early = early;
+      waiting.push_back(s);
+    }
+
+    void syn_ack(const Frame& f)
+    {
+      uint16_t connId = f.pkt->getconnID();
+      if (find(f.daddr, f.dport, f.saddr, f.sport, connId))
+      {
+        return;  // sent again
+      }
+      unordered_map<FlowKey, vector<Syn>, FlowKeyHash>::iterator it =
+        syns.find(FlowKey(f.daddr, f.dport, f.saddr, f.sport, 0));
+      if (it == syns.end())
+      {
+        return;
+      }
+      // The server echoes the window scale option if it switches to 32-bit
+      // sequence numbers
+      ConfundoOptions opts;
+      options(f, opts);
+      SeqSpace seqs(opts.wscale >= 0);
+      vector<Syn>& waiting = it->second;
+      for (size_t i = 0; i < waiting.size(); i++)
+      {
+        Syn s = waiting[i];
+        if (f.pkt->getAck() != seqs.add(s.isn, 1))
+        {
+          continue;
+        }
+        waiting.erase(waiting.begin() + i);
+        if (waiting.empty())
+        {
+          syns.erase(it);
+        }
+        Flow& flow = open(f.daddr, f.dport, f.saddr, f.sport, connId, s.t);
+        flow.seqs = seqs;
+        flow.isn = s.isn;
+        flow.last = f.t;
+        if (!s.resent)
+        {
+          flow.handshake_rtt = f.t - s.t;
+        }
+        if (s.early > 0)
+        {
+          sent(flow, 0, s.early, s.t, s.resent);
+          flow.segments++;
+          flow.bytes += s.early;
+          if (opts.early == s.early)
+          {
+            ack(flow, s.early, f.t);
+          }
+        }
+        return;
+      }
+    }
+
+    void from_client(Flow& flow, const Frame& f)
+    {
+      const UDPpacket* pkt = f.pkt;
+      if (pkt->isFin())
+      {
+        flow.fin = offset(flow, pkt->getSeq(), flow.highest);
+        flow.fin_sent = true;
+        return;
+      }
+      if (pkt->isParity() || pkt->isProbe())
+      {
+        return;  // not the file
+      }
+      // The handshake's ACK repeats the SYN's options, and older clients
+      // send the first segment with it
+      ConfundoOptions opts;
+      long size = f.payload_size - options(f, opts);
+      if (size <= 0)
+      {
+        return;
+      }
+      uint64_t start = offset(flow, pkt->getSeq(), flow.highest);
+      flow.segments++;
+      flow.bytes += size;
+      Bin* b = bin(flow, f.t);
+      if (b)
+      {
+        b->bytes += size;
+      }
+      sent(flow, start, start + size, f.t, false);
+      uint64_t flight = flow.highest - min(flow.acked, flow.highest);
+      flow.flight_samples++;
+      flow.flight_sum += flight;
+      flow.flight_max = max(flow.flight_max, flight);
+      if (b)
+      {
+        b->flight_max = max(b->flight_max, flight);
+      }
+    }
+
+    void from_server(Flow& flow, const Frame& f)
+    {
+      if (!f.pkt->isAck())
+      {
+        return;
+      }
+      uint64_t to = offset(flow, f.pkt->getAck(), flow.acked);
+      if (flow.fin_sent && to > flow.fin)
+      {
+        flow.closed = true;
+      }
+      ack(flow, min(to, flow.highest), f.t);
+    }
+
+    // Data from start to end sent at t: new, a retransmission, or late
+    void sent(Flow& flow, uint64_t start, uint64_t end, int64_t t,
+      bool ambiguous)
+    {
+      Bin* b = bin(flow, t);
+      if (start < flow.highest)
+      {
+        uint64_t below = min(end, flow.highest);
+        bool late = !covers(flow, start, below);
+        if (late)
+        {
+          map<uint64_t, int64_t>::iterator hole = flow.holes.upper_bound(start);
+          int64_t window = flow.rtt_samples ? flow.rtt_min : REORDER_WINDOW;
+          late = hole != flow.holes.begin() && t - (--hole)->second < window;
+        }
+        if (late)
+        {
+          flow.reordered++;
+          if (b)
+          {
+            b->reordered++;
+          }
+        }
+        else
+        {
+          flow.retransmits++;
+          if (b)
+          {
+            b->retransmits++;
+          }
+          for (deque<Sent>::iterator it = lower_bound(flow.sent.begin(),
+            flow.sent.end(), start, [](const Sent& s, uint64_t at)
+            {
+              return s.end <= at;
+            }); it != flow.sent.end() && it->start < below; ++it)
+          {
+            it->ambiguous = true;
+          }
+          ambiguous = true;
+        }
+      }
+      else if (start > flow.highest)
+      {
+        flow.holes[flow.highest] = t;
+      }
+      cover(flow, start, end);
+      if (end > flow.highest)
+      {
+        Sent s;
+        s.start = max(start, flow.highest);
+        s.end = end;
+        s.t = t;
+        s.ambiguous = ambiguous;
+        flow.sent.push_back(s);
+        flow.highest = end;
+      }
+    }
+
+    // Whether all data from start to end was sent before
+    static bool covers(const Flow& flow, uint64_t start, uint64_t end)
+    {
+      start = max(start, flow.acked);
+      if (start >= end)
+      {
+        return true;
+      }
+      map<uint64_t, uint64_t>::const_iterator it =
+        flow.covered.upper_bound(start);
+      return it != flow.covered.begin() && (--it)->second >= end;
+    }
+
+    static void cover(Flow& flow, uint64_t start, uint64_t end)
+    {
+      start = max(start, flow.acked);
+      if (start >= end)
+      {
+        return;
+      }
+      map<uint64_t, uint64_t>& c = flow.covered;
+      if (!c.empty() && c.rbegin()->second == start)
+      {
+        c.rbegin()->second = end;  // the usual case: the next segment
+        return;
+      }
+      map<uint64_t, uint64_t>::iterator it = c.upper_bound(start);
+      if (it != c.begin() && prev(it)->second >= start)
+      {
+        --it;
+        start = it->first;
+        end = max(end, it->second);
+      }
+      while (it != c.end() && it->first <= end)
+      {
+        end = max(end, it->second);
+        it = c.erase(it);
+      }
+      c[start] = end;
+      // A hole this filled is closed
+      map<uint64_t, int64_t>::iterator h = flow.holes.lower_bound(start);
+      while (h != flow.holes.end() && h->first < end)
+      {
+        if (covers(flow, h->first, h->first + 1))
+        {
+          h = flow.holes.erase(h);
+        }
+        else
+        {
+          ++h;
+        }
+      }
+    }
+
+    // The server has everything before to, as of t
+    void ack(Flow& flow, uint64_t to, int64_t t)
+    {
+      if (to <= flow.acked)
+      {
+        return;
+      }
+      Bin* b = bin(flow, t);
+      if (b)
+      {
+        b->acked += to - flow.acked;
+      }
+      flow.acked = to;
+      // The segment this ACK is for gives the sample, as in TCP
+      bool sample = false;
+      int64_t rtt = 0;
+      while (!flow.sent.empty() && flow.sent.front().end <= to)
+      {
+        sample = !flow.sent.front().ambiguous;
+        rtt = t - flow.sent.front().t;
+        flow.sent.pop_front();
+      }
+      if (sample)
+      {
+        if (!flow.rtt_samples || rtt < flow.rtt_min)
+        {
+          flow.rtt_min = rtt;
+        }
+        flow.rtt_max = max(flow.rtt_max, rtt);
+        flow.rtt_sum += rtt;
+        flow.rtt_samples++;
+        if (b)
+        {
+          b->rtt_sum += rtt;
+          b->rtt_samples++;
+        }
+      }
+      map<uint64_t, uint64_t>& c = flow.covered;
+      while (!c.empty() && c.begin()->second <= to)
+      {
+        c.erase(c.begin());
+      }
+      while (!flow.holes.empty() && flow.holes.begin()->first < to)
+      {
+        flow.holes.erase(flow.holes.begin());
+      }
+    }
+};
+
+// Where the IPv4 header starts in a frame of the link type, or -1 if the
+// frame holds something else
+long ipv4_at(uint32_t linktype, const unsigned char* p, long len)
+{
+  if (linktype == LINKTYPE_NULL || linktype == LINKTYPE_LOOP)
+  {
+    // AF_INET is 2 everywhere, in whichever byte order
+    return len >= 4 && (get32(p, false) == htonl(2) ||
+      get32(p, false) == 2) ? 4 : -1;
+  }
+  if (linktype == LINKTYPE_ETHERNET)
+  {
+    long at = 12;
+    while (len >= at + 2 && (get16(p + at) == 0x8100 ||
+      get16(p + at) == 0x88a8))
+    {
+      at += 4;  // VLAN tags
+    }
+    return len >= at + 2 && get16(p + at) == 0x0800 ? at + 2 : -1;
+  }
+  if (linktype == LINKTYPE_LINUX_SLL)
+  {
+    return len >= 16 && get16(p + 14) == 0x0800 ? 16 : -1;
+  }
+  if (linktype == LINKTYPE_LINUX_SLL2)
+  {
+    return len >= 20 && get16(p) == 0x0800 ? 20 : -1;
+  }
+  if (linktype == LINKTYPE_RAW || linktype == LINKTYPE_IPV4)
+  {
+    return 0;
+  }
+  return -1;
+}
+
+// Read the Confundo datagram in a frame; false if it is not a first or only
+// fragment of UDP over IPv4 with a whole Confundo header
+bool decode(uint32_t linktype, const unsigned char* p, long len, Frame& f)
+{
+  long at = ipv4_at(linktype, p, len);
+  if (at < 0 || len < at + 20 || p[at] >> 4 != 4 || p[at + 9] != IPPROTO_UDP ||
+    (get16(p + at + 6) & 0x1fff) != 0)
+  {
+    return false;
+  }
+  long ihl = (p[at] & 0xf) * 4;
+  const unsigned char* ip = p + at;
+  const unsigned char* udp = ip + ihl;
+  if (ihl < 20 || len < at + ihl + 8 + (long) sizeof(UDPheader))
+  {
+    return false;
+  }
+  f.saddr = get32(ip + 12, true);
+  f.daddr = get32(ip + 16, true);
+  f.sport = get16(udp);
+  f.dport = get16(udp + 2);
+  f.pkt = (const UDPpacket*) (udp + 8);
+  long size = (long) get16(udp + 4) - 8 - sizeof(UDPheader);
+  if (size < 0)
+  {
+    return false;
+  }
+  if (f.pkt->isCrc())
+  {
+    size -= 4;
+  }
+  if (f.pkt->hasWindow())
+  {
+    size -= 4;
+  }
+  f.payload_size = max(size, 0L);
+  f.captured = min(f.payload_size,
+    len - at - ihl - 8 - (long) sizeof(UDPheader));
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  bool json = false;
+  int64_t interval = 0;
+  int port = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "ji:p:")) != -1)
+  {
+    if (opt == 'j')
+    {
+      json = true;
+    }
+    else if (opt == 'i')
+    {
+      interval = atof(optarg) * 1e6;
+      if (interval <= 0)
+      {
+        cerr<<"ERROR: Invalid interval"<<endl;
+        exit(1);
+      }
+    }
+    else if (opt == 'p')
+    {
+      port = atoi(optarg);
+      if (port < 1 || port > 65535)
+      {
+        cerr<<"ERROR: Incorrect port"<<endl;
+        exit(1);
+      }
+    }
+    else
+    {
+      cerr<<"ERROR: usage: "<<argv[0]<<" [-j] [-i MS] [-p PORT] <PCAPFILE>"
+        <<endl;
+      exit(1);
+    }
+  }
+
+  if (argc - optind != 1)
+  {
+    cerr<<"ERROR: Invalid number of arguments"<<endl;
+    exit(1);
+  }
+
+  FileSource file;
+  if (!map_file(argv[optind], file))
+  {
+    cerr<<"ERROR: Could not map capture file"<<endl;
+    exit(1);
+  }
+  const unsigned char* map = (const unsigned char*) file.data();
+  long size = file.size;
+  uint32_t magic = size >= PCAP_HEADER ? get32(map, false) : 0;
+  bool swapped = magic == __builtin_bswap32(PCAP_MAGIC) ||
+    magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  bool nanos = magic == PCAP_MAGIC_NS ||
+    magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  if (!swapped && !nanos && magic != PCAP_MAGIC)
+  {
+    cerr<<"ERROR: Not a pcap capture (pcapng must be converted first)"<<endl;
+    exit(1);
+  }
+  uint32_t linktype = get32(map + 20, swapped) & 0xffff;
+  if (linktype != LINKTYPE_NULL && linktype != LINKTYPE_LOOP &&
+    linktype != LINKTYPE_ETHERNET && linktype != LINKTYPE_LINUX_SLL &&
+    linktype != LINKTYPE_LINUX_SLL2 && linktype != LINKTYPE_RAW &&
+    linktype != LINKTYPE_IPV4)
+  {
+    cerr<<"ERROR: Unsupported link type "<<linktype<<endl;
+    exit(1);
+  }
+
+  Analyzer analyzer(interval, port);
+  long at = PCAP_HEADER;
+  int64_t first = -1;
+  while (at + PCAP_RECORD <= size)
+  {
+    const unsigned char* rec = map + at;
+    uint32_t caplen = get32(rec + 8, swapped);
+    if (caplen > size - at - PCAP_RECORD)
+    {
+      break;
+    }
+    int64_t t = (int64_t) get32(rec, swapped) * 1000000000 +
+      (int64_t) get32(rec + 4, swapped) * (nanos ? 1 : 1000);
+    if (first < 0)
+    {
+      first = t;
+    }
+    Frame f;
+    if (decode(linktype, rec + PCAP_RECORD, caplen, f))
+    {
+      f.t = t - first;
+      analyzer.add(f);
+    }
+    at += PCAP_RECORD + caplen;
+  }
+  if (at != size)
+  {
+    cerr<<"WARNING: capture ends in the middle of a packet"<<endl;
+  }
+
+  if (json)
+  {
+    analyzer.print_json();
+  }
+  else
+  {
+    analyzer.print_csv();
+  }
+  unmap_file(file);
+  return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef PMTUD_H
+#define PMTUD_H
+
+#include <stdint.h>
+
+#define PROBE_TIMEOUT 500    // ms to wait for the ACK of a probe
+#define MAX_PROBES 3         // unacknowledged probes before a size is given up
+#define BLACK_HOLE_RTOS 2    // consecutive timeouts that mean the path shrank
+#define PROBE_RAISE_TIMER 5000  // ms before searching again after a black hole
+
+// Packetization layer path MTU discovery for Confundo, after RFC 8899
+// (DPLPMTUD). Segments start at the base size that every path carries, and
+// padding-only probes, which the server acknowledges with the payload size it
+// received, try the payload sizes of common link MTUs up to the negotiated
+// MSS. A size whose probes all go unanswered ends the search. If data
+// segments of the confirmed size start timing out repeatedly, the path is
+// treated as a black hole: segments drop back to the base size and the search
+// starts over later. Bytes every datagram carries beyond the header and
+// payload, like a CRC trailer, come off the candidate sizes.
+class PmtuSearch
+{
+  public:
+    PmtuSearch(int base, int max_mss, int overhead = 0) : base(base),
+      max_mss(max_mss), overhead(overhead), cur(base), probing(0), probes_sent(0), last_probe(0), search_from(0),
+      timeouts(0), done(max_mss <= base) {}
+
+    // Payload size for data segments
+    int mss() const
+    {
+      return cur;
+    }
+
+    // Size of the probe to send now, 0 if none is due
+    int probe_due(int64_t now)
+    {
+      if (done)
+      {
+        return 0;
+      }
+      if (now < search_from)
+      {
+        return 0;
+      }
+      if (probing && now - last_probe < PROBE_TIMEOUT)
+      {
+        return 0;
+      }
+      if (probing && probes_sent >= MAX_PROBES)
+      {
+        done = true;  // black-holed probe size, keep what was confirmed
+        return 0;
+      }
+      if (!probing)
+      {
+        probing = next_size();
+        probes_sent = 0;
+        if (!probing)
+        {
+          done = true;
+          return 0;
+        }
+      }
+      probes_sent++;
+      last_probe = now;
+      return probing;
+    }
+
+    // The server received a probe of this payload size
+    void on_probe_acked(int size)
+    {
+      if (size == probing)
+      {
+        cur = size;
+        probing = 0;
+      }
+    }
+
+    // The local stack refused the probe outright (EMSGSIZE)
+    void on_probe_refused()
+    {
+      probing = 0;
+      done = true;
+    }
+
+    // A data segment was acknowledged
+    void on_ack()
+    {
+      timeouts = 0;
+    }
+
+    // The retransmission timer expired; returns true if segments shrank
+    bool on_timeout(int64_t now)
+    {
+      if (++timeouts < BLACK_HOLE_RTOS || cur == base)
+      {
+        return false;
+      }
+      cur = base;
+      probing = 0;
+      timeouts = 0;
+      done = false;
+      search_from = now + PROBE_RAISE_TIMER;
+      return true;
+    }
+
+  private:
+    int base;
+    int max_mss;
+    int overhead;
+    int cur;
+    int probing;      // size being probed, 0 when idle
+    int probes_sent;
+    int64_t last_probe;
+    int64_t search_from;
+    int timeouts;
+    bool done;
+
+    // Next candidate above the current size: payloads of the common link
+    // MTUs (IPv6 minimum, Ethernet, jumbo frames, loopback) less the IPv4,
+    // UDP and Confundo headers, and finally the negotiated MSS itself
+    int next_size() const
+    {
+      static const int mtus[] = { 1280, 1500, 9000, 65535 };
+      for (size_t i = 0; i < sizeof(mtus) / sizeof(mtus[0]); i++)
+      {
+        int size = mtus[i] - 20 - 8 - 12 - overhead;
+        if (size > cur && size < max_mss)
+        {
+          return size;
+        }
+      }
+      return cur < max_mss ? max_mss : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,795 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "netenv.h"
+#include "conntable.h"
+#include "packetpool.h"
+#include "seqnum.h"
+#include "options.h"
+#include "fec.h"
+#include "resumption.h"
+#include "syncookie.h"
+#include "localpath.h"
+#include "eventlog.h"
+#include "connstats.h"
+
+using namespace std;
+
+// Where a connection's payload goes. write() is handed the connection once
+// CONN_FLUSH bytes are buffered, and takes its data: writes it and clears
+// the buffer, or swaps the buffer out and counts the bytes in c.writing
+// until ConfundoReceiver::written() says they are on disk. A sink that
+// cannot take it yet leaves it, and is offered it again with the next
+// segment. finish() gets the rest of the payload when the client is done,
+// or is told that the client was aborted, in which case the file holds a
+// single ERROR string.
+//
+// A sink whose streams() is true splits the payload of connections with
+// c.streams set into a file per stream (streams.h); an aborted connection
+// leaves ERROR only in the files of streams that had not ended.
+//
+// A sink that can adopt() takes the first len bytes of a sealed memfd a
+// client on the same host handed over (localpath.h) as the connection's
+// next payload, after what it holds, and takes the descriptor with them.
+class FileSink
+{
+  public:
+    virtual ~FileSink() {}
+    virtual void write(Connection& c) = 0;
+    virtual void finish(Connection& c, bool aborted) = 0;
+    virtual bool adopt(Connection& c, int fd, size_t len)
+    {
+      return false;
+    }
+    virtual bool streams() const
+    {
+      return false;
+    }
+};
+
+// The server's side of Confundo for the connections of one shard: the
+// connection table and what happens to each datagram. Time and output come
+// from the Clock and PacketSocket it was built with, so the same code runs
+// in the server's workers and in the simulator.
+//
+// A connection holds at most CONN_RCVBUF bytes that are not on disk yet;
+// in-order segments that do not fit are dropped. A client that asks for
+// the receive buffer size in its SYN gets it, and every ACK then carries
+// the room left, so the client can keep within it.
+//
+// A client that negotiates an ACK frequency of N gets one ACK for every N
+// in-order segments, or CONN_ACK_DELAY ms after the first unACKed one, so
+// the owner must call send_delayed_acks() by next_ack_due(). ACKs still go
+// out at once for a segment the client flagged as immediate, for the first
+// segment out of order, for the one that fills the gap, and for a FIN.
+//
+// A client that negotiates forward error correction sends a parity segment
+// after every block of data segments. The segments that arrive past a gap
+// in a block are kept, and when the parity shows that the gap is a single
+// segment, it is rebuilt and delivered with them, without waiting for the
+// retransmission.
+//
+// With tokens set, a client that asks for one gets a token in the SYN-ACK,
+// and a SYN that presents a valid token may carry the first segment after
+// its options (see resumption.h). The SYN-ACK says how much of it was
+// taken, all or nothing.
+//
+// A client that negotiates CRCs ends every packet with a CRC32C of it, and
+// gets the same back (crc32c.h). A packet whose trailer does not match, or
+// that lacks one, is dropped like a lost one. The FIN carries the CRC of the
+// whole payload, which is checked against what was delivered, so a file that
+// still came out wrong, say from a bad repair, is replaced by ERROR.
+//
+// With cookies set, once backlog connections are half-open (a SYN but no
+// answer yet), as under a SYN flood, a SYN opens nothing: the SYN-ACK
+// carries a cookie (syncookie.h), and the connection is set up when a
+// handshake ACK brings it back. A SYN with a valid token still opens its
+// connection at once.
+//
+// With a rendezvous set, a client on the same host that asks for the local
+// option gets an offer in the SYN-ACK, and may then hand the rest of its
+// file over through the rendezvous instead (localpath.h); adopt() takes it
+// as the connection's next bytes. Connections with streams or CRCs do not
+// get the offer.
+class ConfundoReceiver
+{
+  public:
+    ConfundoReceiver(Clock& clock, PacketSocket& sock, FileSink& sink,
+      int shard = 0, int nshards = 1) : clock(clock), sock(sock), sink(sink),
+      conns(shard, nshards), stats(NULL), log(NULL), tokens(NULL),
+      cookies(NULL), cookie_backlog(0), local(NULL), max_mss(MAXMSS),
+      delayed_head(0) {}
+
+    // Packets are logged to log, and statistics kept in table[connId], when
+    // they are set
+    void set_log(EventLog* event_log)
+    {
+      log = event_log;
+    }
+
+    void set_stats(ConnStats* table)
+    {
+      stats = table;
+    }
+
+    // Issue and accept resumption tokens, which may be shared by receivers
+    // on several threads
+    void set_tokens(const ResumeTokens* resume_tokens)
+    {
+      tokens = resume_tokens;
+    }
+
+    // Answer SYNs with cookies once backlog connections are half-open (0:
+    // always); the cookies may be shared by receivers on several threads
+    void set_cookies(const SynCookies* syn_cookies,
+      size_t backlog = COOKIE_BACKLOG)
+    {
+      cookies = syn_cookies;
+      cookie_backlog = backlog;
+    }
+
+    // Offer clients on the same host the rendezvous, which may be shared
+    // by receivers on several threads
+    void set_local(const LocalRendezvous* rendezvous)
+    {
+      local = rendezvous;
+    }
+
+    // Negotiate segments of at most mss bytes, CRC trailer included
+    void set_max_mss(int mss)
+    {
+      max_mss = mss;
+    }
+
+    ConnTable& connections()
+    {
+      return conns;
+    }
+
+    // Take the memfd of a handoff as the next bytes of its connection; false
+    // if there is no such connection, or it is past them or has ended
+    bool adopt(const LocalHandoff& h)
+    {
+      Connection* c = conns.find(h.addr, h.connId);
+      if (!c || c->saved || c->streams || c->crc || c->state == CONN_FIN_RCVD ||
+        h.seq != c->expected || !sink.adopt(*c, h.fd, h.len))
+      {
+        return false;
+      }
+      SeqSpace seqs(c->wide);
+      c->expected = seqs.add(c->expected, h.len);
+      c->last_active = clock.now_ms();
+      conns.set_state(c, CONN_ESTABLISHED);
+      stat_add(stats_of(c->connId).bytes_received, h.len);
+      return true;
+    }
+
+    // Handle one datagram from cliaddr. The payload may already sit at the
+    // end of its connection's buffer, in which case it is committed there
+    // instead of copied.
+    void handle(UDPpacket* pkt_in, char* payload, int payload_size,
+      const sockaddr_in& cliaddr)
+    {
+      int64_t now = clock.now_ms();
+
+      // The trailer is not part of the payload
+      if (pkt_in->isCrc() && !check_crc(pkt_in, payload, payload_size))
+      {
+        log_packet(LOG_DROP, pkt_in);
+        expire(now, CONN_SWEEP_BUDGET);
+        return;
+      }
+
+      if(pkt_in->isSyn()) // SYN packet, send SYN-ACK
+      {
+        log_packet(LOG_RECV, pkt_in);
+
+        // A client asking for window scaling gets it, along with 32-bit
+        // sequence numbers
+        ConfundoOptions opts;
+        size_t optend = 0;
+        if (pkt_in->hasOpt())
+        {
+          optend = opts.decode(payload, payload_size);
+        }
+        negotiate(opts);
+
+        // Data after the options is taken only with a valid token, and
+        // only if it is no more than a segment. A valid token proves the
+        // client's address, so its connection opens at once; past the
+        // backlog, any other client's opens only when it answers the SYN-ACK.
+        // Cookies cost the client's early data and need it to repeat its
+        // options, which older clients do not, so they wait for a flood.
+        int early = optend ? payload_size - (int) optend : 0;
+        bool proven = tokens && tokens->valid(opts.token, cliaddr, now);
+        opts.token = tokens && opts.token >= 0 ?
+          tokens->issue(cliaddr, now) : -1;
+
+        // A client whose SYN-ACK was lost sends its SYN again; the copy
+        // gets the SYN-ACK of the connection the first one opened
+        Connection* c = conns.find_syn(cliaddr, pkt_in->getSeq());
+        if (c)
+        {
+          resend_syn_ack(*c, pkt_in, opts, early, cliaddr);
+          expire(now, CONN_SWEEP_BUDGET);
+          return;
+        }
+        if (cookies && !proven && conns.half_open() >= cookie_backlog)
+        {
+          send_cookie(pkt_in, payload, optend, opts, early, cliaddr, now);
+          expire(now, CONN_SWEEP_BUDGET);
+          return;
+        }
+
+        c = conns.open(cliaddr, now);
+        if (!c) // every connId is taken, let the client retry
+        {
+          log_packet(LOG_DROP, pkt_in);
+        }
+        else
+        {
+          ConnStats& s = stats_of(c->connId);
+          s.reset(c->connId, log_tsc());
+          stat_add(s.segments_received);
+          configure(*c, opts);
+          bool take_early = early > 0 && early <= DATABUF && proven;
+          opts.early = early > 0 ? (take_early ? early : 0) : -1;
+
+          SeqSpace seqs(c->wide);
+          send_syn_ack(SRVR_DEFAULT_SEQ, seqs.add(pkt_in->getSeq(), 1),
+            c->connId, opts, cliaddr);
+          stat_add(s.segments_sent);
+          s.rtt_start = log_tsc();  // timed until the handshake ACK
+          c->expected=seqs.add(pkt_in->getSeq(), 1);
+          conns.opened_by(c, pkt_in->getSeq());
+          if (take_early)
+          {
+            deliver(*c, payload + optend, early, s);
+          }
+        }
+        expire(now, CONN_SWEEP_BUDGET);
+        return;
+      }
+
+      // A handshake ACK for no connection may answer a cookie
+      Connection* c = conns.find(cliaddr, pkt_in->getconnID());
+      if (!c && cookies && pkt_in->isAck() && !pkt_in->isFin())
+      {
+        c = establish(pkt_in, payload, payload_size, cliaddr, now);
+        if (c)
+        {
+          log_packet(LOG_RECV, pkt_in);
+          stat_add(stats_of(c->connId).segments_received);
+          expire(now, CONN_SWEEP_BUDGET);
+          return;
+        }
+      }
+      if (!c || (c->crc && !pkt_in->isCrc())) // stale or unknown connection
+      {
+        log_packet(LOG_DROP, pkt_in);
+        expire(now, CONN_SWEEP_BUDGET);
+        return;
+      }
+      c->last_active = now;
+      SeqSpace seqs(c->wide);
+      ConnStats& s = stats_of(c->connId);
+      stat_add(s.segments_received);
+
+      if(pkt_in->isProbe()) // path MTU probe, tell the client what size arrived
+      {
+        log_packet(LOG_RECV, pkt_in);
+        PacketRef pkt_out= pool.make(htonl(payload_size), htonl(c->expected),
+          htons(pkt_in->getconnID()), 1, 0, 0, NULL);
+        pkt_out->setProbe();
+        transmit(pkt_out.get(), NULL, 0, c->crc, cliaddr);
+        log_packet(LOG_SEND, pkt_out.get());
+        stat_add(s.segments_sent);
+        expire(now, CONN_SWEEP_BUDGET);
+        return;
+      }
+
+      if(pkt_in->isParity()) // rebuild the segment at the gap if it can be
+      {
+        log_packet(LOG_RECV, pkt_in);
+        FecRepair* fec = repair_of(c->connId);
+        const char* missing = NULL;
+        int n = fec ? fec->repair(seqs, c->expected, pkt_in->getSeq(),
+          pkt_in->getAck(), payload, payload_size, missing) : 0;
+        if (n > 0 && n <= window(*c))
+        {
+          deliver(*c, missing, n, s);
+          stat_add(s.repaired);
+          deliver_kept(*c, *fec, s);
+          c->gap = false;
+          send_ack(*c, cliaddr, s);
+        }
+        expire(now, CONN_SWEEP_BUDGET);
+        return;
+      }
+
+      if(pkt_in->isAck())
+      {
+        log_packet(LOG_RECV, pkt_in);
+        //client only sends ACK twice: SYN-ACK & FIN-ACK
+        if (c->state == CONN_SYN_RCVD)
+        {
+          conns.set_state(c, CONN_ESTABLISHED);
+          stats_rtt(s);
+        }
+        else if (c->state == CONN_FIN_RCVD) // teardown complete, reclaim the slot
+        {
+          stats_rtt(s);
+          s.state = STATS_CLOSED;
+          repairs.erase(c->connId);
+          digests.erase(c->connId);
+          conns.release(c);
+        }
+      }
+      else if(pkt_in->isFin())
+      {
+        log_packet(LOG_RECV, pkt_in);
+
+        // A payload that does not match the client's CRC is not kept, and
+        // the FIN goes unanswered, so the client knows the upload failed
+        if (!c->saved && c->crc && pkt_in->getAck() != digests[c->connId])
+        {
+          log_packet(LOG_DROP, pkt_in);
+          sink.finish(*c, true);
+          s.state = STATS_CLOSED;
+          repairs.erase(c->connId);
+          digests.erase(c->connId);
+          conns.release(c);
+          expire(now, CONN_SWEEP_BUDGET);
+          return;
+        }
+        //send ACK for the FIN
+        PacketRef pkt_out= pool.make(htonl(SRVR_DEFAULT_SEQ+1), htonl(seqs.add(pkt_in->getSeq(), payload_size + 1)),
+          htons(pkt_in->getconnID()), 1, 0, 1, NULL);
+        send_with_window(pkt_out.get(), *c, cliaddr);
+        log_packet(LOG_SEND, pkt_out.get());
+        stat_add(s.segments_sent);
+        if (c->state != CONN_FIN_RCVD)
+        {
+          s.rtt_start = log_tsc();  // timed until the last ACK
+        }
+
+        c->unacked = 0;  // covered by the FIN's ACK
+        c->ack_due = 0;
+
+        //reconstruct the file sent by client
+        if (!c->saved)
+        {
+          sink.finish(*c, false);
+          c->saved = true;
+        }
+        conns.set_state(c, CONN_FIN_RCVD);
+      }
+      else  // received data packet, store it accordingly
+      {
+        if(pkt_in->getSeq()==c->expected && payload_size <= window(*c))
+        {
+
+          log_packet(LOG_RECV, pkt_in);
+          FecRepair* fec = repair_of(c->connId);
+          if (fec)
+          {
+            fec->in_order(seqs, pkt_in->isFec(), pkt_in->getAck(),
+              pkt_in->getSeq(), payload, payload_size);
+          }
+          deliver(*c, payload, payload_size, s);
+          conns.set_state(c, CONN_ESTABLISHED);
+          if (fec)
+          {
+            deliver_kept(*c, *fec, s);
+          }
+
+          // send ack for received packet, or hold it back for the next ones
+          bool ack_now = c->ack_every <= 1 || ++c->unacked >= c->ack_every ||
+            c->gap || pkt_in->isImmediate();
+          c->gap = false;
+          if (ack_now)
+          {
+            send_ack(*c, cliaddr, s);
+          }
+          else if (!c->ack_due)
+          {
+            c->ack_due = now + CONN_ACK_DELAY;
+            DelayedAck d = { c->ack_due, cliaddr, c->connId };
+            delayed.push_back(d);
+          }
+        }
+
+        else //server's Ack got dropped (or no room left), send dup Ack
+        {
+          // Past a gap, a segment of an error correction block is kept for
+          // the repair; anything else is dropped
+          FecRepair* fec = repair_of(c->connId);
+          if (fec && pkt_in->isFec() && fec->keep(seqs, pkt_in->getAck(),
+            c->expected, pkt_in->getSeq(), payload, payload_size))
+          {
+            log_packet(LOG_RECV, pkt_in);
+          }
+          else
+          {
+            log_packet(LOG_DROP, pkt_in);
+            stat_add(s.retransmits);
+          }
+
+          // The first segment past a gap is reported at once; the rest of
+          // the burst only as often as in-order segments
+          bool ack_now = c->ack_every <= 1 || !c->gap ||
+            ++c->unacked >= c->ack_every || pkt_in->isImmediate();
+          c->gap = true;
+          if (ack_now)
+          {
+            send_ack(*c, cliaddr, s);
+            stat_add(s.dup_acks);
+          }
+        }
+      }
+
+      // Evict idle clients only now, the payload may live in one of their
+      // buffers
+      expire(now, CONN_SWEEP_BUDGET);
+    }
+
+    // Abort clients that have been idle too long, inspecting up to budget
+    // slots of the table. A client that went quiet before finishing gets a
+    // single ERROR string in its file; one that never got past its SYN, and
+    // sent nothing with it, gets no file.
+    void expire(int64_t now, size_t budget)
+    {
+      conns.expire(now, budget, [this](Connection& c) {
+        stats_of(c.connId).state = STATS_CLOSED;
+        repairs.erase(c.connId);
+        digests.erase(c.connId);
+        bool empty = c.state == CONN_SYN_RCVD && c.data.size() == 0;
+        if (!c.saved && !empty)
+        {
+          sink.finish(c, true);
+          c.saved = true;
+        }
+      });
+    }
+
+    // n bytes of a connection's payload that were handed to the sink are on
+    // disk now. A client that was told the window is closed hears that it
+    // has reopened.
+    void written(const sockaddr_in& addr, short int connId, size_t n)
+    {
+      Connection* c = conns.find(addr, connId);
+      if (!c)
+      {
+        return;
+      }
+      c->writing -= min((size_t) c->writing, n);
+      if (c->window_closed && window(*c) >= c->mss)
+      {
+        send_ack(*c, addr, stats_of(connId));
+      }
+    }
+
+    // When the earliest held-back ACK is due, 0 if there is none
+    int64_t next_ack_due() const
+    {
+      return delayed_head < delayed.size() ? delayed[delayed_head].due : 0;
+    }
+
+    // Send the held-back ACKs whose delay is up
+    void send_delayed_acks(int64_t now)
+    {
+      while (delayed_head < delayed.size() && delayed[delayed_head].due <= now)
+      {
+        const DelayedAck& d = delayed[delayed_head++];
+        Connection* c = conns.find(d.addr, d.connId);
+        if (c && c->ack_due == d.due) // not sent since, nor the client gone
+        {
+          send_ack(*c, d.addr, stats_of(c->connId));
+        }
+      }
+      // The delay is fixed, so the queue is in due order; reclaim the
+      // consumed front once it is most of the vector
+      if (delayed_head == delayed.size())
+      {
+        delayed.clear();
+        delayed_head = 0;
+      }
+      else if (delayed_head > 64 && delayed_head * 2 > delayed.size())
+      {
+        delayed.erase(delayed.begin(), delayed.begin() + delayed_head);
+        delayed_head = 0;
+      }
+    }
+
+    PacketPool& packet_pool()
+    {
+      return pool;
+    }
+
+  private:
+    struct DelayedAck
+    {
+      int64_t due;
+      sockaddr_in addr;
+      short int connId;
+    };
+
+    Clock& clock;
+    PacketSocket& sock;
+    FileSink& sink;
+    ConnTable conns;
+    PacketPool pool;  // buffers for outgoing packets
+    ConnStats* stats;
+    ConnStats scratch;  // stands in for the table when there is none
+    EventLog* log;
+    const ResumeTokens* tokens;
+    const SynCookies* cookies;
+    size_t cookie_backlog;
+    const LocalRendezvous* local;
+    int max_mss;  // largest segment negotiated
+    vector<DelayedAck> delayed;  // ACKs held back, oldest first
+    size_t delayed_head;
+    unordered_map<int, FecRepair> repairs;  // of clients that use FEC
+    unordered_map<int, uint32_t> digests;   // CRC of the payload so far, of
+                                            // clients that use CRCs
+
+    ConnStats& stats_of(short int connId)
+    {
+      return stats ? stats[connId] : scratch;
+    }
+
+    FecRepair* repair_of(short int connId)
+    {
+      if (repairs.empty())
+      {
+        return NULL;
+      }
+      unordered_map<int, FecRepair>::iterator it = repairs.find(connId);
+      return it == repairs.end() ? NULL : &it->second;
+    }
+
+    // Turn the options of a SYN into the ones its SYN-ACK echoes
+    void negotiate(ConfundoOptions& opts) const
+    {
+      if (opts.rcvbuf >= 0)
+      {
+        opts.rcvbuf = CONN_RCVBUF;
+      }
+      opts.streams = opts.streams && sink.streams();
+      opts.local = opts.local && local && !opts.streams && !opts.crc;
+      if (opts.mss > 0) // take whatever the client can send, up to max_mss
+      {
+        opts.mss = min(opts.mss, max_mss - (opts.crc ? CRC_TRAILER : 0));
+      }
+      if (opts.fecblock < MINFECBLOCK)
+      {
+        opts.fecblock = 0;
+      }
+    }
+
+    // Set a new connection up for the options its SYN-ACK echoed
+    void configure(Connection& c, const ConfundoOptions& opts)
+    {
+      c.wide = opts.wscale >= 0;
+      if (opts.ackfreq > 1)
+      {
+        c.ack_every = opts.ackfreq;
+      }
+      c.flow = opts.rcvbuf >= 0;
+      c.streams = opts.streams;
+      c.crc = opts.crc;
+      c.wscale = c.wide ? opts.wscale : 0;
+      if (opts.mss > 0)
+      {
+        c.mss = opts.mss;
+      }
+      repairs.erase(c.connId);
+      if (opts.fecblock >= MINFECBLOCK)
+      {
+        repairs.insert(make_pair(c.connId, FecRepair(opts.fecblock, c.mss)));
+      }
+      digests.erase(c.connId);
+      if (c.crc)
+      {
+        digests[c.connId] = 0;
+      }
+    }
+
+    void send_syn_ack(unsigned int seq, unsigned int ack, short int connId,
+      ConfundoOptions& opts, const sockaddr_in& cliaddr)
+    {
+      opts.local = opts.local && local->offer(opts, cliaddr, connId);
+      PacketRef pkt_out= pool.make(htonl(seq), htonl(ack), htons(connId), 1, 1, 0, NULL);
+      char optbuf[MAXOPTIONS + 1];
+      size_t optlen = 0;
+      if (!opts.empty())
+      {
+        pkt_out->setOpt();
+        optlen = opts.encode(optbuf);
+      }
+      transmit(pkt_out.get(), optbuf, optlen, opts.crc, cliaddr);
+      log_packet(LOG_SEND, pkt_out.get());
+    }
+
+    // Answer a copy of the SYN that opened c, which is still half-open. Data
+    // sent with it was taken with the first copy, if at all.
+    void resend_syn_ack(Connection& c, const UDPpacket* pkt_in,
+      ConfundoOptions& opts, int early, const sockaddr_in& cliaddr)
+    {
+      ConnStats& s = stats_of(c.connId);
+      stat_add(s.segments_received);
+      c.last_active = clock.now_ms();
+      unsigned int next_seq = SeqSpace(c.wide).add(pkt_in->getSeq(), 1);
+      opts.early = early > 0 ? (c.expected != next_seq ? early : 0) : -1;
+      send_syn_ack(SRVR_DEFAULT_SEQ, next_seq, c.connId, opts, cliaddr);
+      stat_add(s.segments_sent);
+    }
+
+    // Answer a SYN whose options are the optlen bytes at options with a
+    // cookie, handing out the next connId but keeping nothing. Data sent
+    // with the SYN is not taken, the client sends it again.
+    void send_cookie(const UDPpacket* pkt_in, const char* options,
+      size_t optlen, ConfundoOptions& opts, int early,
+      const sockaddr_in& cliaddr, int64_t now)
+    {
+      short int connId = conns.next_id();
+      if (!connId) // every connId is taken, let the client retry
+      {
+        log_packet(LOG_DROP, pkt_in);
+        return;
+      }
+      opts.early = early > 0 ? 0 : -1;
+      SeqSpace seqs(opts.wscale >= 0);
+      unsigned int next_seq = seqs.add(pkt_in->getSeq(), 1);
+      unsigned int cookie = cookies->issue(cliaddr, connId, next_seq,
+        options, optlen, seqs.wide(), now);
+      send_syn_ack(cookie, next_seq, connId, opts, cliaddr);
+    }
+
+    // Open the connection of a handshake ACK that brings back a valid
+    // cookie, and repeats its SYN's options; NULL if it does not, or if its
+    // connId has been taken since
+    Connection* establish(const UDPpacket* pkt_in, const char* payload,
+      int payload_size, const sockaddr_in& cliaddr, int64_t now)
+    {
+      ConfundoOptions opts;
+      size_t optend = 0;
+      if (pkt_in->hasOpt())
+      {
+        optend = opts.decode(payload, payload_size);
+      }
+      SeqSpace seqs(opts.wscale >= 0);
+      unsigned int cookie = seqs.dist(1, pkt_in->getAck());
+      if ((opts.crc && !pkt_in->isCrc()) || !cookies->valid(cookie, cliaddr,
+        pkt_in->getconnID(), pkt_in->getSeq(), payload, optend, seqs.wide(),
+        now))
+      {
+        return NULL;
+      }
+      Connection* c = conns.open(cliaddr, now, pkt_in->getconnID());
+      if (!c)
+      {
+        return NULL;
+      }
+      negotiate(opts);
+      configure(*c, opts);
+      c->expected = pkt_in->getSeq();
+      conns.set_state(c, CONN_ESTABLISHED);
+      stats_of(c->connId).reset(c->connId, log_tsc());
+      return c;
+    }
+
+    // Append the next in-order n bytes to the connection, or commit them if
+    // they were received in place, and hand the buffer to the sink once it
+    // holds CONN_FLUSH bytes
+    void deliver(Connection& c, const char* p, int n, ConnStats& s)
+    {
+      if (c.crc)
+      {
+        uint32_t& digest = digests[c.connId];
+        digest = crc32c(digest, p, n);
+      }
+      if (p == c.data.end())
+      {
+        c.data.commit(n);
+      }
+      else
+      {
+        c.data.append(p, n);
+      }
+      stat_add(s.bytes_received, n);
+      if (c.data.size() >= CONN_FLUSH)
+      {
+        sink.write(c);
+      }
+      c.expected = SeqSpace(c.wide).add(c.expected, n);
+    }
+
+    // Deliver the kept segments that now continue the in-order data
+    void deliver_kept(Connection& c, FecRepair& fec, ConnStats& s)
+    {
+      SeqSpace seqs(c.wide);
+      const char* p;
+      int n;
+      while (fec.next_kept(seqs, c.expected, p, n) && n <= window(c))
+      {
+        fec.pop_kept();
+        deliver(c, p, n, s);
+      }
+    }
+
+    // Payload bytes the connection can still take
+    static int window(const Connection& c)
+    {
+      long held = (long) c.data.size() + c.writing;
+      return held < CONN_RCVBUF ? CONN_RCVBUF - held : 0;
+    }
+
+    // Send a packet to a client, with a CRC trailer if it asked for them
+    void transmit(UDPpacket* pkt, const char* payload, size_t len, bool crc,
+      const sockaddr_in& addr)
+    {
+      if (crc)
+      {
+        sock.send_crc(pkt, payload, len, addr);
+      }
+      else
+      {
+        sock.send(pkt, payload, len, addr);
+      }
+    }
+
+    // Send an ACK, with the window after it if the client asked for one
+    void send_with_window(UDPpacket* pkt, Connection& c,
+      const sockaddr_in& addr)
+    {
+      if (!c.flow)
+      {
+        transmit(pkt, NULL, 0, c.crc, addr);
+        return;
+      }
+      int w = window(c);
+      uint32_t wnd = htonl(w);
+      pkt->setWindow();
+      transmit(pkt, (const char*) &wnd, sizeof(wnd), c.crc, addr);
+      c.window_closed = w < c.mss;
+    }
+
+    // Cumulative ACK of everything received in order
+    void send_ack(Connection& c, const sockaddr_in& addr, ConnStats& s)
+    {
+      PacketRef pkt_out= pool.make(htonl(SRVR_DEFAULT_SEQ+1), htonl(c.expected),
+        htons(c.connId), 1, 0, 0, NULL);
+      send_with_window(pkt_out.get(), c, addr);
+      log_packet(LOG_SEND, pkt_out.get());
+      stat_add(s.segments_sent);
+      c.unacked = 0;
+      c.ack_due = 0;
+    }
+
+    // Round trip from the packet timed by s.rtt_start to the one just
+    // received
+    void stats_rtt(ConnStats& s)
+    {
+      if (s.rtt_start)
+      {
+        s.add_rtt((log_tsc() - s.rtt_start) / tsc_clock().ticks_per_ns());
+        s.rtt_start = 0;
+      }
+    }
+
+    void log_packet(int type, const UDPpacket* pkt)
+    {
+      if (log)
+      {
+        log->record(type, pkt->getSeq(), pkt->getAck(), pkt->getconnID(), 0,
+          0, (pkt->isAck() ? LOG_ACK : 0) | (pkt->isSyn() ? LOG_SYN : 0) |
+          (pkt->isFin() ? LOG_FIN : 0));
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef RESUMPTION_H
+#define RESUMPTION_H
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include "siphash.h"
+
+#define TOKEN_LIFETIME 3600     // s a server's token lets a client send data in its SYN
+#define RESUME_LIFETIME 3600    // s a client keeps what it learned about a server
+#define RESUME_RTT_SLACK 1000   // us of handshake RTT above twice the cached SRTT
+
+using namespace std;
+
+// Resumption: a client that talked to a server before sends its first
+// segment along with the SYN, and starts from the congestion state it
+// ended with instead of from slow start.
+//
+// The server proves that the client receives at its address before taking
+// data with a SYN: every SYN-ACK to a client that asks for one carries a
+// token, the time it was issued and a MAC of it and the client's address
+// under the server's secret, and a SYN that presents a valid token may
+// carry data. Nothing is kept per client, and a new secret (a restarted
+// server) turns away every earlier token.
+class ResumeTokens
+{
+  public:
+    ResumeTokens()
+    {
+      random_device rd;
+      k0 = ((uint64_t) rd() << 32) | rd();
+      k1 = ((uint64_t) rd() << 32) | rd();
+    }
+
+    // A token for the client at addr, as of now_ms on the server's clock
+    int64_t issue(const sockaddr_in& addr, int64_t now_ms) const
+    {
+      uint32_t t = (uint32_t) (now_ms / 1000) & 0x7fffffff;
+      return ((int64_t) t << 32) | mac(addr, t);
+    }
+
+    bool valid(int64_t token, const sockaddr_in& addr, int64_t now_ms) const
+    {
+      if (token <= 0)
+      {
+        return false;
+      }
+      uint32_t t = (uint32_t) (token >> 32);
+      int64_t age = now_ms / 1000 - t;
+      return age >= 0 && age <= TOKEN_LIFETIME &&
+        (uint32_t) token == mac(addr, t);
+    }
+
+  private:
+    uint64_t k0, k1;
+
+    // SipHash-2-4 of the client's address and the issue time
+    uint32_t mac(const sockaddr_in& addr, uint32_t t) const
+    {
+      uint64_t m = ((uint64_t) addr.sin_addr.s_addr << 32) | t;
+      uint8_t bytes[8];
+      for (int i = 0; i < 8; i++)
+      {
+        bytes[i] = (uint8_t) (m >> (8 * i));
+      }
+      uint64_t h = siphash24(k0, k1, bytes, sizeof(bytes));
+      return (uint32_t) (h ^ (h >> 32));
+    }
+};
+
+// What a client keeps about a server from one connection to the next: the
+// last token, and the congestion state and smoothed RTT it ended with. A
+// zero token asks the server for one.
+struct ResumeState
+{
+  int64_t token;
+  long cwnd;       // 0 when unknown
+  long ssthresh;
+  long srtt_us;
+
+  ResumeState() : token(0), cwnd(0), ssthresh(0), srtt_us(0) {}
+};
+
+// The client's cache of ResumeStates by server address and port, kept in a
+// text file of one server per line between runs. Entries older than
+// RESUME_LIFETIME are forgotten, since the path may have changed since.
+class ResumeCache
+{
+  public:
+    // Read the cache file; a missing file is an empty cache
+    bool load(const string& path)
+    {
+      FILE* f = fopen(path.c_str(), "r");
+      if (!f)
+      {
+        return true;
+      }
+      char ip[INET_ADDRSTRLEN];
+      unsigned int port;
+      long long token, saved;
+      Entry e;
+      while (fscanf(f, "%15s %u %lld %ld %ld %ld %lld", ip, &port, &token,
+        &e.state.cwnd, &e.state.ssthresh, &e.state.srtt_us, &saved) == 7)
+      {
+        sockaddr_in addr;
+        if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1 || port > 65535)
+        {
+          continue;
+        }
+        addr.sin_port = htons(port);
+        e.state.token = token;
+        e.saved = saved;
+        if (fresh(e))
+        {
+          entries[key(addr)] = e;
+        }
+      }
+      fclose(f);
+      return true;
+    }
+
+    // Write the cache file, replacing it in one step so that clients
+    // running at the same time never read half of it
+    bool save(const string& path) const
+    {
+      string tmp = path + "." + to_string(getpid());
+      FILE* f = fopen(tmp.c_str(), "w");
+      if (!f)
+      {
+        return false;
+      }
+      for (unordered_map<uint64_t, Entry>::const_iterator it = entries.begin();
+        it != entries.end(); ++it)
+      {
+        if (!fresh(it->second))
+        {
+          continue;
+        }
+        in_addr a;
+        a.s_addr = htonl((uint32_t) (it->first >> 16));
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        const ResumeState& s = it->second.state;
+        fprintf(f, "%s %u %lld %ld %ld %ld %lld\n", ip,
+          (unsigned int) (it->first & 0xffff), (long long) s.token, s.cwnd,
+          s.ssthresh, s.srtt_us, (long long) it->second.saved);
+      }
+      bool ok = fclose(f) == 0;
+      return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // What is known about the server at addr, NULL if nothing
+    const ResumeState* find(const sockaddr_in& addr) const
+    {
+      unordered_map<uint64_t, Entry>::const_iterator it =
+        entries.find(key(addr));
+      return it == entries.end() || !fresh(it->second) ? NULL :
+        &it->second.state;
+    }
+
+    void store(const sockaddr_in& addr, const ResumeState& state)
+    {
+      Entry& e = entries[key(addr)];
+      e.state = state;
+      e.saved = time(NULL);
+    }
+
+  private:
+    struct Entry
+    {
+      ResumeState state;
+      long long saved;  // wall clock seconds
+    };
+
+    unordered_map<uint64_t, Entry> entries;
+
+    static uint64_t key(const sockaddr_in& addr)
+    {
+      return ((uint64_t) ntohl(addr.sin_addr.s_addr) << 16) |
+        ntohs(addr.sin_port);
+    }
+
+    static bool fresh(const Entry& e)
+    {
+      long long age = time(NULL) - e.saved;
+      return age >= 0 && age <= RESUME_LIFETIME;
+    }
+};
+
+#endif
@@ -0,0 +1,1115 @@
+#ifndef SENDER_H
+#define SENDER_H
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "netenv.h"
+#include "packetpool.h"
+#include "seqnum.h"
+#include "options.h"
+#include "pmtud.h"
+#include "fec.h"
+#include "streams.h"
+#include "resumption.h"
+#include "localpath.h"
+#include "eventlog.h"
+#include "connstats.h"
+
+#define SYN_TIMEOUT 10000   // ms without a SYN-ACK before giving up
+#define RTO 500             // ms without any packet before retransmitting
+#define ACK_TIMEOUT 10000   // ms without an ACK that moves the window before giving up
+#define FIN_WAIT 2000       // ms to keep ACKing the server's FIN
+#define MAX_PERSIST 4000    // ms between probes of a closed receive window
+
+using namespace std;
+
+// The client's side of a Confundo transfer, as an event-driven state
+// machine. The owner feeds it every datagram from the server
+// (on_datagram()) and calls on_timer() once the clock reaches deadline();
+// everything else, including the time, comes from the Clock and
+// PacketSocket it was built with, so the same code runs over a UDP socket
+// and in the simulator.
+//
+// The sender transmits up to cwnd bytes, then waits until all of them are
+// ACKed or RTO ms pass without a packet, in which case it goes back to the
+// first unACKed byte. Once everything is ACKed it sends a FIN, again every
+// RTO until the server's FIN answers it, and ACKs FINs from the server for
+// FIN_WAIT ms.
+//
+// With flow control, the server's ACKs also say how many bytes past the ACK
+// it can take, and the sender keeps within min(cwnd, that window). While
+// the window is closed it sends an empty segment every persist interval,
+// backing off up to MAX_PERSIST ms, so a lost window update cannot stall the
+// transfer.
+//
+// With forward error correction, a parity segment follows every block of
+// fresh segments (see fec.h). Blocks shrink as the rate of losses the ACKs
+// reveal grows, from the negotiated size down to MINFECBLOCK segments.
+//
+// A sender given streams instead of a file sends them all over the one
+// connection, as the frames of streams.h, and fails against a server that
+// does not echo the streams option.
+//
+// A resuming sender asks the server for a token (resumption.h). With one
+// from an earlier connection, the first segment goes out with the SYN, and
+// if the handshake RTT shows the same path, the earlier cwnd and ssthresh
+// replace slow start from DATABUF.
+//
+// A sender that asks for CRCs ends every packet with a CRC32C of it
+// (crc32c.h), and once the server agrees, drops what arrives damaged or
+// without one. Its FIN carries the CRC of everything it sent, which the
+// server checks the file against.
+//
+// The handshake ACK repeats the SYN's options, for a server that answered
+// with a SYN cookie (syncookie.h) and opens the connection only then. Until
+// the server answers anything else, it goes out again with every
+// retransmission, since a server that lost it drops the whole transfer.
+//
+// A sender that asks for the same-host path, to a server that offers it,
+// hands the rest of the file over through shared memory right after the
+// handshake (localpath.h), and then only sends the FIN. The sender does no
+// I/O of its own for it: it waits, sending nothing, while its owner takes
+// the job (take_handoff()), sends it off the event loop and reports back
+// (handoff_sent(), handoff_answer()). If the server refuses, the file goes
+// over UDP; if it does not answer within LOCAL_TIMEOUT ms of the request,
+// the transfer fails. Uploads with streams or CRCs do not ask.
+class ConfundoSender
+{
+  public:
+    enum State
+    {
+      SYN_SENT,
+      TRANSFER,
+      FIN_SENT,
+      DONE,
+      FAILED  // the server stopped responding
+    };
+
+    ConfundoSender(Clock& clock, PacketSocket& sock,
+      const sockaddr_in& server, const char* file_data, long file_size,
+      ConnStats& stats, int wscale = -1, int mss = 0, int ackfreq = 0,
+      bool flow = false, int fecblock = 0, bool crc = false,
+      bool local = false) :
+      clock(clock),
+      sock(sock), server(server), file_data(file_data), file_size(file_size),
+      stats(stats), series(NULL), log(NULL), st(SYN_SENT), connectionID(0),
+      isn(CLNT_DEFAULT_SEQ), server_isn(0),
+      cwnd(DATABUF), ssthresh(INITSSTHRESH), max_cwnd(MAXCWND), ack_every(1),
+      rwnd_end(LONG_MAX), persist(0), last_ack_new(true), syn_optlen(0),
+      early_bytes(0), server_token(-1), srtt_us(0), crc(crc), digest(0),
+      pmtu(DATABUF, DATABUF),
+      first_unsent_byte(0),
+      first_unacked_byte(0), highest_sent_byte(0), recovery_end(0),
+      rtt_end_byte(0), finished_sending(false), finished_receiving(false),
+      fin_acked(false), answered(false), handoff(HANDOFF_NONE),
+      handoff_due(0), state_start(0), last_rx(0), packet_count(0)
+    {
+      syn_opts.wscale = wscale;
+      syn_opts.mss = mss;
+      syn_opts.ackfreq = ackfreq;
+      syn_opts.rcvbuf = flow ? 0 : -1;
+      syn_opts.fecblock = fecblock;
+      syn_opts.crc = crc;
+      syn_opts.local = local && !crc;
+      syn_optlen = syn_opts.empty() ? 0 : syn_opts.encode(syn_optbuf);
+    }
+
+    // Packets are logged to log and cwnd changes recorded in series when
+    // they are set
+    void set_log(EventLog* event_log)
+    {
+      log = event_log;
+    }
+
+    void set_series(CwndSeries* cwnd_series)
+    {
+      series = cwnd_series;
+    }
+
+    // Sequence number of the SYN, CLNT_DEFAULT_SEQ unless set before
+    // start(). The SYN-ACK acknowledges it, so senders sharing a socket tell
+    // their SYN-ACKs apart by it.
+    void set_isn(unsigned int seq)
+    {
+      isn = seq;
+    }
+
+    unsigned int initial_seq() const
+    {
+      return isn;
+    }
+
+    // The connId the server assigned, 0 before the SYN-ACK
+    short int conn_id() const
+    {
+      return connectionID;
+    }
+
+    // Send size bytes at data as one of several streams, instead of the
+    // file the sender was built with; returns the stream id. Streams are
+    // added before start().
+    int add_stream(const char* data, long size)
+    {
+      return layout.add(data, size);
+    }
+
+    // Ask the server for a token, and pick up from state, what an earlier
+    // connection to it left (a default ResumeState for a first contact).
+    // Called before start().
+    void resume(const ResumeState& state)
+    {
+      resume_from = state;
+      srtt_us = state.srtt_us;
+      syn_opts.token = state.token;
+      syn_optlen = syn_opts.encode(syn_optbuf);
+    }
+
+    // What the next connection to the server can pick up from this one;
+    // false unless the server gave a token
+    bool resume_state(ResumeState& state) const
+    {
+      if (server_token <= 0)
+      {
+        return false;
+      }
+      state.token = server_token;
+      state.cwnd = cwnd;
+      state.ssthresh = ssthresh;
+      state.srtt_us = srtt_us;
+      return true;
+    }
+
+    // Send the SYN, with the first segment when the sender has a token
+    void start()
+    {
+      int64_t now = clock.now_ms();
+      if (layout.streams() && !syn_opts.streams)
+      {
+        layout.build();
+        file_data = NULL;
+        file_size = layout.size();
+        syn_opts.streams = true;
+        syn_opts.local = false;
+        syn_optlen = syn_opts.encode(syn_optbuf);
+      }
+      syn_payload.assign(syn_optbuf, syn_optbuf + syn_optlen);
+      early_bytes = syn_opts.token > 0 ? min(file_size, (long) DATABUF) : 0;
+      if (early_bytes)
+      {
+        const char* early = bytes_at(0, early_bytes);
+        syn_payload.insert(syn_payload.end(), early, early + early_bytes);
+        sent_through(early, 0, early_bytes);
+      }
+      PacketRef pkt_syn = pool.make(htonl(isn), htonl(0), 0, 0,
+        1, 0, NULL);
+      if (syn_optlen)
+      {
+        pkt_syn->setOpt();
+      }
+      send(pkt_syn.get(), syn_payload.data(), syn_payload.size());
+      log_packet(LOG_SEND, pkt_syn.get());
+      stats.reset(0, log_tsc());
+      stats.rtt_start = log_tsc();  // timed until the SYN-ACK
+      stat_add(stats.segments_sent);
+      stat_add(stats.bytes_sent, early_bytes);
+      st = SYN_SENT;
+      state_start = last_rx = now;
+    }
+
+    State state() const
+    {
+      return st;
+    }
+
+    bool finished() const
+    {
+      return st == DONE || st == FAILED;
+    }
+
+    // Whether the server has answered the FIN, so it has the whole file;
+    // the sender keeps ACKing the server's FIN for a while after that
+    bool delivered() const
+    {
+      return st == DONE || (st == FIN_SENT && fin_acked);
+    }
+
+    // When on_timer() is due
+    int64_t deadline() const
+    {
+      return last_rx + (st == FIN_SENT && fin_acked ? FIN_WAIT :
+        persist ? persist : RTO);
+    }
+
+    unsigned long packets() const
+    {
+      return packet_count;
+    }
+
+    // Whether the server offered the same-host path and the sender waits
+    // for its owner to take the job
+    bool handoff_wanted() const
+    {
+      return st == TRANSFER && handoff == HANDOFF_WANTED;
+    }
+
+    // Take the job of handing over what the server has not got yet, for
+    // local_handoff_send(); false, and the transfer goes on over UDP, if
+    // there is nothing left to hand over
+    bool take_handoff(LocalJob& job)
+    {
+      long off = first_unacked_byte;
+      if (!handoff_wanted() || off >= file_size)
+      {
+        handoff = HANDOFF_NONE;
+        if (st == TRANSFER)
+        {
+          pump(clock.now_ms());
+        }
+        return false;
+      }
+      job.offer = local_offer;
+      job.connId = connectionID;
+      job.seq = seqs.add(isn + 1, off);
+      job.data = file_data + off;
+      job.len = file_size - off;
+      handoff = HANDOFF_COPYING;
+      return true;
+    }
+
+    // The request of the job went out, and the answer is due within
+    // LOCAL_TIMEOUT ms; or it did not, and the file goes over UDP
+    void handoff_sent(bool sent)
+    {
+      int64_t now = clock.now_ms();
+      if (sent)
+      {
+        handoff = HANDOFF_SENT;
+        handoff_due = now + LOCAL_TIMEOUT;
+        return;
+      }
+      handoff_answer(LOCAL_REFUSED);
+    }
+
+    // The server's answer to the request
+    void handoff_answer(LocalResult r)
+    {
+      if (handoff == HANDOFF_NONE || finished())
+      {
+        return;
+      }
+      handoff = HANDOFF_NONE;
+      if (r == LOCAL_FAILED)
+      {
+        st = FAILED;
+        return;
+      }
+      if (r == LOCAL_TAKEN)
+      {
+        stat_add(stats.bytes_sent, file_size - first_unacked_byte);
+        first_unacked_byte = first_unsent_byte = highest_sent_byte =
+          file_size;
+      }
+      int64_t now = clock.now_ms();
+      state_start = last_rx = now;
+      pump(now);
+    }
+
+    const PacketPool& packet_pool() const
+    {
+      return pool;
+    }
+
+    void on_datagram(const char* buf, int len)
+    {
+      if (len < (int) sizeof(UDPheader) || finished())
+      {
+        return;
+      }
+      const UDPpacket* pkt_in = reinterpret_cast<const UDPpacket*> (buf);
+
+      // A damaged packet counts as lost, and so does one without a CRC once
+      // they are negotiated. The trailer is not part of the payload.
+      if (pkt_in->isCrc() || (crc && st != SYN_SENT))
+      {
+        int payload_len = len - sizeof(UDPheader);
+        if (!pkt_in->isCrc() ||
+          !check_crc(pkt_in, buf + sizeof(UDPheader), payload_len))
+        {
+          log_packet(LOG_DROP, pkt_in);
+          return;
+        }
+        len = sizeof(UDPheader) + payload_len;
+      }
+      int64_t now = clock.now_ms();
+      last_rx = now;
+      stat_add(stats.segments_received);
+
+      if (st == SYN_SENT)
+      {
+        log_packet(LOG_RECV, pkt_in);
+        if (pkt_in->isSyn() && pkt_in->isAck())
+        {
+          handshake(pkt_in, buf, len);
+          if (st == TRANSFER)
+          {
+            state_start = now;
+            if (handoff == HANDOFF_NONE)
+            {
+              pump(now);
+            }
+          }
+        }
+        else if (now - state_start > SYN_TIMEOUT)
+        {
+          st = FAILED;
+        }
+        return;
+      }
+
+      if (st == FIN_SENT)
+      {
+        // Only send an ACK if the received packet is a FIN, which also
+        // tells that ours arrived
+        if (pkt_in->isFin())
+        {
+          log_packet(LOG_RECV, pkt_in);
+          answered = true;
+          if (!fin_acked)
+          {
+            fin_acked = true;
+            state_start = now;
+          }
+          PacketRef pkt_ack = pool.make(
+            htonl(pkt_in->getAck()),
+            htonl(seqs.add(pkt_in->getSeq(), 1)),
+            htons(pkt_in->getconnID()), 1, 0, 0, NULL);
+          send(pkt_ack.get(), NULL, 0);
+          log_packet(LOG_SEND, pkt_ack.get());
+          stat_add(stats.segments_sent);
+        }
+        else
+        {
+          log_packet(LOG_DROP, pkt_in);
+        }
+        if (fin_acked && now - state_start > FIN_WAIT)
+        {
+          close();
+        }
+        return;
+      }
+
+      // Expect ACKs for the window just sent out
+      packet_count++;
+      log_packet(LOG_RECV, pkt_in);
+      if (!pkt_in->isSyn())
+      {
+        answered = true;
+      }
+      if (handoff != HANDOFF_NONE)
+      {
+        return;  // nothing is sent until the server has answered it
+      }
+      if (pkt_in->hasWindow())
+      {
+        on_window(pkt_in, buf, len);
+      }
+      if (on_ack(pkt_in, now))
+      {
+        return;
+      }
+      if (now - state_start > ACK_TIMEOUT)
+      {
+        st = FAILED;
+      }
+      else if (!waiting())
+      {
+        pump(now);
+      }
+    }
+
+    void on_timer()
+    {
+      int64_t now = clock.now_ms();
+      if (finished() || now < deadline())
+      {
+        return;
+      }
+      last_rx = now;
+
+      if (st == SYN_SENT)
+      {
+        if (now - state_start > SYN_TIMEOUT)
+        {
+          st = FAILED;
+          return;
+        }
+        PacketRef pkt_syn = pool.make(htonl(isn), htonl(0),
+          htons(connectionID), 0, 1, 0, NULL);
+        if (syn_optlen)
+        {
+          pkt_syn->setOpt();
+        }
+        send(pkt_syn.get(), syn_payload.data(), syn_payload.size());
+        log_packet(LOG_SEND, pkt_syn.get(), true);
+        stat_add(stats.segments_sent);
+        stat_add(stats.retransmits);
+        stats.rtt_start = 0;  // no RTT from retransmitted segments
+        return;
+      }
+
+      if (!answered)
+      {
+        send_handshake_ack();
+      }
+      if (handoff != HANDOFF_NONE)
+      {
+        if (handoff == HANDOFF_SENT && now >= handoff_due)
+        {
+          st = FAILED;  // the server may or may not have the data
+        }
+        return;
+      }
+
+      // Until the server answers the FIN, it is sent again every RTO
+      if (st == FIN_SENT)
+      {
+        if (fin_acked)
+        {
+          close();
+        }
+        else if (now - state_start > ACK_TIMEOUT)
+        {
+          st = FAILED;
+        }
+        else
+        {
+          send_fin(true);
+        }
+        return;
+      }
+
+      // The receive window is still closed: probe it with an empty segment,
+      // which the server ACKs at once with its window
+      if (window_closed())
+      {
+        if (now - state_start > ACK_TIMEOUT)
+        {
+          st = FAILED;
+          return;
+        }
+        PacketRef pkt_probe = pool.make(
+          htonl(seqs.add(isn + 1, first_unsent_byte)),
+          htonl(0), htons(connectionID), 0, 0, 0);
+        pkt_probe->setImmediate();
+        send(pkt_probe.get(), NULL, 0);
+        log_packet(LOG_SEND, pkt_probe.get());
+        stat_add(stats.segments_sent);
+        persist = min(persist * 2, (int64_t) MAX_PERSIST);
+        return;
+      }
+
+      // Retransmission timeout: go back to the first unACKed byte, unless
+      // no ACK has moved it for ACK_TIMEOUT ms however often it was resent
+      if (now - state_start > ACK_TIMEOUT)
+      {
+        st = FAILED;
+        return;
+      }
+      finished_sending = false;
+      first_unsent_byte = first_unacked_byte;
+      if (fec.enabled())
+      {
+        fec.on_loss();
+        fec.close();
+      }
+
+      // Update congestion control variables, and shrink segments if the
+      // path has started dropping the larger ones
+      pmtu.on_timeout(now);
+      ssthresh = cwnd / 2;
+      cwnd = pmtu.mss();
+      recovery_end = highest_sent_byte;
+      stats.rtt_start = 0;
+      update_cc_stats();
+      pump(now);
+    }
+
+  private:
+    Clock& clock;
+    PacketSocket& sock;
+    sockaddr_in server;
+    const char* file_data;
+    long file_size;
+    ConnStats& stats;
+    CwndSeries* series;
+    EventLog* log;
+    PacketPool pool;
+    State st;
+    short int connectionID;
+    unsigned int isn;
+    unsigned int server_isn;  // the SYN-ACK's sequence number
+
+    // Congestion control variables
+    long cwnd;
+    long ssthresh;
+    long max_cwnd;
+
+    // Segments the server may cover with one ACK. With more than one, cwnd
+    // grows by the bytes each ACK covers rather than by one segment per ACK.
+    int ack_every;
+
+    // The byte the server's receive window ends at, LONG_MAX without flow
+    // control, and the interval between probes while it is closed (0 while
+    // it is open)
+    long rwnd_end;
+    int64_t persist;
+
+    // Error correction blocks, and whether the last ACK was a new one: the
+    // first duplicate after it means a segment went missing
+    FecEncoder fec;
+    bool last_ack_new;
+
+    // The frames of the streams, when there are any
+    StreamLayout layout;
+
+    // Legacy sequence numbers until the server agrees to window scaling
+    SeqSpace seqs;
+    ConfundoOptions syn_opts;
+    char syn_optbuf[MAXOPTIONS + 1];
+    size_t syn_optlen;
+    vector<char> syn_payload;  // the options, then any data sent with the SYN
+
+    // Resumption: what the earlier connection left, the bytes sent with the
+    // SYN, and the token for the next connection (-1 if none)
+    ResumeState resume_from;
+    long early_bytes;
+    int64_t server_token;
+    long srtt_us;   // smoothed RTT, 0 before the first sample
+
+    // Whether packets carry CRCs: as asked for until the SYN-ACK, then as
+    // negotiated; and the CRC of the bytes sent so far
+    bool crc;
+    uint32_t digest;
+
+    // Segment size: DATABUF unless the server accepts a larger MSS, in which
+    // case the path MTU search grows it from there
+    PmtuSearch pmtu;
+    vector<char> padding;
+
+    // Offsets into the file. Bytes below highest_sent_byte have been
+    // transmitted before, so sending them again is a retransmission.
+    long first_unsent_byte;
+    long first_unacked_byte;
+    long highest_sent_byte;
+
+    // Go-back-N recovery after a timeout lasts until everything that had
+    // been sent before it is acknowledged. One segment at a time is timed
+    // for RTT samples, never a retransmitted one.
+    long recovery_end;
+    long rtt_end_byte;
+
+    bool finished_sending;
+    bool finished_receiving;
+    bool fin_acked;       // the server's FIN arrived
+    bool answered;        // the server sent more than the SYN-ACK
+
+    // The same-host path: offered by the server, taken by the owner, and
+    // its request sent, with the answer due by handoff_due
+    enum
+    {
+      HANDOFF_NONE,
+      HANDOFF_WANTED,
+      HANDOFF_COPYING,
+      HANDOFF_SENT
+    } handoff;
+    ConfundoOptions local_offer;
+    int64_t handoff_due;
+    // When the SYN or FIN wait began, or in the transfer when an ACK last
+    // moved the first unACKed byte or the window was last probed
+    int64_t state_start;
+    int64_t last_rx;      // when the last packet arrived, or the timer fired
+    unsigned long packet_count;
+
+    void log_packet(int type, const UDPpacket* pkt, bool dup = false)
+    {
+      if (log)
+      {
+        log->record(type, pkt->getSeq(), pkt->getAck(), pkt->getconnID(),
+          cwnd, ssthresh, (pkt->isAck() ? LOG_ACK : 0) |
+          (pkt->isSyn() ? LOG_SYN : 0) | (pkt->isFin() ? LOG_FIN : 0) |
+          (dup ? LOG_DUP : 0));
+      }
+    }
+
+    void update_cc_stats()
+    {
+      uint64_t now = log_tsc();
+      stats.cwnd.store(cwnd, memory_order_relaxed);
+      stats.ssthresh.store(ssthresh, memory_order_relaxed);
+      stats.set_phase(first_unacked_byte < recovery_end ? PHASE_RECOVERY :
+        (cwnd < ssthresh ? PHASE_SLOW_START : PHASE_AVOIDANCE), now);
+      if (series)
+      {
+        series->add(now, cwnd, ssthresh);
+      }
+    }
+
+    void close()
+    {
+      st = DONE;
+      stats.close(log_tsc());
+    }
+
+    // Still waiting for ACKs of the window in flight
+    bool waiting() const
+    {
+      return !finished_receiving && first_unacked_byte < first_unsent_byte;
+    }
+
+    // Nothing is in flight and the server has no room for the next segment
+    bool window_closed() const
+    {
+      return st == TRANSFER && !finished_sending &&
+        first_unsent_byte == first_unacked_byte &&
+        first_unsent_byte + min(file_size - first_unsent_byte,
+          (long) pmtu.mss()) > rwnd_end;
+    }
+
+    // Bytes may be sent up to the end of cwnd or of the receive window,
+    // whichever comes first
+    long send_limit() const
+    {
+      return min(first_unacked_byte + cwnd, rwnd_end);
+    }
+
+    // Take the receive window from an ACK that is not older than the last
+    void on_window(const UDPpacket* pkt_in, const char* buf, int len)
+    {
+      unsigned int unacked_seq = seqs.add(isn + 1,
+        first_unacked_byte);
+      if (len < (int) (sizeof(UDPheader) + sizeof(uint32_t)) ||
+        seqs.lt(pkt_in->getAck(), unacked_seq))
+      {
+        return;
+      }
+      uint32_t wnd;
+      memcpy(&wnd, buf + sizeof(UDPheader), sizeof(wnd));
+      rwnd_end = first_unacked_byte + seqs.dist(unacked_seq,
+        pkt_in->getAck()) + ntohl(wnd);
+    }
+
+    // Finish the 3-way handshake after the SYN-ACK
+    void handshake(const UDPpacket* pkt_in, const char* buf, int len)
+    {
+      connectionID = pkt_in->getconnID();
+      stats.connId = connectionID;
+      long handshake_rtt_us = -1;  // none if the SYN was sent again
+      if (stats.rtt_start)
+      {
+        handshake_rtt_us = sample_rtt();
+      }
+
+      // A server that echoes the window scale option switches the
+      // connection to 32-bit sequence numbers and larger windows, and slow
+      // start runs until the first loss like in TCP
+      ConfundoOptions opts;
+      if (pkt_in->hasOpt())
+      {
+        opts.decode(buf + sizeof(UDPheader), len - sizeof(UDPheader));
+      }
+      crc = crc && opts.crc;
+      if (opts.wscale >= 0)
+      {
+        seqs = SeqSpace(true);
+        max_cwnd = (long) MAXCWND << opts.wscale;
+        ssthresh = max_cwnd;
+      }
+
+      // With a negotiated MSS, probe for the path MTU. Probes must be
+      // dropped rather than fragmented when they are too large. A segment
+      // is kept to half the largest window, so its ACK is always "after"
+      // its sequence number even in the legacy sequence space.
+      if (opts.mss > DATABUF)
+      {
+        int max_mss = min((long) opts.mss, max_cwnd / 2);
+        pmtu = PmtuSearch(DATABUF, max_mss, crc ? CRC_TRAILER : 0);
+        padding.assign(max_mss, 0);
+        sock.set_dont_fragment();
+      }
+
+      // A server that echoes the ACK frequency option ACKs only every few
+      // segments, unless it is asked for an immediate ACK
+      if (opts.ackfreq > 1)
+      {
+        ack_every = opts.ackfreq;
+      }
+
+      // A server that echoes the receive buffer option starts with that
+      // much room and says how much is left in every ACK
+      if (opts.rcvbuf >= 0 && syn_opts.rcvbuf >= 0)
+      {
+        rwnd_end = opts.rcvbuf;
+      }
+
+      // A server that echoes the error correction option repairs single
+      // losses in blocks of up to that many segments
+      if (opts.fecblock >= MINFECBLOCK && syn_opts.fecblock >= MINFECBLOCK)
+      {
+        fec.enable(min(opts.fecblock, syn_opts.fecblock),
+          max((int) padding.size(), DATABUF));
+      }
+
+      // Streams only make sense to a server that can split them
+      if (syn_opts.streams && !opts.streams)
+      {
+        st = FAILED;
+        return;
+      }
+
+      // The server took the data sent with the SYN, or it is sent again.
+      // The earlier connection's congestion state holds if the handshake
+      // took about as long as its RTTs did.
+      server_token = opts.token;
+      if (early_bytes && opts.early == early_bytes)
+      {
+        first_unacked_byte = first_unsent_byte = early_bytes;
+      }
+      if (resume_from.cwnd > 0 && handshake_rtt_us >= 0 &&
+        handshake_rtt_us <= 2 * resume_from.srtt_us + RESUME_RTT_SLACK)
+      {
+        cwnd = max(min(resume_from.cwnd, max_cwnd), (long) DATABUF);
+        ssthresh = min(resume_from.ssthresh, max_cwnd);
+      }
+
+      server_isn = pkt_in->getSeq();
+      send_handshake_ack();
+      st = TRANSFER;
+      update_cc_stats();
+
+      if (syn_opts.local && opts.local && opts.local_path[0])
+      {
+        handoff = HANDOFF_WANTED;
+        local_offer = opts;
+      }
+    }
+
+    void send_handshake_ack()
+    {
+      PacketRef pkt_syn_ack = pool.make(
+        htonl(seqs.add(isn, 1)),
+        htonl(seqs.add(server_isn, 1)),
+        htons(connectionID), 1, 0, 0, NULL);
+      if (syn_optlen)
+      {
+        pkt_syn_ack->setOpt();
+      }
+      send(pkt_syn_ack.get(), syn_optbuf, syn_optlen);
+      log_packet(LOG_SEND, pkt_syn_ack.get());
+      stat_add(stats.segments_sent);
+    }
+
+    // Send what the window allows, then wait for its ACKs; once the whole
+    // file is ACKed, wait for the server's FIN
+    void pump(int64_t now)
+    {
+      while (!finished_sending || !finished_receiving)
+      {
+        send_window(now);
+        long unreceived_bytes = file_size - first_unacked_byte;
+        if (min(unreceived_bytes, (long) pmtu.mss()) <= 0)
+        {
+          finished_receiving = true;
+        }
+        if (waiting())
+        {
+          last_rx = now;
+          persist = 0;
+          return;
+        }
+        if (window_closed())
+        {
+          // Until the window reopens, the server is alive as long as it
+          // answers the probes
+          if (!persist)
+          {
+            persist = RTO;
+          }
+          state_start = now;
+          last_rx = now;
+          return;
+        }
+      }
+      fin_wait(now);
+    }
+
+    void send_window(int64_t now)
+    {
+      // Probe for a larger segment size when one is due
+      int probe_size = pmtu.probe_due(now);
+      if (probe_size > 0)
+      {
+        PacketRef pkt_probe = pool.make(
+          htonl(seqs.add(isn + 1, first_unsent_byte)), htonl(0),
+          htons(connectionID), 0, 0, 0);
+        pkt_probe->setProbe();
+        if (send(pkt_probe.get(), padding.data(), probe_size) == EMSGSIZE)
+        {
+          pmtu.on_probe_refused();
+        }
+        else
+        {
+          log_packet(LOG_SEND, pkt_probe.get());
+        }
+      }
+
+      int mss = pmtu.mss();
+      long unsent_bytes = file_size - first_unsent_byte;
+      int bytes_to_send = min(unsent_bytes, (long) mss);
+      if (bytes_to_send <= 0)
+      {
+        finished_sending = true;
+      }
+
+      // Send up to cwnd bytes, and no more than the server can take
+      while (!finished_sending &&
+        first_unsent_byte + bytes_to_send <= send_limit())
+      {
+        // It is a DUP only if we've sent these bytes before
+        bool isDUP = first_unsent_byte < highest_sent_byte;
+        const char* payload = bytes_at(first_unsent_byte, bytes_to_send);
+
+        // Fresh segments join the error correction block, which ends
+        // before the segment size grows
+        bool in_block = fec.enabled() && !isDUP;
+        long block_start = 0;
+        if (in_block)
+        {
+          if (fec.open() && bytes_to_send > fec.segment_size())
+          {
+            send_parity();
+          }
+          block_start = fec.add(first_unsent_byte, payload, bytes_to_send);
+        }
+
+        // Build the header and send it together with the payload, which the
+        // socket gathers directly from the file data (or from a copy, for
+        // the bytes around a stream frame header)
+        PacketRef pkt_file = pool.make(
+          htonl(seqs.add(isn + 1, first_unsent_byte)),
+          htonl(in_block ? seqs.add(isn + 1, block_start) : 0),
+          htons(connectionID), 0, 0, 0);
+        if (in_block)
+        {
+          pkt_file->setFec();
+        }
+
+        // The last segment of the window is ACKed right away, since
+        // nothing more is sent until it is
+        long next_byte = first_unsent_byte + bytes_to_send;
+        long next_bytes = min(file_size - next_byte, (long) mss);
+        bool window_end = next_bytes <= 0 ||
+          next_byte + next_bytes > send_limit();
+        if (ack_every > 1 && window_end)
+        {
+          pkt_file->setImmediate();
+        }
+        send(pkt_file.get(), payload, bytes_to_send);
+        sent_through(payload, first_unsent_byte, bytes_to_send);
+        packet_count++;
+        stat_add(stats.segments_sent);
+        stat_add(stats.bytes_sent, bytes_to_send);
+        if (isDUP)
+        {
+          stat_add(stats.retransmits);
+        }
+        else if (!stats.rtt_start)
+        {
+          stats.rtt_start = log_tsc();
+          rtt_end_byte = first_unsent_byte + bytes_to_send;
+        }
+        log_packet(LOG_SEND, pkt_file.get(), isDUP);
+
+        // Update state variables
+        first_unsent_byte += bytes_to_send;
+        unsent_bytes = file_size - first_unsent_byte;
+        bytes_to_send = min(unsent_bytes, (long) mss);
+        if (bytes_to_send <= 0)
+        {
+          finished_sending = true;
+        }
+
+        // The block's parity goes out once it is complete, or nothing more
+        // is sent until its ACKs
+        if (fec.open() && (fec.full() || window_end))
+        {
+          send_parity();
+        }
+      }
+    }
+
+    // The parity of the open block, which ends at the first unsent byte
+    void send_parity()
+    {
+      PacketRef pkt_parity = pool.make(
+        htonl(seqs.add(isn + 1, fec.block_start())),
+        htonl(seqs.add(isn + 1, first_unsent_byte)),
+        htons(connectionID), 0, 0, 0);
+      pkt_parity->setFec();
+      pkt_parity->setParity();
+      send(pkt_parity.get(), fec.data(), fec.length());
+      log_packet(LOG_SEND, pkt_parity.get());
+      stat_add(stats.segments_sent);
+      fec.close();
+    }
+
+    // Handle a packet while waiting for ACKs; true once the FIN is out
+    bool on_ack(const UDPpacket* pkt_in, int64_t now)
+    {
+      // A probe got through: its size, echoed in the sequence number,
+      // becomes the new segment size
+      if (pkt_in->isProbe())
+      {
+        pmtu.on_probe_acked(pkt_in->getSeq());
+        cwnd = max(cwnd, (long) pmtu.mss());
+        return false;
+      }
+      if (!pkt_in->isAck())
+      {
+        return false;
+      }
+
+      // ACKs are cumulative: a new one acknowledges every byte up to its
+      // number. It is new if it lies within the bytes in flight; an old or
+      // duplicate ACK is at most a window behind, which puts it more than a
+      // window ahead in the sequence space. Serial number comparison is not
+      // enough, since the legacy space is only twice MAXCWND: an ACK a whole
+      // window ahead would count as a duplicate.
+      unsigned int unacked_seq = seqs.add(isn + 1,
+        first_unacked_byte);
+      long acked = seqs.dist(unacked_seq, pkt_in->getAck());
+      if (acked == 0 || acked > highest_sent_byte - first_unacked_byte)
+      {
+        stat_add(stats.dup_acks);
+        if (last_ack_new && waiting() && fec.enabled())
+        {
+          fec.on_loss();
+        }
+        last_ack_new = false;
+        return false;
+      }
+      last_ack_new = true;
+      state_start = now;
+
+      // Update congestion control variables. An ACK covering several
+      // segments counts for the bytes it covers, up to the segments the
+      // server may wait for (RFC 3465), so coalesced ACKs grow cwnd as fast
+      // as one ACK per segment.
+      int mss = pmtu.mss();
+      pmtu.on_ack();
+      long credit = ack_every > 1 ? min(acked, (long) ack_every * mss) : mss;
+      if (cwnd < ssthresh)
+      {
+        cwnd += credit;
+      }
+      else
+      {
+        cwnd += ((long) mss * credit) / cwnd;
+      }
+
+      // Keep CWND within its allowed bounds
+      cwnd = min(cwnd, max_cwnd);
+      cwnd = max(cwnd, (long) mss);
+
+      // Update state variables
+      first_unacked_byte += acked;
+      first_unsent_byte = max(first_unsent_byte, first_unacked_byte);
+      if (stats.rtt_start && first_unacked_byte >= rtt_end_byte)
+      {
+        sample_rtt();
+      }
+      update_cc_stats();
+      long unreceived_bytes = file_size - first_unacked_byte;
+      if (min(unreceived_bytes, (long) mss) <= 0)
+      {
+        finished_receiving = true;
+      }
+
+      // If done sending and receiving, close connection with a FIN
+      if (finished_sending && finished_receiving)
+      {
+        fin_wait(now);
+        return true;
+      }
+      return false;
+    }
+
+    // RTT of the segment timed by stats.rtt_start, folded into the smoothed
+    // RTT like in RFC 6298; returns it in microseconds
+    long sample_rtt()
+    {
+      uint64_t ns = (log_tsc() - stats.rtt_start) / tsc_clock().ticks_per_ns();
+      stats.add_rtt(ns);
+      stats.rtt_start = 0;
+      long us = ns / 1000;
+      srtt_us = srtt_us ? srtt_us + (us - srtt_us) / 8 : us;
+      return us;
+    }
+
+    // Send a packet to the server, with a CRC trailer if it is to carry one
+    int send(UDPpacket* pkt, const char* payload, size_t len)
+    {
+      return crc ? sock.send_crc(pkt, payload, len, server) :
+        sock.send(pkt, payload, len, server);
+    }
+
+    // The n bytes at payload, offset off into the file, went out: the ones
+    // never sent before extend highest_sent_byte, and the CRC of what was
+    // sent
+    void sent_through(const char* payload, long off, int n)
+    {
+      long end = off + n;
+      if (end <= highest_sent_byte)
+      {
+        return;
+      }
+      if (crc)
+      {
+        digest = crc32c(digest, payload + (highest_sent_byte - off),
+          end - highest_sent_byte);
+      }
+      highest_sent_byte = end;
+    }
+
+    // n bytes of the file, or of the streams' frames, at offset off
+    const char* bytes_at(long off, int n)
+    {
+      return layout.streams() ? layout.bytes(off, n) : file_data + off;
+    }
+
+    // Send the FIN and wait for the server's
+    void fin_wait(int64_t now)
+    {
+      send_fin(false);
+      st = FIN_SENT;
+      state_start = last_rx = now;
+    }
+
+    void send_fin(bool dup)
+    {
+      PacketRef pkt_fin = pool.make(
+        htonl(seqs.add(isn + 1, file_size)), htonl(crc ? digest : 0),
+        htons(connectionID), 0, 0, 1, NULL);
+      send(pkt_fin.get(), NULL, 0);
+      log_packet(LOG_SEND, pkt_fin.get(), dup);
+      stat_add(stats.segments_sent);
+      if (dup)
+      {
+        stat_add(stats.retransmits);
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SEQNUM_H
+#define SEQNUM_H
+
+#include <stdint.h>
+#include "udpheader.h"
+
+// Sequence number space of a connection. Legacy Confundo wraps sequence and
+// ACK numbers at MAXSEQACKNUM; connections that negotiated window scaling use
+// all 32 bits. Comparisons follow RFC 1982 serial number arithmetic: a is
+// before b when b is less than half the space ahead of a.
+class SeqSpace
+{
+  public:
+    explicit SeqSpace(bool wide = false)
+      : modulus(wide ? (1ULL << 32) : MAXSEQACKNUM + 1) {}
+
+    // a advanced by n bytes
+    unsigned int add(unsigned int a, uint64_t n) const
+    {
+      return (a % modulus + n % modulus) % modulus;
+    }
+
+    // How many bytes b is ahead of a
+    uint64_t dist(unsigned int a, unsigned int b) const
+    {
+      return (b % modulus + modulus - a % modulus) % modulus;
+    }
+
+    bool lt(unsigned int a, unsigned int b) const
+    {
+      uint64_t d = dist(a, b);
+      return d != 0 && d < modulus / 2;
+    }
+
+    bool le(unsigned int a, unsigned int b) const
+    {
+      return dist(a, b) < modulus / 2;
+    }
+
+    bool wide() const
+    {
+      return modulus > MAXSEQACKNUM + 1;
+    }
+
+  private:
+    uint64_t modulus;
+};
+
+#endif
@@ -1,58 +1,457 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <bits/stdc++.h>
+#include <poll.h>
 #include "udpfunctions.h"
+#include "spscqueue.h"
+#include "alloccount.h"
+#include "receiver.h"
+#include "tcpreceiver.h"
+#include "diskio.h"
+
+#define MAXTHREADS 64
+#define HANDOFF_QUEUE 128
+#define LOCAL_QUEUE 16     // same-host handoffs waiting for a worker
+
+// A datagram handed from the worker whose socket received it to the worker
+// that owns its connId. Without reuseport steering, which never misroutes a
+// segment, the workers negotiate segments small enough to fit.
+struct Datagram
+{
+  sockaddr_in addr;
+  int len;
+  char buf[MAXBUF];
+};
+
+DiskWriter disk_writer;
+
+// Hands each connection's payload to the disk thread as it arrives, in
+// chunks of CONN_FLUSH bytes or more, so the worker never waits for a
+// write. The chunk's bytes count as the connection's until the disk thread
+// reports them written. When the queue is full the chunk stays where it is
+// and is offered again with the connection's next segment.
+class DiskSink : public FileSink
+{
+  public:
+    DiskChannel chan;
+
+    explicit DiskSink(int evfd) : chan(evfd) {}
+    void write(Connection& c);
+    void finish(Connection& c, bool aborted);
+    bool adopt(Connection& c, int fd, size_t len);
+    bool streams() const
+    {
+      return true;  // the disk thread splits them into files
+    }
+
+  private:
+    void queue(DiskJob* job, int op, Connection& c, int fd = -1,
+      size_t fd_len = 0);
+};
+
+// One shard of the server: its own SO_REUSEPORT socket, the connections with
+// connId % workers.size() == shard, and one handoff queue from every peer
+struct Worker
+{
+  int shard;
+  int sockfd;
+  int evfd;  // signalled when a peer hands over a datagram or a write is done
+  SystemClock clock;
+  UdpSocket sock;
+  DiskSink disk;
+  ConfundoReceiver receiver;
+  vector<SPSCQueue<Datagram>*> inbox;  // inbox[i] is fed by worker i
+  SPSCQueue<LocalHandoff> local_inbox;  // fed by the rendezvous thread
+  unsigned long packets;  // datagrams received
+  sockaddr_in last_addr;  // sender of the previous datagram
+  short int last_connId;
+  vector<char> scratch;   // receives payloads that don't fit the guessed buffer
+
+  Worker(int shard, int nshards, int sockfd, int evfd) : shard(shard),
+    sockfd(sockfd), evfd(evfd), sock(sockfd), disk(evfd),
+    receiver(clock, sock, disk, shard, nshards), local_inbox(LOCAL_QUEUE),
+    packets(0), last_connId(0), scratch(MAXDGRAM)
+  {
+    memset(&last_addr, 0, sizeof(last_addr));
+  }
+};
+
+string directory;
+vector<Worker*> workers;
+EventLog evlog;
+ConnStats* conn_stats;  // by connId, which is unique across workers; -S only
+ResumeTokens resume_tokens;  // one secret, since SYNs land on any worker
+SynCookies syn_cookies;      // and handshake ACKs on the owner of their connId
+LocalRendezvous local_rendezvous;
+StatsServer stats_server;
+bool alloc_stats = false;
 
 void signalHandler( int signum )
 {
    cerr << "INTERRUPT: Interrupt signal (" << signum << ") received.\n";
+   if (alloc_stats)
+   {
+     unsigned long packets = 0;
+     for (size_t i = 0; i < workers.size(); i++)
+     {
+       packets += workers[i]->packets;
+     }
+     cerr << "ALLOC: " << heap_allocations() << " heap allocations for "
+       << packets << " packets\n";
+   }
    exit(signum);
 }
 
 void print_log(bool isrecv, unsigned int seqnum, unsigned int acknum,
   short int connId, bool isAck, bool isSyn, bool isFin, bool isdrop=false)
 {
-  if(isdrop)
-    cout << "DROP ";
-  else {
-    if (isrecv) {
-      cout << "RECV ";
-    } else {
-      cout << "SEND ";
-    }
-  }
-  cout << seqnum << " " << acknum << " " << connId;
-  if (isAck)
-    cout << " ACK";
-  if (isSyn)
-    cout << " SYN";
-  if (isFin)
-    cout << " FIN";
-  cout << endl;
+  evlog.record(isdrop ? LOG_DROP : (isrecv ? LOG_RECV : LOG_SEND), seqnum,
+    acknum, connId, 0, 0,
+    (isAck ? LOG_ACK : 0) | (isSyn ? LOG_SYN : 0) | (isFin ? LOG_FIN : 0));
 }
 
-int main(int argc, char const *argv[])
+// Statistics of every connId that has been used, for -S queries
+void render_stats(string& out, bool prometheus)
 {
-  signal(SIGINT, signalHandler);
-  signal(SIGTERM, signalHandler);
-  signal(SIGQUIT, signalHandler);
+  vector<const ConnStats*> conns;
+  for (int id = 1; id <= MAXCONNID; id++)
+  {
+    if (conn_stats[id].state != STATS_UNUSED)
+    {
+      conns.push_back(&conn_stats[id]);
+    }
+  }
+  if (prometheus)
+  {
+    stats_prometheus(out, "server", conns, false, tsc_clock());
+  }
+  else
+  {
+    stats_json(out, "server", conns, false, NULL, tsc_clock(), 0);
+  }
+}
 
-  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  //fcntl(sockfd, F_SETFL, O_NONBLOCK);
+void DiskSink::queue(DiskJob* job, int op, Connection& c, int fd,
+  size_t fd_len)
+{
+  job->op = op;
+  job->streams = c.streams;
+  job->connId = c.connId;
+  job->fd = fd;
+  job->fd_len = fd_len;
+  memset(&job->addr, 0, sizeof(job->addr));
+  job->addr.sin_family = AF_INET;
+  job->addr.sin_addr.s_addr = c.addr;
+  job->addr.sin_port = c.port;
+  job->data.swap(c.data);  // the slot's spare buffer takes the chunk's place
+  chan.jobs.commit();
+  disk_writer.notify();
+}
 
-  if (argc!=3)
+// Pass on the in-order payload received so far
+void DiskSink::write(Connection& c)
+{
+  DiskJob* job = chan.jobs.reserve();
+  if (!job)
   {
-    cerr<<"ERROR: Invalid number of arguments"<<endl;
+    return;
+  }
+  c.writing += c.data.size();
+  queue(job, DISK_WRITE, c);
+}
+
+// Pass on the rest of the payload, or have it all replaced with an ERROR
+// string. This must not be lost, so it waits for room in the queue.
+void DiskSink::finish(Connection& c, bool aborted)
+{
+  DiskJob* job;
+  while (!(job = chan.jobs.reserve()))
+  {
+    this_thread::yield();
+  }
+  queue(job, aborted ? DISK_ABORT : DISK_FINISH, c);
+}
+
+// Pass on the payload received so far followed by a client's memfd, which
+// the disk thread writes straight from a mapping. Like the end of a file,
+// this waits for room in the queue.
+bool DiskSink::adopt(Connection& c, int fd, size_t len)
+{
+  DiskJob* job;
+  while (!(job = chan.jobs.reserve()))
+  {
+    this_thread::yield();
+  }
+  c.writing += c.data.size();
+  queue(job, DISK_WRITE, c, fd, len);
+  return true;
+}
+
+// Forward a datagram to the worker owning its connId. Datagrams that find
+// the queue full are dropped; the client retransmits them.
+void handoff(Worker& w, int owner, Datagram& d)
+{
+  SPSCQueue<Datagram>* q = workers[owner]->inbox[w.shard];
+  if (!q->push(d))
+  {
+    UDPpacket* pkt_in = reinterpret_cast<UDPpacket*> (d.buf);
+    print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
+      pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin(), true);
+    return;
+  }
+  uint64_t one = 1;
+  if (write(workers[owner]->evfd, &one, sizeof(one)) < 0)
+  {
+    cerr<<"ERROR in handoff "<<strerror(errno)<<endl;
+  }
+}
+
+// Pass a same-host handoff to the worker owning its connId, which answers
+// it; one that finds the queue full is refused, and the client sends over
+// UDP instead
+void route_handoff(LocalHandoff& h)
+{
+  Worker* owner = workers[(uint16_t) h.connId % workers.size()];
+  if (!owner->local_inbox.push(h))
+  {
+    LocalRendezvous::reply(h, false);
+    return;
+  }
+  uint64_t one = 1;
+  if (write(owner->evfd, &one, sizeof(one)) < 0)
+  {
+    cerr<<"ERROR in handoff "<<strerror(errno)<<endl;
+  }
+}
+
+void worker_loop(Worker* w)
+{
+  int nworkers = workers.size();
+  struct pollfd pfd[2];
+  pfd[0].fd = w->sockfd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = w->evfd;
+  pfd[1].events = POLLIN;
+
+  Datagram d;
+  while(true)
+  {
+    // Wake up when a held-back ACK is due, and at least once a second so
+    // idle clients are evicted even when nobody is sending
+    int timeout = 1000;
+    int64_t ack_due = w->receiver.next_ack_due();
+    if (ack_due)
+    {
+      timeout = max((int64_t) 0, min(ack_due - now_ms(), (int64_t) timeout));
+    }
+    int ready = poll(pfd, 2, timeout);
+    w->receiver.send_delayed_acks(now_ms());
+    if (ready <= 0)
+    {
+      if (timeout == 1000)
+      {
+        w->receiver.expire(now_ms(), w->receiver.connections().capacity());
+      }
+      continue;
+    }
+
+    if (pfd[1].revents & POLLIN)
+    {
+      uint64_t n;
+      if (read(w->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      {
+        cerr<<"ERROR in handoff "<<strerror(errno)<<endl;
+      }
+      // Payload the disk thread has written
+      DiskDone* done;
+      while ((done = w->disk.chan.done.front()))
+      {
+        w->receiver.written(done->addr, done->connId, done->bytes);
+        w->disk.chan.done.consume();
+      }
+      // Datagrams that arrived on a peer's socket
+      for (size_t i = 0; i < w->inbox.size(); i++)
+      {
+        Datagram* in;
+        while (w->inbox[i] && (in = w->inbox[i]->front()))
+        {
+          w->receiver.handle(reinterpret_cast<UDPpacket*> (in->buf),
+            in->buf + sizeof(UDPheader), in->len - sizeof(UDPheader), in->addr);
+          w->inbox[i]->consume();
+        }
+      }
+      // Files handed over by clients on this host
+      LocalHandoff* h;
+      while ((h = w->local_inbox.front()))
+      {
+        LocalRendezvous::reply(*h, w->receiver.adopt(*h));
+        w->local_inbox.consume();
+      }
+    }
+
+    if (!(pfd[0].revents & POLLIN))
+    {
+      continue;
+    }
+    // Receive the header into d.buf and the payload straight into the spare
+    // room of the connection that sent the previous datagram. Clients send
+    // in bursts, so that is usually where the payload belongs and it is
+    // never copied; otherwise it is copied from there to its connection.
+    // Anything beyond that connection's MSS (and CRC trailer) spills into
+    // the scratch buffer.
+    Connection* guess = w->receiver.connections().find(w->last_addr,
+      w->last_connId);
+    size_t room = guess ? guess->mss + (guess->crc ? CRC_TRAILER : 0) : 0;
+    char* payload = guess ? guess->data.tail(room) : NULL;
+    struct iovec iov[3];
+    iov[0].iov_base = d.buf;
+    iov[0].iov_len = sizeof(UDPheader);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = room;
+    iov[2].iov_base = w->scratch.data();
+    iov[2].iov_len = w->scratch.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &d.addr;
+    msg.msg_namelen = sizeof(d.addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    d.len = recvmsg(w->sockfd, &msg, 0);
+    if(d.len < 0)
+    {
+      cerr<<"ERROR in receive "<<strerror(errno);
+      continue;
+    }
+    if(d.len < (int) sizeof(UDPheader)) // too short to carry a header
+    {
+      continue;
+    }
+    w->packets++;
+
+    // New connections stay on the shard that received the SYN; everything
+    // else belongs to the shard encoded in its connId
+    UDPpacket* pkt_in = reinterpret_cast<UDPpacket*> (d.buf);
+    int owner = pkt_in->isSyn() ? w->shard
+      : (uint16_t) pkt_in->getconnID() % nworkers;
+    int payload_size = d.len - sizeof(UDPheader);
+    if (payload_size > (int) room) // spilled, make it contiguous in scratch
+    {
+      if (room)
+      {
+        memmove(w->scratch.data() + room, w->scratch.data(), payload_size - room);
+        memcpy(w->scratch.data(), payload, room);
+      }
+      payload = w->scratch.data();
+    }
+    if (owner != w->shard)
+    {
+      if (d.len > MAXBUF)
+      {
+        print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
+          pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin(), true);
+        continue;
+      }
+      memcpy(d.buf + sizeof(UDPheader), payload, payload_size);
+      handoff(*w, owner, d);
+      continue;
+    }
+    w->last_addr = d.addr;
+    w->last_connId = pkt_in->getconnID();
+    w->receiver.handle(pkt_in, payload, payload_size, d.addr);
+  }
+}
+
+// With -T the server takes Project 1's uploads over TCP instead, on one
+// thread, into the same files through the same disk thread
+void tcp_loop(int port)
+{
+  int evfd = eventfd(0, EFD_NONBLOCK);
+  if (evfd < 0)
+  {
+    cerr<<"ERROR: eventfd failed"<<endl;
+    exit(1);
+  }
+  SystemClock clock;
+  DiskSink disk(evfd);
+  TcpReceiver receiver(clock, disk);
+  if (!receiver.open(port))
+  {
+    cerr<<"ERROR: Binding error"<<endl;
     exit(1);
   }
+  if (!disk_writer.start(directory, vector<DiskChannel*>(1, &disk.chan)))
+  {
+    cerr<<"ERROR: Could not start the disk thread"<<endl;
+    exit(1);
+  }
+
+  struct pollfd pfd[2];
+  pfd[0].fd = receiver.fd();
+  pfd[0].events = POLLIN;
+  pfd[1].fd = evfd;
+  pfd[1].events = POLLIN;
+  while (true)
+  {
+    // Wake up at least once a second so idle clients are aborted
+    int ready = poll(pfd, 2, 1000);
+    if (ready <= 0)
+    {
+      receiver.expire(now_ms(), receiver.connections().capacity());
+      continue;
+    }
+    if (pfd[1].revents & POLLIN)
+    {
+      uint64_t n;
+      if (read(evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      {
+        cerr<<"ERROR in handoff "<<strerror(errno)<<endl;
+      }
+      DiskDone* done;
+      while ((done = disk.chan.done.front()))
+      {
+        receiver.written(done->addr, done->connId, done->bytes);
+        disk.chan.done.consume();
+      }
+    }
+    receiver.poll();
+  }
+}
 
+// Steer each datagram to the socket of the shard in its connId with a
+// classic BPF program on the reuseport group, so handoffs are the exception.
+// SYNs (connId 0) are spread randomly.
+bool attach_steering(int sockfd, int nworkers)
+{
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 8),  // A = connId
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t) nworkers),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_AD_OFF + SKF_AD_RANDOM)),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t) nworkers),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+    sizeof(prog)) == 0;
+}
+
+// Create a UDP socket bound to port. All sockets of a multi-threaded server
+// join one SO_REUSEPORT group, in shard order.
+int open_socket(int port, bool reuseport)
+{
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if(sockfd < 0)
   {
     cerr<<"ERROR: Socket creation failed"<<endl;
@@ -66,22 +465,102 @@ int main(int argc, char const *argv[])
     close(sockfd);
     exit(1);
   }
+  if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+    cerr<<"ERROR: setsockopt failed"<<endl;
+    close(sockfd);
+    exit(1);
+  }
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  memset(addr.sin_zero, '\0', sizeof(addr.sin_zero));
+
+  // bind address to socket
+  if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    cerr<<"ERROR: Binding error"<<endl;
+    exit(1);
+  }
+  return sockfd;
+}
+
+int main(int argc, char *argv[])
+{
+  signal(SIGINT, signalHandler);
+  signal(SIGTERM, signalHandler);
+  signal(SIGQUIT, signalHandler);
+
+  int nthreads = 1;
+  const char* log_path = NULL;
+  const char* stats_path = NULL;
+  long backlog = COOKIE_BACKLOG;
+  bool tcp = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:AL:S:c:T")) != -1)
+  {
+    if (opt == 't')
+    {
+      nthreads = atoi(optarg);
+    }
+    else if (opt == 'A')
+    {
+      alloc_stats = true;
+    }
+    else if (opt == 'L')
+    {
+      log_path = optarg;
+    }
+    else if (opt == 'S')
+    {
+      stats_path = optarg;
+    }
+    else if (opt == 'c')
+    {
+      backlog = atol(optarg);
+    }
+    else if (opt == 'T')
+    {
+      tcp = true;
+    }
+    else
+    {
+      cerr<<"ERROR: usage: "<<argv[0]<<" [-t THREADS] [-A] [-L LOGFILE] [-S SOCKET] [-c BACKLOG] [-T] <PORT> <FILE-DIR>"<<endl;
+      exit(1);
+    }
+  }
+
+  if (backlog < 0)
+  {
+    cerr<<"ERROR: Invalid backlog"<<endl;
+    exit(1);
+  }
+
+  if (argc - optind != 2)
+  {
+    cerr<<"ERROR: Invalid number of arguments"<<endl;
+    exit(1);
+  }
 
-  stringstream geek(argv[1]);
-  short port = 0;
+  if (nthreads < 1 || nthreads > MAXTHREADS)
+  {
+    cerr<<"ERROR: Invalid number of threads"<<endl;
+    exit(1);
+  }
+
+  stringstream geek(argv[optind]);
+  int port = 0;
   geek >> port;
 
   if(port<1023 || port>65535)
   {
     cerr<<"ERROR: Incorrect port"<<endl;
-    close(sockfd);
     exit(1);
   }
 
-  const char* directory_arg = argv[2];
-
+  const char* directory_arg = argv[optind + 1];
   // Construct the directory string from the user input
-  string directory(directory_arg);
+  directory = directory_arg;
   if (directory.size() > 0) {
     if (directory[0] != '.') {
       directory = "." + directory;
@@ -99,157 +578,90 @@ int main(int argc, char const *argv[])
   if (stat (directory.c_str(), &buffer) == -1) {
     if (mkdir(directory.c_str(), 0777) == -1) {
       cerr<<"ERROR: Could not create directory"<<endl;
-      close(sockfd);
       exit(1);
     }
   }
 
-  struct sockaddr_in addr,cliaddr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  memset(addr.sin_zero, '\0', sizeof(addr.sin_zero));
-  memset(&cliaddr, 0, sizeof(cliaddr));
+  if (tcp)
+  {
+    tcp_loop(port);
+  }
 
-  socklen_t cliaddr_len=sizeof(cliaddr);
-  // bind address to socket
-  if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-    cerr<<"ERROR: Binding error"<<endl;
+  if (!evlog.open(LOG_SERVER, log_path))
+  {
+    cerr<<"ERROR: Could not open log file"<<endl;
     exit(1);
   }
 
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(sockfd, &readfds);
-
-
-  bool end=false;
-  int clientcount=0;
-  vector< vector<UDPpacket> > v (50);
-  vector<vector <int> > sizes (50);
-  vector<int> expected (50);
-  //FILE *f=fopen("1.file","w+b");
-  while(!end)
+  // Without -S each receiver keeps its statistics in one scratch slot
+  // rather than 10 MB of slots nobody reads
+  if (stats_path)
   {
-    UDPpacket* pkt_in= NULL;
-    char rec[MAXBUF];
-    bzero(rec,MAXBUF);
-
-    int block_size = recvfrom(sockfd, (char*)rec, MAXBUF, 0, ( struct sockaddr *) &cliaddr, &cliaddr_len);
-    if(block_size < 0)
+    conn_stats = new ConnStats[MAXCONNID + 1];
+    if (!stats_server.open(stats_path, render_stats))
     {
-      cerr<<"ERROR in receive "<<strerror(errno);
+      cerr<<"ERROR: Could not open stats socket"<<endl;
+      exit(1);
     }
-    pkt_in=reinterpret_cast<UDPpacket*> (rec);
-
-
+  }
 
-    if(pkt_in->isSyn()) // SYN packet, send SYN-ACK
+  for (int i = 0; i < nthreads; i++)
+  {
+    int evfd = eventfd(0, EFD_NONBLOCK);
+    if (evfd < 0)
     {
-      print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
-        pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin());
-
-      clientcount+=1;
-      UDPpacket* pkt_out= new UDPpacket(htonl(SRVR_DEFAULT_SEQ), htonl(pkt_in->getSeq()+1), htons(clientcount), 1, 1, 0, NULL);
-      UDPsend(pkt_out, sockfd, cliaddr);
-      print_log(false, pkt_out->getSeq(), pkt_out->getAck(), pkt_out->getconnID(),
-        pkt_out->isAck(), pkt_out->isSyn(), pkt_out->isFin());
-      expected[clientcount]=pkt_in->getSeq()+1;
+      cerr<<"ERROR: eventfd failed"<<endl;
+      exit(1);
     }
-    else if(pkt_in->isAck())
+    Worker* w = new Worker(i, nthreads, open_socket(port, nthreads > 1), evfd);
+    w->receiver.set_log(&evlog);
+    w->receiver.set_stats(conn_stats);
+    w->receiver.set_tokens(&resume_tokens);
+    w->receiver.set_cookies(&syn_cookies, backlog);
+    w->receiver.set_local(&local_rendezvous);
+    if (nthreads > 1)
     {
-      print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
-        pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin());
-     //client only sends ACK twice: SYN-ACK & FIN-ACK
-     //maybe FIN pkt got lost, check if this is teardown-> reconstruct file
-     if (v[pkt_in->getconnID()].size()!=0)
-     {
-       string s= to_string(pkt_in->getconnID())+".file";
-       char fname[s.size()+1];
-       strcpy(fname, s.c_str());
-
-       // Create an empty file in the directory and save its file descriptor
-       string file_path = directory + to_string(pkt_in->getconnID()) + ".file";
-       FILE* f = fopen(file_path.c_str(), "w+b");
-       if (!f) {
-         cerr<<"ERROR: Could not open file"<<endl;
-         close(sockfd);
-         exit(1);
-       }
-       for (size_t i=0; i< v[pkt_in->getconnID()].size() ; i++)
-       {
-          //cout<<v[pkt_in->getconnID()][i]->getSeq())<<endl;
-         fwrite(v[pkt_in->getconnID()][i].getpayload(), sizeof(char), sizes[pkt_in->getconnID()][i], f);
-       }
-       fclose(f);
-     }
-    }
-    else if(pkt_in->isFin())
-    {
-      print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
-        pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin());
-      //send ACK for the FIN
-      UDPpacket* pkt_out= new UDPpacket(htonl(SRVR_DEFAULT_SEQ+1), htonl((pkt_in->getSeq() + block_size - pkt_in->getheadersize()+1)%(MAXSEQACKNUM + 1)),
-        htons(pkt_in->getconnID()), 1, 0, 1, NULL);
-      UDPsend(pkt_out, sockfd, cliaddr);
-      print_log(false, pkt_out->getSeq(), pkt_out->getAck(), pkt_out->getconnID(),
-        pkt_out->isAck(), pkt_out->isSyn(), pkt_out->isFin());
-     
-      //reconstruct the file sent by client
-      //cout<<v[pkt_in->getconnID()].size()<<endl;
-
-      string s= to_string(pkt_in->getconnID())+".file";
-      char fname[s.size()+1];
-      strcpy(fname, s.c_str());
-
-      // Create an empty file in the directory and save its file descriptor
-      string file_path = directory + to_string(pkt_in->getconnID()) + ".file";
-      FILE* f = fopen(file_path.c_str(), "w+b");
-      if (!f) {
-        cerr<<"ERROR: Could not open file"<<endl;
-        close(sockfd);
-        exit(1);
-      }
-      for (size_t i=0; i< v[pkt_in->getconnID()].size() ; i++)
+      for (int j = 0; j < nthreads; j++)
       {
-        fwrite(v[pkt_in->getconnID()][i].getpayload(), sizeof(char), sizes[pkt_in->getconnID()][i], f);
+        w->inbox.push_back(j == i ? NULL : new SPSCQueue<Datagram>(HANDOFF_QUEUE));
       }
-      fclose(f);
     }
-    else  // received data packet, store it accordingly
+    workers.push_back(w);
+  }
+  if (nthreads > 1 && !attach_steering(workers[0]->sockfd, nthreads))
+  {
+    cerr<<"WARNING: reuseport steering unavailable, using handoff queues"<<endl;
+    for (int i = 0; i < nthreads; i++)
     {
-      if(pkt_in->getSeq()==(size_t)expected[pkt_in->getconnID()])
-      {
-
-        print_log(true, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
-            pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin());
-
-        v[pkt_in->getconnID()].push_back(*pkt_in);
-        sizes[pkt_in->getconnID()].push_back(block_size - pkt_in->getheadersize());
+      workers[i]->receiver.set_max_mss(MAXBUF - sizeof(UDPheader));
+    }
+  }
 
-        // send ack for received packet
-        UDPpacket* pkt_out= new UDPpacket(htonl(SRVR_DEFAULT_SEQ+1), htonl((pkt_in->getSeq() + block_size - pkt_in->getheadersize())%(MAXSEQACKNUM + 1)),
-          htons(pkt_in->getconnID()), 1, 0, 0, NULL);
-        UDPsend(pkt_out, sockfd, cliaddr);
-        print_log(false, pkt_out->getSeq(), pkt_out->getAck(), pkt_out->getconnID(),
-          pkt_out->isAck(), pkt_out->isSyn(), pkt_out->isFin());
+  // Clients on this host may hand their files over through a socket in the
+  // directory; without one they send over UDP
+  char* real = realpath(directory.c_str(), NULL);
+  if (!real || !local_rendezvous.open(string(real) + "/" + LOCAL_SOCKET,
+    route_handoff))
+  {
+    cerr<<"WARNING: same-host path unavailable"<<endl;
+  }
+  free(real);
 
-        //update next expected seqnum from this client
-        expected[pkt_in->getconnID()] = (pkt_in->getSeq() + block_size - pkt_in->getheadersize())%(MAXSEQACKNUM + 1);
-      }
+  vector<DiskChannel*> channels;
+  for (int i = 0; i < nthreads; i++)
+  {
+    channels.push_back(&workers[i]->disk.chan);
+  }
+  if (!disk_writer.start(directory, channels))
+  {
+    cerr<<"ERROR: Could not start the disk thread"<<endl;
+    exit(1);
+  }
 
-      else //server's Ack got dropped, send dup Ack
-      {
-        UDPpacket* pkt_out= new UDPpacket((htonl(SRVR_DEFAULT_SEQ+1)), htonl(expected[pkt_in->getconnID()]),
-          htons(pkt_in->getconnID()), 1, 0, 0, NULL);
-        UDPsend(pkt_out, sockfd, cliaddr);
-        //log of dropped received packet
-        print_log(false, pkt_in->getSeq(), pkt_in->getAck(), pkt_in->getconnID(),
-          pkt_in->isAck(), pkt_in->isSyn(), pkt_in->isFin(),true);
-        //log of sent ack packet
-        print_log(false, pkt_out->getSeq(), pkt_out->getAck(), pkt_out->getconnID(),
-            pkt_out->isAck(), pkt_out->isSyn(), pkt_out->isFin());
-      }
-    }
+  // Worker 0 runs on the main thread
+  for (int i = 1; i < nthreads; i++)
+  {
+    thread(worker_loop, workers[i]).detach();
   }
+  worker_loop(workers[0]);
 }
@@ -0,0 +1,63 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// SipHash-2-4 (Aumasson and Bernstein), the keyed hash behind the server's
+// resumption tokens and SYN cookies: a MAC that is fast on short inputs.
+
+inline uint64_t siphash_rotl(uint64_t x, int b)
+{
+  return (x << b) | (x >> (64 - b));
+}
+
+inline void sipround(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+{
+  v0 += v1; v1 = siphash_rotl(v1, 13); v1 ^= v0; v0 = siphash_rotl(v0, 32);
+  v2 += v3; v3 = siphash_rotl(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = siphash_rotl(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = siphash_rotl(v1, 17); v1 ^= v2; v2 = siphash_rotl(v2, 32);
+}
+
+// The hash of len bytes under the key (k0, k1), words read little-endian
+inline uint64_t siphash24(uint64_t k0, uint64_t k1, const void* data,
+  size_t len)
+{
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  size_t left = len;
+  for (; left >= 8; p += 8, left -= 8)
+  {
+    uint64_t m = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+      m = (m << 8) | p[i];
+    }
+    v3 ^= m;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t last = (uint64_t) len << 56;
+  for (size_t i = 0; i < left; i++)
+  {
+    last |= (uint64_t) p[i] << (8 * i);
+  }
+  v3 ^= last;
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; i++)
+  {
+    sipround(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif
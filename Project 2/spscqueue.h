@@ -0,0 +1,128 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+// Bounded lock-free single-producer/single-consumer ring. Exactly one thread
+// may call push() and exactly one (other) thread may call pop(). The capacity
+// is rounded up to a power of two.
+template <typename T>
+class SPSCQueue
+{
+  public:
+    explicit SPSCQueue(size_t capacity) : head(0), cached_tail(0), tail(0),
+      cached_head(0)
+    {
+      size_t n = 2;
+      while (n < capacity)
+      {
+        n <<= 1;
+      }
+      ring.resize(n);
+      mask = n - 1;
+    }
+
+    // Producer side; returns false when the ring is full
+    bool push(const T& item)
+    {
+      size_t t = tail.load(memory_order_relaxed);
+      if (t - cached_head > mask)
+      {
+        cached_head = head.load(memory_order_acquire);
+        if (t - cached_head > mask)
+        {
+          return false;
+        }
+      }
+      ring[t & mask] = item;
+      tail.store(t + 1, memory_order_release);
+      return true;
+    }
+
+    // Producer side; slot to fill in place before commit(), NULL when full
+    T* reserve()
+    {
+      size_t t = tail.load(memory_order_relaxed);
+      if (t - cached_head > mask)
+      {
+        cached_head = head.load(memory_order_acquire);
+        if (t - cached_head > mask)
+        {
+          return NULL;
+        }
+      }
+      return &ring[t & mask];
+    }
+
+    void commit()
+    {
+      tail.store(tail.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    // Consumer side; the front item or NULL when empty, released by consume()
+    T* front()
+    {
+      size_t h = head.load(memory_order_relaxed);
+      if (h == cached_tail)
+      {
+        cached_tail = tail.load(memory_order_acquire);
+        if (h == cached_tail)
+        {
+          return NULL;
+        }
+      }
+      return &ring[h & mask];
+    }
+
+    // Consumer side; the i-th item from the front or NULL, for looking at
+    // several before consuming them in order
+    T* peek(size_t i)
+    {
+      size_t h = head.load(memory_order_relaxed);
+      if (cached_tail - h <= i)
+      {
+        cached_tail = tail.load(memory_order_acquire);
+        if (cached_tail - h <= i)
+        {
+          return NULL;
+        }
+      }
+      return &ring[(h + i) & mask];
+    }
+
+    void consume()
+    {
+      head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    bool pop(T& item)
+    {
+      T* p = front();
+      if (!p)
+      {
+        return false;
+      }
+      item = *p;
+      consume();
+      return true;
+    }
+
+  private:
+    vector<T> ring;
+    size_t mask;
+    // Consumer and producer state live on separate cache lines, each index
+    // next to that side's cached copy of the other index
+    char pad0[64];
+    atomic<size_t> head;
+    size_t cached_tail;  // consumer's view of tail
+    char pad1[64];
+    atomic<size_t> tail;
+    size_t cached_head;  // producer's view of head
+    char pad2[64];
+};
+
+#endif
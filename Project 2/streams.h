@@ -0,0 +1,270 @@
+#ifndef STREAMS_H
+#define STREAMS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define STREAM_HEADER 8        // stream id, flags and length of a frame
+#define STREAM_FRAME 16384     // most data bytes in one frame
+#define STREAM_INTERLEAVE 8    // streams whose frames take turns
+#define STREAM_END 1           // flag of a stream's last frame
+#define MAXSTREAMS 65536
+
+using namespace std;
+
+// Several files over one Confundo connection. With the streams option
+// negotiated, the connection's byte stream is a sequence of frames: an
+// 8-byte header (stream id and flags, 16 bits each, and the length of the
+// data, 32 bits, all big-endian) followed by that much of the stream's data.
+// A stream's last frame has the END flag; an empty file is a single empty
+// END frame.
+//
+// Frames live in the sequence space like any payload, so segments, ACKs,
+// retransmissions and parity cover them without knowing about streams, and
+// the receiver finds them again in the in-order bytes however they were
+// segmented.
+
+// The sender's side: the frames of the streams, laid out before the
+// transfer. Up to STREAM_INTERLEAVE streams take turns, a frame of at most
+// STREAM_FRAME bytes each, so small files are not held up behind large ones
+// and the receiver has few files open at once.
+class StreamLayout
+{
+  public:
+    StreamLayout() : total(0), cursor(0) {}
+
+    // Add a stream of size bytes at data, which must stay valid until the
+    // transfer is over; returns its id
+    int add(const char* data, long size)
+    {
+      File f = { data, size };
+      files.push_back(f);
+      return files.size() - 1;
+    }
+
+    size_t streams() const
+    {
+      return files.size();
+    }
+
+    // Lay out the frames of every stream added
+    void build()
+    {
+      frames.clear();
+      total = 0;
+      vector<long> sent(files.size(), 0);
+      vector<int> turn;
+      size_t next = 0;
+      size_t at = 0;
+      while (next < files.size() || !turn.empty())
+      {
+        while (turn.size() < STREAM_INTERLEAVE && next < files.size())
+        {
+          turn.push_back(next++);
+        }
+        at %= turn.size();
+        int s = turn[at];
+        Frame fr;
+        fr.start = total;
+        fr.stream = s;
+        fr.file_off = sent[s];
+        fr.len = (int) min(files[s].size - sent[s], (long) STREAM_FRAME);
+        sent[s] += fr.len;
+        fr.end = sent[s] == files[s].size;
+        encode_header(fr);
+        frames.push_back(fr);
+        total += STREAM_HEADER + fr.len;
+        if (fr.end)
+        {
+          turn.erase(turn.begin() + at);
+        }
+        else
+        {
+          at++;
+        }
+      }
+      cursor = 0;
+    }
+
+    // Bytes in the connection's stream
+    long size() const
+    {
+      return total;
+    }
+
+    // n bytes at offset off of the connection's stream: a pointer into the
+    // file when they lie in one frame's data, otherwise a copy
+    const char* bytes(long off, int n)
+    {
+      size_t i = find(off);
+      const Frame& fr = frames[i];
+      long data_start = fr.start + STREAM_HEADER;
+      if (off >= data_start && off + n <= data_start + fr.len)
+      {
+        return files[fr.stream].data + fr.file_off + (off - data_start);
+      }
+      if (staging.size() < (size_t) n)
+      {
+        staging.resize(n);
+      }
+      int copied = 0;
+      while (copied < n && i < frames.size())
+      {
+        const Frame& f = frames[i];
+        long pos = off + copied - f.start;
+        if (pos < STREAM_HEADER)
+        {
+          int k = min((long) n - copied, STREAM_HEADER - pos);
+          memcpy(staging.data() + copied, f.header + pos, k);
+          copied += k;
+          pos += k;
+        }
+        if (copied < n && pos < STREAM_HEADER + f.len)
+        {
+          long data_pos = pos - STREAM_HEADER;
+          int k = min((long) n - copied, f.len - data_pos);
+          memcpy(staging.data() + copied,
+            files[f.stream].data + f.file_off + data_pos, k);
+          copied += k;
+        }
+        i++;
+      }
+      return staging.data();
+    }
+
+  private:
+    struct File
+    {
+      const char* data;
+      long size;
+    };
+
+    struct Frame
+    {
+      long start;      // offset of the header in the connection's stream
+      int stream;
+      long file_off;
+      int len;
+      bool end;
+      char header[STREAM_HEADER];
+    };
+
+    vector<File> files;
+    vector<Frame> frames;
+    vector<char> staging;
+    long total;
+    size_t cursor;   // frame of the last lookup; most move forward a little
+
+    static void encode_header(Frame& fr)
+    {
+      uint16_t flags = fr.end ? STREAM_END : 0;
+      fr.header[0] = (char) (fr.stream >> 8);
+      fr.header[1] = (char) fr.stream;
+      fr.header[2] = (char) (flags >> 8);
+      fr.header[3] = (char) flags;
+      for (int i = 0; i < 4; i++)
+      {
+        fr.header[4 + i] = (char) ((uint32_t) fr.len >> (24 - 8 * i));
+      }
+    }
+
+    // The frame holding offset off, which is at or just after the last
+    // one found as long as the sender moves forward
+    size_t find(long off)
+    {
+      for (size_t i = cursor; i < cursor + 2 && i < frames.size(); i++)
+      {
+        if (frames[i].start <= off &&
+          (i + 1 == frames.size() || off < frames[i + 1].start))
+        {
+          return cursor = i;
+        }
+      }
+      size_t lo = 0, hi = frames.size() - 1;
+      while (lo < hi)
+      {
+        size_t mid = (lo + hi + 1) / 2;
+        if (frames[mid].start <= off)
+        {
+          lo = mid;
+        }
+        else
+        {
+          hi = mid - 1;
+        }
+      }
+      return cursor = lo;
+    }
+};
+
+// The receiver's side: finds the frames in the in-order bytes of a
+// connection, fed in pieces of any size
+class StreamParser
+{
+  public:
+    StreamParser() : have(0), stream(0), remaining(0), end(false) {}
+
+    void reset()
+    {
+      have = 0;
+      remaining = 0;
+      end = false;
+    }
+
+    // Parse n bytes, calling data(stream, p, len) for each piece of a
+    // stream's data and end(stream) after a stream's last frame
+    template <typename D, typename E>
+    void feed(const char* p, size_t n, D data, E on_end)
+    {
+      while (n > 0)
+      {
+        if (have < STREAM_HEADER)
+        {
+          size_t k = min(n, (size_t) (STREAM_HEADER - have));
+          memcpy(header + have, p, k);
+          have += k;
+          p += k;
+          n -= k;
+          if (have < STREAM_HEADER)
+          {
+            return;
+          }
+          stream = ((uint8_t) header[0] << 8) | (uint8_t) header[1];
+          end = ((((uint8_t) header[2] << 8) | (uint8_t) header[3]) &
+            STREAM_END) != 0;
+          remaining = 0;
+          for (int i = 4; i < 8; i++)
+          {
+            remaining = (remaining << 8) | (uint8_t) header[i];
+          }
+        }
+        size_t k = min(n, (size_t) remaining);
+        if (k > 0)
+        {
+          data(stream, p, k);
+          p += k;
+          n -= k;
+          remaining -= k;
+        }
+        if (!remaining)
+        {
+          if (end)
+          {
+            on_end(stream);
+          }
+          have = 0;
+        }
+      }
+    }
+
+  private:
+    char header[STREAM_HEADER];
+    int have;          // header bytes of the current frame seen
+    int stream;
+    uint32_t remaining;  // data bytes of the current frame still to come
+    bool end;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef SYNCOOKIE_H
+#define SYNCOOKIE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <random>
+#include "options.h"
+#include "siphash.h"
+
+#define COOKIE_TICK 64000   // ms per tick of the cookie clock
+#define COOKIE_TICKS 2      // ticks a cookie stays valid for, at most
+#define COOKIE_BACKLOG 128  // half-open connections before SYNs get cookies
+
+using namespace std;
+
+// SYN cookies: the server answers a SYN without keeping anything about it.
+// The SYN-ACK's sequence number is a cookie: the tick of the cookie clock
+// it was issued in, in its top two bits, and a MAC under the server's secret
+// of that tick, the client's address and port, the connId handed out, the
+// client's next sequence number and its SYN's option block. The handshake
+// ACK acknowledges the cookie and repeats the options, so the server can
+// check it and only then set the connection up, as if from the SYN. A flood
+// of SYNs from addresses that never answer then costs no connection state
+// and no connIds.
+//
+// Legacy sequence numbers wrap at MAXSEQACKNUM, so there cookies have 16
+// bits: 14 of MAC. Connections with window scaling use all 32.
+class SynCookies
+{
+  public:
+    SynCookies()
+    {
+      random_device rd;
+      k0 = ((uint64_t) rd() << 32) | rd();
+      k1 = ((uint64_t) rd() << 32) | rd();
+    }
+
+    // A fixed secret, for runs that must repeat
+    SynCookies(uint64_t k0, uint64_t k1) : k0(k0), k1(k1) {}
+
+    // The cookie for a SYN from addr answered with connId, whose client
+    // sends seq next and whose options are the optlen bytes at opts
+    unsigned int issue(const sockaddr_in& addr, short int connId,
+      unsigned int seq, const char* opts, size_t optlen, bool wide,
+      int64_t now_ms) const
+    {
+      uint32_t tick = (uint32_t) (now_ms / COOKIE_TICK);
+      return encode(tick, addr, connId, seq, opts, optlen, wide);
+    }
+
+    // Whether cookie was issued for the same in the last COOKIE_TICKS ticks
+    bool valid(unsigned int cookie, const sockaddr_in& addr,
+      short int connId, unsigned int seq, const char* opts, size_t optlen,
+      bool wide, int64_t now_ms) const
+    {
+      uint32_t tick = (uint32_t) (now_ms / COOKIE_TICK);
+      for (int age = 0; age < COOKIE_TICKS; age++)
+      {
+        if (cookie == encode(tick - age, addr, connId, seq, opts, optlen,
+          wide))
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    uint64_t k0, k1;
+
+    unsigned int encode(uint32_t tick, const sockaddr_in& addr,
+      short int connId, unsigned int seq, const char* opts, size_t optlen,
+      bool wide) const
+    {
+      char buf[16 + MAXOPTIONS + 1];
+      memcpy(buf, &addr.sin_addr.s_addr, 4);
+      memcpy(buf + 4, &addr.sin_port, 2);
+      memcpy(buf + 6, &connId, 2);
+      memcpy(buf + 8, &seq, 4);
+      memcpy(buf + 12, &tick, 4);
+      optlen = min(optlen, (size_t) MAXOPTIONS + 1);
+      if (optlen)
+      {
+        memcpy(buf + 16, opts, optlen);
+      }
+      uint64_t h = siphash24(k0, k1, buf, 16 + optlen);
+      int bits = wide ? 32 : 16;
+      unsigned int mac_mask = (1u << (bits - 2)) - 1;
+      return ((tick & 3) << (bits - 2)) | ((unsigned int) h & mac_mask);
+    }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <bits/stdc++.h>
+#include "udpheader.h"
+#include "options.h"
+
+using namespace std;
+
+// A SYN flood for loopback experiments: sends SYNs from many source ports
+// and never answers the SYN-ACKs, which only drain. Run it against a server
+// while a client uploads to see whether established transfers keep their
+// rate. With -W the SYNs carry options, as a real client's would.
+
+unsigned long sent = 0, answered = 0;
+
+void signalHandler(int signum)
+{
+  cerr << "INTERRUPT: Interrupt signal (" << signum << ") received.\n";
+  cerr << "FLOOD: " << sent << " SYNs sent, " << answered << " answered\n";
+  exit(signum);
+}
+
+int64_t now_us()
+{
+  return chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char *argv[])
+{
+  signal(SIGINT, signalHandler);
+  signal(SIGTERM, signalHandler);
+  signal(SIGQUIT, signalHandler);
+
+  long rate = 100000;  // SYNs per second
+  double seconds = 10;
+  int nsocks = 64;
+  bool with_options = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:t:n:W")) != -1)
+  {
+    if (opt == 'r')
+    {
+      rate = atol(optarg);
+    }
+    else if (opt == 't')
+    {
+      seconds = atof(optarg);
+    }
+    else if (opt == 'n')
+    {
+      nsocks = atoi(optarg);
+    }
+    else if (opt == 'W')
+    {
+      with_options = true;
+    }
+    else
+    {
+      cerr << "ERROR: usage: " << argv[0] << " [-r RATE] [-t SECONDS]"
+        << " [-n SOCKETS] [-W] <SERVER-HOSTNAME-OR-IP> <PORT>" << endl;
+      exit(1);
+    }
+  }
+  if (argc - optind != 2)
+  {
+    cerr << "ERROR: Invalid number of arguments" << endl;
+    exit(1);
+  }
+  if (rate <= 0 || seconds <= 0 || nsocks <= 0)
+  {
+    cerr << "ERROR: Invalid rate, duration or socket count" << endl;
+    exit(1);
+  }
+  int port = atoi(argv[optind + 1]);
+  if (port < 1023 || port > 65535)
+  {
+    cerr << "ERROR: Incorrect port" << endl;
+    exit(1);
+  }
+  struct hostent* host = gethostbyname(argv[optind]);
+  if (!host)
+  {
+    cerr << "ERROR: Invalid hostname" << endl;
+    exit(1);
+  }
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  memcpy(&server.sin_addr, host->h_addr, host->h_length);
+
+  // Every socket is another source port, so another would-be connection
+  vector<int> fds(nsocks);
+  for (int& fd : fds)
+  {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &server,
+      sizeof(server)) == -1)
+    {
+      cerr << "ERROR: Could not open a socket to the server" << endl;
+      exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  ConfundoOptions syn_opts;
+  if (with_options)
+  {
+    syn_opts.wscale = 4;
+    syn_opts.mss = MAXBUF;
+    syn_opts.rcvbuf = 0;
+    syn_opts.token = 0;
+  }
+  char packet[sizeof(UDPheader) + MAXOPTIONS + 1];
+  mt19937 rng(random_device{}());
+  vector<char> drain(65536);
+
+  int64_t start = now_us();
+  int64_t end = start + (int64_t) (seconds * 1e6);
+  for (int64_t now = start; now < end; now = now_us())
+  {
+    // Catch up with the rate, a burst of at most one socket round at a time
+    unsigned long due = (unsigned long) ((now - start) * rate / 1000000);
+    for (int i = 0; sent < due && i < nsocks; i++, sent++)
+    {
+      UDPpacket* syn = new (packet) UDPpacket(htonl(rng() % (MAXSEQACKNUM + 1)),
+        0, 0, 0, 1, 0, NULL);
+      size_t len = sizeof(UDPheader);
+      if (!syn_opts.empty())
+      {
+        syn->setOpt();
+        len += syn_opts.encode(syn->getpayload());
+      }
+      send(fds[sent % nsocks], packet, len, 0);
+    }
+    for (int fd : fds)
+    {
+      while (recv(fd, drain.data(), drain.size(), 0) > 0)
+      {
+        answered++;
+      }
+    }
+    if (sent >= due)
+    {
+      usleep(100);
+    }
+  }
+  cout << "FLOOD: " << sent << " SYNs sent, " << answered << " answered in "
+    << (now_us() - start) / 1e6 << " s" << endl;
+  return 0;
+}
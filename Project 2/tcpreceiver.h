@@ -0,0 +1,284 @@
+#ifndef TCPRECEIVER_H
+#define TCPRECEIVER_H
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "conntable.h"
+#include "netenv.h"
+#include "receiver.h"
+
+#define TCP_BACKLOG 256
+#define TCP_EVENTS 64  // events handled per poll()
+
+using namespace std;
+
+// The server's side of Project 1's upload over TCP (see TcpTransport in
+// transport.h), for comparing the transports on the same server: a
+// connection per file, which the client shuts down once it has sent it.
+//
+// Connections live in a ConnTable like Confundo's, so they get connIds the
+// same way and their payload goes to <connId>.file through the same
+// FileSink, in chunks of CONN_FLUSH bytes. A connection stops being read
+// while it holds CONN_RCVBUF bytes that are not on disk yet, so TCP's own
+// flow control holds the client back, and is read again once written()
+// reports them done. At the client's end of the stream the rest goes to
+// the sink and the connection is closed, which tells the client the file
+// is delivered. A connection that is reset, or sends nothing for
+// TCP_TIMEOUT ms, is aborted and its file holds ERROR.
+class TcpReceiver
+{
+  public:
+    TcpReceiver(Clock& clock, FileSink& sink) : clock(clock), sink(sink),
+      listenfd(-1), epfd(-1), socket_of(MAXCONNID + 1, -1)
+    {
+      conns.set_idle_timeout(TCP_TIMEOUT);
+    }
+
+    ~TcpReceiver()
+    {
+      if (epfd >= 0)
+      {
+        close(epfd);
+      }
+      if (listenfd >= 0)
+      {
+        close(listenfd);
+      }
+    }
+
+    // Listen on port; false if the socket cannot be set up
+    bool open(int port)
+    {
+      listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      epfd = epoll_create1(0);
+      if (listenfd < 0 || epfd < 0)
+      {
+        return false;
+      }
+      int yes = 1;
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      if (bind(listenfd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(listenfd, TCP_BACKLOG) == -1)
+      {
+        return false;
+      }
+      return watch(listenfd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    // The epoll descriptor, readable when there is something to handle
+    int fd() const
+    {
+      return epfd;
+    }
+
+    // Handle what is ready without waiting, and abort idle connections
+    void poll()
+    {
+      struct epoll_event evs[TCP_EVENTS];
+      int n = epoll_wait(epfd, evs, TCP_EVENTS, 0);
+      for (int i = 0; i < n; i++)
+      {
+        if (evs[i].data.fd == listenfd)
+        {
+          accept_all();
+        }
+        else
+        {
+          receive(evs[i].data.fd);
+        }
+      }
+      expire(clock.now_ms(), CONN_SWEEP_BUDGET);
+    }
+
+    // Bytes of a connection that the sink has written
+    void written(const sockaddr_in& addr, short int connId, size_t n)
+    {
+      Connection* c = conns.find(addr, connId);
+      if (!c)
+      {
+        return;
+      }
+      c->writing -= min((size_t) c->writing, n);
+      c->last_active = clock.now_ms();  // a slow disk is not an idle client
+      resume();
+    }
+
+    // Inspect up to budget connections for idle ones
+    void expire(int64_t now, size_t budget)
+    {
+      conns.expire(now, budget, [this](Connection& c)
+      {
+        sink.finish(c, true);
+        drop(socket_of[c.connId]);
+      });
+    }
+
+    const ConnTable& connections() const
+    {
+      return conns;
+    }
+
+  private:
+    // What an accepted socket belongs to, by descriptor
+    struct Peer
+    {
+      sockaddr_in addr;
+      short int connId;
+      bool paused;  // not read until its payload is on disk
+    };
+
+    Clock& clock;
+    FileSink& sink;
+    int listenfd;
+    int epfd;
+    ConnTable conns;
+    vector<Peer> peers;
+    vector<int> socket_of;  // by connId
+    vector<int> paused;  // sockets not being read
+
+    bool watch(int sock, uint32_t events, int op)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.fd = sock;
+      return epoll_ctl(epfd, op, sock, &ev) == 0;
+    }
+
+    void accept_all()
+    {
+      while (true)
+      {
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int sock = accept4(listenfd, (struct sockaddr*) &addr, &len,
+          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+          return;
+        }
+        Connection* c = conns.open(addr, clock.now_ms());
+        if (!c || !watch(sock, EPOLLIN, EPOLL_CTL_ADD))
+        {
+          if (c)
+          {
+            conns.release(c);
+          }
+          close(sock);  // every connId is in use
+          continue;
+        }
+        conns.set_state(c, CONN_ESTABLISHED);
+        if ((size_t) sock >= peers.size())
+        {
+          peers.resize(sock + 1);
+        }
+        peers[sock].addr = addr;
+        peers[sock].connId = c->connId;
+        peers[sock].paused = false;
+        socket_of[c->connId] = sock;
+      }
+    }
+
+    // Read what a connection has sent, as far as there is room for it
+    void receive(int sock)
+    {
+      Peer& p = peers[sock];
+      Connection* c = conns.find(p.addr, p.connId);
+      if (!c || p.paused)
+      {
+        return;
+      }
+      while (true)
+      {
+        size_t held = c->data.size() + c->writing;
+        if (held >= CONN_RCVBUF)
+        {
+          if (!c->data.empty())
+          {
+            sink.write(*c);  // may not take it while the queue is full
+          }
+          if (c->data.size() + c->writing >= CONN_RCVBUF)
+          {
+            p.paused = true;
+            paused.push_back(sock);
+            watch(sock, 0, EPOLL_CTL_MOD);
+            return;
+          }
+          continue;
+        }
+        size_t room = min(CONN_RCVBUF - held, (size_t) CONN_FLUSH);
+        ssize_t n = recv(sock, c->data.tail(room), room, 0);
+        if (n > 0)
+        {
+          c->data.commit(n);
+          c->last_active = clock.now_ms();
+          if (c->data.size() >= CONN_FLUSH)
+          {
+            sink.write(*c);
+          }
+          continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+          return;
+        }
+        // The end of the file, or a reset that aborts it
+        sink.finish(*c, n < 0);
+        conns.release(c);
+        drop(sock);
+        return;
+      }
+    }
+
+    // Read the paused connections that have room again
+    void resume()
+    {
+      for (size_t i = 0; i < paused.size(); )
+      {
+        int sock = paused[i];
+        Peer& p = peers[sock];
+        Connection* c = conns.find(p.addr, p.connId);
+        if (c && c->data.size() >= CONN_FLUSH)
+        {
+          sink.write(*c);
+        }
+        if (c && c->data.size() + c->writing >= CONN_RCVBUF)
+        {
+          i++;
+          continue;
+        }
+        paused[i] = paused.back();
+        paused.pop_back();
+        if (c)
+        {
+          p.paused = false;
+          watch(sock, EPOLLIN, EPOLL_CTL_MOD);
+          receive(sock);
+        }
+      }
+    }
+
+    void drop(int sock)
+    {
+      if (sock < 0)
+      {
+        return;
+      }
+      socket_of[peers[sock].connId] = -1;
+      peers[sock].paused = false;
+      paused.erase(remove(paused.begin(), paused.end(), sock), paused.end());
+      close(sock);
+    }
+};
+
+#endif
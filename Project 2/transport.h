@@ -0,0 +1,390 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include "filesource.h"
+#include "confundoclient.h"
+
+#define UPLOAD_OPTIONS "W:M:K:FE:CU"  // getopt letters of upload_option()
+
+using namespace std;
+
+// The client side of an upload, whatever carries it. Project 1's TCP
+// upload and Confundo do the same job, a file into <connId>.file under the
+// server's directory, so the client and transportbench run either through
+// this interface: start uploads of whole files, then poll until none is
+// active. The server takes TCP uploads with -T (tcpreceiver.h).
+class Transport
+{
+  public:
+    virtual ~Transport() {}
+
+    virtual const char* name() const = 0;
+
+    // Start uploading the file at path to server; the id of the upload, or
+    // -1 if the file cannot be read
+    virtual int upload_file(const sockaddr_in& server, const char* path) = 0;
+
+    // Uploads started, and those not finished yet
+    virtual size_t size() const = 0;
+    virtual size_t active() const = 0;
+
+    // Wait up to timeout_ms (-1: until something is due) and handle what
+    // happened
+    virtual void poll(int timeout_ms = -1) = 0;
+
+    // Whether the server has all of an upload, and whether it has failed
+    virtual bool delivered(int id) const = 0;
+    virtual bool failed(int id) const = 0;
+
+    void run()
+    {
+      while (active())
+      {
+        poll();
+      }
+    }
+};
+
+// Handle one of the client's Confundo options (UPLOAD_OPTIONS); false if opt
+// is not one of them. An invalid value ends the program.
+inline bool upload_option(int opt, const char* arg, UploadOptions& opts)
+{
+  if (opt == 'W')
+  {
+    opts.wscale = atoi(arg);
+    if (opts.wscale < 0 || opts.wscale > MAXWSCALE)
+    {
+      cerr << "ERROR: Window scale must be between 0 and " << MAXWSCALE
+        << endl;
+      exit(1);
+    }
+  }
+  else if (opt == 'M')
+  {
+    opts.mss = atoi(arg);
+    if (opts.mss < DATABUF || opts.mss > MAXMSS)
+    {
+      cerr << "ERROR: MSS must be between " << DATABUF << " and " << MAXMSS
+        << endl;
+      exit(1);
+    }
+  }
+  else if (opt == 'K')
+  {
+    opts.ackfreq = atoi(arg);
+    if (opts.ackfreq < 1 || opts.ackfreq > MAXACKFREQ)
+    {
+      cerr << "ERROR: ACK frequency must be between 1 and " << MAXACKFREQ
+        << endl;
+      exit(1);
+    }
+  }
+  else if (opt == 'F')
+  {
+    opts.flow = true;
+  }
+  else if (opt == 'E')
+  {
+    opts.fecblock = atoi(arg);
+    if (opts.fecblock < MINFECBLOCK || opts.fecblock > MAXFECBLOCK)
+    {
+      cerr << "ERROR: FEC block must be between " << MINFECBLOCK << " and "
+        << MAXFECBLOCK << endl;
+      exit(1);
+    }
+  }
+  else if (opt == 'C')
+  {
+    opts.crc = true;
+  }
+  else if (opt == 'U')
+  {
+    opts.local = true;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// Confundo uploads through a ConfundoClient, each file over its own
+// connection with the same options
+class ConfundoTransport : public Transport
+{
+  public:
+    ConfundoTransport(ConfundoClient& client,
+      const UploadOptions& opts = UploadOptions()) : client(client),
+      opts(opts) {}
+
+    const char* name() const
+    {
+      return "confundo";
+    }
+
+    int upload_file(const sockaddr_in& server, const char* path)
+    {
+      return client.upload_file(server, path, opts);
+    }
+
+    size_t size() const
+    {
+      return client.size();
+    }
+
+    size_t active() const
+    {
+      return client.active();
+    }
+
+    void poll(int timeout_ms = -1)
+    {
+      client.poll(timeout_ms);
+    }
+
+    bool delivered(int id) const
+    {
+      return client.sender(id).delivered();
+    }
+
+    bool failed(int id) const
+    {
+      return client.sender(id).state() == ConfundoSender::FAILED;
+    }
+
+  private:
+    ConfundoClient& client;
+    UploadOptions opts;
+};
+
+// Project 1's upload: a TCP connection per file, which carries the file and
+// nothing else. The client shuts down its side once the file is sent, and
+// the server closes the connection once it has read all of it, so that is
+// when the file is delivered. Every upload runs at the same time from one
+// epoll loop, sending straight from the file's mapping; one that makes no
+// progress for TCP_TIMEOUT ms fails.
+class TcpTransport : public Transport
+{
+  public:
+    TcpTransport() : epfd(epoll_create1(0)), running(0) {}
+
+    ~TcpTransport()
+    {
+      for (size_t i = 0; i < uploads.size(); i++)
+      {
+        end(i, uploads[i].state);
+      }
+      if (epfd >= 0)
+      {
+        close(epfd);
+      }
+    }
+
+    const char* name() const
+    {
+      return "tcp";
+    }
+
+    int upload_file(const sockaddr_in& server, const char* path)
+    {
+      Upload u;
+      if (epfd < 0 || !map_file(path, u.file))
+      {
+        return -1;
+      }
+      int id = uploads.size();
+      u.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      u.sent = 0;
+      u.state = CONNECTING;
+      u.last_progress = clock.now_ms();
+      uploads.push_back(u);
+      running++;
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLOUT;
+      ev.data.u32 = id;
+      if (u.fd < 0 || (connect(u.fd, (const struct sockaddr*) &server,
+        sizeof(server)) == -1 && errno != EINPROGRESS) ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, u.fd, &ev) == -1)
+      {
+        end(id, FAILED);
+      }
+      return id;
+    }
+
+    size_t size() const
+    {
+      return uploads.size();
+    }
+
+    size_t active() const
+    {
+      return running;
+    }
+
+    void poll(int timeout_ms = -1)
+    {
+      int64_t now = clock.now_ms();
+      int64_t due = 0;
+      for (size_t i = 0; i < uploads.size(); i++)
+      {
+        if (uploads[i].fd >= 0 && (!due || uploads[i].last_progress < due))
+        {
+          due = uploads[i].last_progress;
+        }
+      }
+      if (due)
+      {
+        int wait = (int) max((int64_t) 0, due + TCP_TIMEOUT - now);
+        timeout_ms = timeout_ms < 0 ? wait : min(timeout_ms, wait);
+      }
+      struct epoll_event evs[64];
+      int n = epoll_wait(epfd, evs, 64, timeout_ms);
+      if (n < 0 && errno != EINTR)
+      {
+        cerr << "ERROR: Could not poll socket" << endl;
+        exit(1);
+      }
+      now = clock.now_ms();
+      for (int i = 0; i < n; i++)
+      {
+        ready(evs[i].data.u32, now);
+      }
+      for (size_t i = 0; i < uploads.size(); i++)
+      {
+        if (uploads[i].fd >= 0 &&
+          now - uploads[i].last_progress >= TCP_TIMEOUT)
+        {
+          end(i, FAILED);
+        }
+      }
+    }
+
+    bool delivered(int id) const
+    {
+      return uploads[id].state == DONE;
+    }
+
+    bool failed(int id) const
+    {
+      return uploads[id].state == FAILED;
+    }
+
+  private:
+    enum State
+    {
+      CONNECTING,
+      SENDING,
+      CLOSING,  // all sent, waiting for the server to close
+      DONE,
+      FAILED
+    };
+
+    struct Upload
+    {
+      int fd;
+      FileSource file;
+      long sent;
+      int state;
+      int64_t last_progress;
+    };
+
+    int epfd;
+    SystemClock clock;
+    vector<Upload> uploads;
+    size_t running;
+
+    void ready(int id, int64_t now)
+    {
+      Upload& u = uploads[id];
+      if (u.fd < 0)
+      {
+        return;
+      }
+      if (u.state == CONNECTING)
+      {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(u.fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+          error)
+        {
+          end(id, FAILED);
+          return;
+        }
+        u.state = SENDING;
+        u.last_progress = now;
+      }
+      if (u.state == SENDING)
+      {
+        while (u.sent < u.file.size)
+        {
+          ssize_t n = send(u.fd, u.file.data() + u.sent, u.file.size - u.sent,
+            MSG_NOSIGNAL);
+          if (n < 0)
+          {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+              end(id, FAILED);
+            }
+            return;
+          }
+          u.sent += n;
+          u.last_progress = now;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = id;
+        if (shutdown(u.fd, SHUT_WR) == -1 ||
+          epoll_ctl(epfd, EPOLL_CTL_MOD, u.fd, &ev) == -1)
+        {
+          end(id, FAILED);
+          return;
+        }
+        u.state = CLOSING;
+        return;
+      }
+      // The server sends nothing, so all that can come is its close
+      char buf[64];
+      ssize_t n;
+      while ((n = recv(u.fd, buf, sizeof(buf), 0)) > 0)
+      {
+      }
+      if (n == 0)
+      {
+        end(id, DONE);
+      }
+      else if (errno != EAGAIN && errno != EINTR)
+      {
+        end(id, FAILED);
+      }
+    }
+
+    void end(int id, int state)
+    {
+      Upload& u = uploads[id];
+      if (u.fd < 0 && u.state >= DONE)
+      {
+        return;
+      }
+      if (u.fd >= 0)
+      {
+        close(u.fd);
+        u.fd = -1;
+      }
+      unmap_file(u.file);
+      u.state = state;
+      running--;
+    }
+};
+
+#endif
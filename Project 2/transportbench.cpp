@@ -0,0 +1,210 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <bits/stdc++.h>
+#include "transport.h"
+
+using namespace std;
+
+// Runs the same workloads over TCP and Confundo against one server address
+// and prints a CSV row per run: how long until the server had every file,
+// and the goodput. The server must take both: ./server on the port for
+// Confundo, and ./server -T on the same port number for TCP, which is what
+// transportbench.sh starts. Confundo options (-W, -M, ...) are the client's.
+//
+// A workload is a number of copies of a file of random bytes, uploaded at
+// the same time over a connection each. Every run does TCP then Confundo,
+// with fresh sockets, from the same files.
+
+int64_t now_us()
+{
+  return chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Comma-separated numbers
+vector<long> parse_list(const char* arg)
+{
+  vector<long> values;
+  stringstream in(arg);
+  string item;
+  while (getline(in, item, ','))
+  {
+    char* end;
+    long v = strtol(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0' || v < 0)
+    {
+      cerr << "ERROR: Invalid list " << arg << endl;
+      exit(1);
+    }
+    values.push_back(v);
+  }
+  return values;
+}
+
+// Upload count copies of path and wait until the server has them all;
+// the seconds that took, or -1 if an upload failed. Uploads are then run
+// to their end, which for Confundo includes the wait after the FIN.
+double run_once(Transport& transport, const sockaddr_in& server,
+  const string& path, long count)
+{
+  int64_t start = now_us();
+  vector<int> ids;
+  for (long i = 0; i < count; i++)
+  {
+    int id = transport.upload_file(server, path.c_str());
+    if (id < 0)
+    {
+      cerr << "ERROR: Cannot open file " << path << endl;
+      exit(1);
+    }
+    ids.push_back(id);
+  }
+  int64_t delivered_at = 0;
+  bool failed = false;
+  while (transport.active())
+  {
+    transport.poll();
+    if (delivered_at)
+    {
+      continue;
+    }
+    bool all = true;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+      failed |= transport.failed(ids[i]);
+      all &= transport.delivered(ids[i]);
+    }
+    if (all)
+    {
+      delivered_at = now_us();
+    }
+  }
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    failed |= transport.failed(ids[i]);
+  }
+  if (failed || !delivered_at)
+  {
+    return -1;
+  }
+  return (delivered_at - start) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+  vector<long> sizes(1, 1000000);
+  vector<long> counts(1, 1);
+  int runs = 1;
+  UploadOptions opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:f:n:" UPLOAD_OPTIONS)) != -1)
+  {
+    if (opt == 's')
+    {
+      sizes = parse_list(optarg);
+    }
+    else if (opt == 'f')
+    {
+      counts = parse_list(optarg);
+    }
+    else if (opt == 'n')
+    {
+      runs = atoi(optarg);
+    }
+    else if (!upload_option(opt, optarg, opts))
+    {
+      cerr << "ERROR: usage: " << argv[0] << " [-s SIZES] [-f FILES] [-n RUNS]"
+        << " [CONFUNDO-OPTIONS] <SERVER-HOSTNAME-OR-IP> <PORT>" << endl;
+      exit(1);
+    }
+  }
+  if (argc - optind != 2)
+  {
+    cerr << "ERROR: Invalid number of arguments" << endl;
+    exit(1);
+  }
+  if (runs < 1 || sizes.empty() || counts.empty())
+  {
+    cerr << "ERROR: Invalid number of runs, sizes or files" << endl;
+    exit(1);
+  }
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    if (counts[i] < 1)
+    {
+      cerr << "ERROR: Invalid number of files" << endl;
+      exit(1);
+    }
+  }
+  int port = atoi(argv[optind + 1]);
+  if (port < 1023 || port > 65535)
+  {
+    cerr << "ERROR: Incorrect port" << endl;
+    exit(1);
+  }
+  struct hostent* host = gethostbyname(argv[optind]);
+  if (!host)
+  {
+    cerr << "ERROR: Invalid hostname" << endl;
+    exit(1);
+  }
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  memcpy(&server.sin_addr, host->h_addr, host->h_length);
+
+  char dir[] = "/tmp/transportbench.XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    cerr << "ERROR: Could not create a directory for the files" << endl;
+    exit(1);
+  }
+
+  cout << "transport,size,files,run,ok,seconds,goodput_mbps" << endl;
+  mt19937 rng(118);
+  for (size_t s = 0; s < sizes.size(); s++)
+  {
+    string path = string(dir) + "/" + to_string(sizes[s]);
+    ofstream out(path.c_str(), ios::binary);
+    for (long i = 0; i < sizes[s]; i++)
+    {
+      out.put((char) rng());
+    }
+    out.close();
+
+    for (size_t c = 0; c < counts.size(); c++)
+    {
+      for (int run = 1; run <= runs; run++)
+      {
+        for (int t = 0; t < 2; t++)
+        {
+          ConfundoClient client;
+          if (!client.open())
+          {
+            cerr << "ERROR: Socket creation failed" << endl;
+            exit(1);
+          }
+          ConfundoTransport confundo(client, opts);
+          TcpTransport tcp;
+          Transport& transport = t == 0 ? (Transport&) tcp : confundo;
+          double secs = run_once(transport, server, path, counts[c]);
+          double goodput = secs > 0 ?
+            sizes[s] * counts[c] * 8 / secs / 1e6 : 0;
+          cout << transport.name() << "," << sizes[s] << "," << counts[c]
+            << "," << run << "," << (secs >= 0) << "," << fixed
+            << setprecision(6) << max(secs, 0.0) << "," << setprecision(3)
+            << goodput << endl;
+          cout.unsetf(ios::floatfield);
+        }
+      }
+    }
+    unlink(path.c_str());
+  }
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Runs the same workloads over TCP and Confundo on loopback and prints
+# transportbench's CSV: a row per transport, file size, number of files
+# uploaded at once and run.
+#
+# usage: ./transportbench.sh [-s SIZES] [-f FILES] [-n RUNS]
+#                            [-c "CONFUNDO-OPTIONS"] > out.csv
+#
+# Run `make` first; `make compare` runs this with the defaults. Sizes and
+# file counts are comma-separated, and the Confundo options are the
+# client's (-W, -M, -K, -F, -E, -C, -U). Both servers write to a temporary
+# directory that is removed at the end.
+
+SIZES="100000,1000000"
+FILES="1,4"
+RUNS=3
+CONFUNDO_OPTS="-W 8 -M 8192"
+while getopts "s:f:n:c:" opt; do
+  case $opt in
+    s) SIZES="$OPTARG" ;;
+    f) FILES="$OPTARG" ;;
+    n) RUNS="$OPTARG" ;;
+    c) CONFUNDO_OPTS="$OPTARG" ;;
+    *) sed -n '6,7p' "$0" >&2; exit 1 ;;
+  esac
+done
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+for bin in server transportbench; do
+  if [ ! -x "$DIR/$bin" ]; then
+    echo "ERROR: $bin not built, run make" >&2
+    exit 1
+  fi
+done
+
+WORK=$(mktemp -d)
+trap 'kill $UDP_PID $TCP_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+PORT=$((20000 + RANDOM % 10000))
+
+# The server takes its directory relative to where it runs
+cd "$WORK"
+"$DIR/server" "$PORT" udp > /dev/null 2>&1 &
+UDP_PID=$!
+"$DIR/server" -T "$PORT" tcp > /dev/null 2>&1 &
+TCP_PID=$!
+sleep 0.3
+
+"$DIR/transportbench" -s "$SIZES" -f "$FILES" -n "$RUNS" $CONFUNDO_OPTS \
+  127.0.0.1 "$PORT"
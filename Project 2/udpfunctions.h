@@ -1,5 +1,9 @@
+#ifndef UDPFUNCTIONS_H
+#define UDPFUNCTIONS_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -7,12 +11,20 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <thread>
+#include <chrono>
 #include <bits/stdc++.h>
 #include "udpheader.h"
 
 
+// Milliseconds on the monotonic clock
+inline int64_t now_ms()
+{
+  return chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //helper function for sending UDP packet
-void UDPsend(UDPpacket* out_packet, int sockfd, struct sockaddr_in addr, int bytes_to_send=524)
+void UDPsend(UDPpacket* out_packet, int sockfd, struct sockaddr_in addr, int bytes_to_send=sizeof(UDPheader)+DATABUF)
 {
   char* sen=reinterpret_cast<char*> (out_packet);
   int  bytes_sent=0;
@@ -31,3 +43,45 @@ void UDPsend(UDPpacket* out_packet, int sockfd, struct sockaddr_in addr, int byt
     sen+=bytes_sent;
   }
 }
+
+// Send the header of out_packet followed by payload_size bytes at payload.
+// The kernel gathers both pieces, so the payload is not copied in user space.
+// Returns false if the datagram could not be sent; a datagram too large for
+// the path (EMSGSIZE) is not reported as an error.
+bool UDPsendv(UDPpacket* out_packet, const char* payload, size_t payload_size,
+  int sockfd, struct sockaddr_in addr, const char* trailer = NULL,
+  size_t trailer_size = 0)
+{
+  struct iovec iov[3];
+  int n = 1;
+  iov[0].iov_base = out_packet;
+  iov[0].iov_len = out_packet->getheadersize();
+  if (payload_size)
+  {
+    iov[n].iov_base = const_cast<char*>(payload);
+    iov[n++].iov_len = payload_size;
+  }
+  if (trailer_size)
+  {
+    iov[n].iov_base = const_cast<char*>(trailer);
+    iov[n++].iov_len = trailer_size;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  if (sendmsg(sockfd, &msg, 0) < 0)
+  {
+    if (errno != EMSGSIZE)
+    {
+      cerr<<"ERROR in sending";
+    }
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -1,8 +1,17 @@
+#ifndef UDPHEADER_H
+#define UDPHEADER_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
 #define MAXSEQACKNUM 102400
-#define MAXBUF 1024
+#define MAXBUF 1024       // buffer for control packets (no data payload)
+#define MAXDGRAM 65507    // largest UDP payload over IPv4
+#define MAXMSS 65495      // MAXDGRAM less the Confundo header
 #define MAXCWND 51200
 #define INITSSTHRESH 10000
-#define DATABUF 512
+#define DATABUF 512       // default segment size, carried by every path
 #define HEADER 20
 #define SRVR_DEFAULT_SEQ 4321
 #define CLNT_DEFAULT_SEQ 12345
@@ -16,6 +25,10 @@ struct UDPheader
   uint16_t flags;
 };
 
+// A Confundo packet: the header, followed in the same buffer by a payload of
+// whatever size that buffer was made for. Packets are either built in place
+// in a buffer large enough for their payload, or cast onto a received
+// datagram; the object itself is only the header.
 class UDPpacket
 {
   public:
@@ -33,53 +46,125 @@ class UDPpacket
 
       head.flags= a|s|f;
       head.flags=htons(head.flags);
-      memset(payload, 0, sizeof(payload));
+      // Only the bytes actually sent are written; callers that fill the
+      // payload themselves pass NULL and copy into getpayload()
       if (_payload)
       {
-        memcpy(payload, _payload, _payload_size);
+        memcpy(getpayload(), _payload, _payload_size);
       }
     }
     
-    unsigned int getSeq()
+    unsigned int getSeq() const
     {
       return ntohl(head.seqnum);
     }
-    unsigned int getAck()
+    unsigned int getAck() const
     {
       return ntohl(head.acknum);
     }
-     short int getconnID()
+     short int getconnID() const
     {
       return ntohs(head.connId);
     }
-    bool isFin()
+    bool isFin() const
     {
       uint16_t i=1;
       return ntohs(head.flags)&i;
     }
-    bool isSyn()
+    bool isSyn() const
     {
       uint16_t i=1<<1;
       return ntohs(head.flags)&i;
     }
-    bool isAck()
+    bool isAck() const
     {
       uint16_t i=1<<2;
       return ntohs(head.flags)&i;
     }
-    char* getpayload()
+    // The payload starts with an option block (see options.h)
+    bool hasOpt() const
+    {
+      uint16_t i=1<<3;
+      return ntohs(head.flags)&i;
+    }
+    void setOpt()
+    {
+      head.flags=htons(ntohs(head.flags)|(1<<3));
+    }
+    // Padding-only path MTU probe (see pmtud.h)
+    bool isProbe() const
+    {
+      uint16_t i=1<<4;
+      return ntohs(head.flags)&i;
+    }
+    void setProbe()
+    {
+      head.flags=htons(ntohs(head.flags)|(1<<4));
+    }
+    // The sender waits for this segment's ACK, so it must not be delayed
+    bool isImmediate() const
+    {
+      uint16_t i=1<<5;
+      return ntohs(head.flags)&i;
+    }
+    void setImmediate()
+    {
+      head.flags=htons(ntohs(head.flags)|(1<<5));
+    }
+    // The header is followed by the receiver's window: 4 bytes, the payload
+    // bytes past the ACK number it can take
+    bool hasWindow() const
+    {
+      uint16_t i=1<<6;
+      return ntohs(head.flags)&i;
+    }
+    void setWindow()
+    {
+      head.flags=htons(ntohs(head.flags)|(1<<6));
+    }
+    // Part of a forward error correction block (see fec.h): the ACK field
+    // holds the sequence number the block starts at
+    bool isFec() const
+    {
+      uint16_t i=1<<7;
+      return ntohs(head.flags)&i;
+    }
+    void setFec()
     {
-      return payload;
+      head.flags=htons(ntohs(head.flags)|(1<<7));
+    }
+    // The parity of a block that starts at the sequence number and ends at
+    // the ACK number
+    bool isParity() const
+    {
+      uint16_t i=1<<8;
+      return ntohs(head.flags)&i;
     }
-    int getsize()
+    void setParity()
     {
-      return sizeof(head) + sizeof(payload);
+      head.flags=htons(ntohs(head.flags)|(1<<8));
     }
-    int getheadersize()
+    // The payload ends with a CRC32C of the header and the rest of the
+    // payload (see crc32c.h); the FIN's ACK field holds that of the file
+    bool isCrc() const
+    {
+      uint16_t i=1<<9;
+      return ntohs(head.flags)&i;
+    }
+    void setCrc()
+    {
+      head.flags=htons(ntohs(head.flags)|(1<<9));
+    }
+    char* getpayload()
+    {
+      return reinterpret_cast<char*>(this) + sizeof(head);
+    }
+    int getheadersize() const
     {
       return sizeof(head);
     }
   private:
     UDPheader head;
-    char payload[DATABUF];
 };
+
+#endif